@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define DATA_CHUNK_SIZE 1048576 // Bytes written at a time to the pipeline input file
+
+#define SOAK_SAMPLES 10           // RSS samples taken during a soak
+#define SOAK_EXTERNAL_EVERY 100   // A soak runs external commands every this many lines
+#define SOAK_LONG_EVERY 10007     // and a very long line every this many
+#define SOAK_LONG_CMDS 5000       // Commands on that line
+#define SOAK_MAX_GROWTH_KB 256    // RSS growth over a soak that counts as a leak
+
+// What one run of smash cost
+struct result
+{
+    double secs;    // Wall-clock time
+    long maxrss_kb; // Largest resident set size of smash itself
+};
+
+// Options given on the command line
+static const char *smash = "./smash"; // The shell being measured
+static int scale = 1;                 // Multiplies the size of every benchmark
+static int repeats = 3;               // Runs of each benchmark, of which the fastest counts
+static long soak_commands = 0;        // Commands to run in one session instead of benchmarking, if not 0
+static char dir[] = "/tmp/smash-bench-XXXXXX"; // Where the generated scripts and data go
+
+int run_smash(const char *script, int as_stdin, struct result *res);
+int best_of(const char *script, struct result *res);
+int write_script(const char *name, const char *line, long count);
+int write_data(const char *name, long size);
+char *path_in_dir(const char *name);
+void cleanup(void);
+double bench_spawn(void);
+double bench_loop(void);
+double bench_pipeline(int stages, long size);
+double bench_parse(void);
+int bench_rss(long *short_kb, long *long_kb);
+long read_rss(pid_t pid);
+int soak(long commands);
+
+/**
+ * Benchmark harness for smash.
+ * Usage: bench [-n scale] [-r repeats] [-s commands] [path/to/smash]
+ * Generates scripts that each stress one part of the shell, runs smash on them
+ * and prints the results as one JSON object on standard output, so they can be
+ * compared between versions.
+ * With -s, it instead runs that many commands in one long session and checks
+ * that smash's memory use stays flat (see soak()).
+ */
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:")) != -1)
+    {
+        if (opt == 'n' && (scale = atoi(optarg)) >= 1)
+        {
+            continue;
+        }
+        if (opt == 'r' && (repeats = atoi(optarg)) >= 1)
+        {
+            continue;
+        }
+        if (opt == 's' && (soak_commands = atol(optarg)) >= SOAK_SAMPLES)
+        {
+            continue;
+        }
+        fprintf(stderr, "usage: %s [-n scale] [-r repeats] [-s commands] [path/to/smash]\n", argv[0]);
+        exit(2);
+    }
+    if (optind < argc)
+    {
+        smash = argv[optind];
+    }
+    if (access(smash, X_OK) == -1 || mkdtemp(dir) == NULL)
+    {
+        perror(smash);
+        exit(1);
+    }
+    atexit(cleanup);
+
+    if (soak_commands > 0)
+    {
+        int ret = soak(soak_commands);
+        if (ret == -1)
+        {
+            perror("bench");
+        }
+        exit(ret == 0 ? 0 : 1);
+    }
+
+    long pipe_size = 64L * 1048576 * scale;
+    double spawn = bench_spawn();
+    double loop = bench_loop();
+    double pipe2 = bench_pipeline(2, pipe_size);
+    double pipe4 = bench_pipeline(4, pipe_size);
+    double pipe8 = bench_pipeline(8, pipe_size);
+    double parse = bench_parse();
+    long short_kb, long_kb;
+    if (spawn < 0 || loop < 0 || pipe2 < 0 || pipe4 < 0 || pipe8 < 0 || parse < 0 ||
+        bench_rss(&short_kb, &long_kb) == -1)
+    {
+        perror("bench");
+        exit(1);
+    }
+
+    printf("{\n");
+    printf("  \"smash\": \"%s\",\n", smash);
+    printf("  \"scale\": %d,\n", scale);
+    printf("  \"spawn_latency_us\": %.2f,\n", spawn);
+    printf("  \"loop_cmds_per_sec\": %.0f,\n", loop);
+    printf("  \"pipeline_mb_per_sec\": {\"2\": %.1f, \"4\": %.1f, \"8\": %.1f},\n", pipe2, pipe4, pipe8);
+    printf("  \"parse_lines_per_sec\": %.0f,\n", parse);
+    printf("  \"rss_kb\": {\"short\": %ld, \"long\": %ld, \"growth\": %ld}\n", short_kb, long_kb, long_kb - short_kb);
+    printf("}\n");
+    return 0;
+}
+
+/**
+ * Function: run_smash
+ * -------------------
+ * Runs smash on a script, with its output (and time reports) thrown away, and measures it
+ *
+ * script: the script to run
+ *
+ * as_stdin: 1 to feed the script to smash on its standard input, 0 to give its name to smash
+ *
+ * res: set to the wall-clock time and max RSS of the run
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_smash(const char *script, int as_stdin, struct result *res)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (as_stdin)
+        {
+            int in = open(script, O_RDONLY);
+            if (in == -1 || dup2(in, STDIN_FILENO) == -1)
+            {
+                _exit(127);
+            }
+            execl(smash, smash, (char *)NULL);
+        }
+        execl(smash, smash, script, (char *)NULL);
+        _exit(127);
+    }
+    if (pid == -1)
+    {
+        return -1;
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1)
+    {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+    {
+        errno = ECHILD;
+        return -1;
+    }
+    res->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    res->maxrss_kb = ru.ru_maxrss;
+    return 0;
+}
+
+/**
+ * Function: best_of
+ * -----------------
+ * Runs smash on a script repeats times and keeps the fastest run,
+ * which is the one least disturbed by everything else on the machine
+ *
+ * script: the script to run
+ *
+ * res: set to the result of the fastest run
+ *
+ * return: -1 on failure, 0 on success
+ */
+int best_of(const char *script, struct result *res)
+{
+    res->secs = 0;
+    res->maxrss_kb = 0;
+    for (int i = 0; i < repeats; i++)
+    {
+        struct result r;
+        if (run_smash(script, 0, &r) == -1)
+        {
+            return -1;
+        }
+        if (i == 0 || r.secs < res->secs)
+        {
+            *res = r;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: write_script
+ * ----------------------
+ * Generates a script in the benchmark directory that repeats one line
+ *
+ * name: the file name of the script
+ *
+ * line: the line, without its newline
+ *
+ * count: how many times it is repeated
+ *
+ * return: -1 on failure, 0 on success
+ */
+int write_script(const char *name, const char *line, long count)
+{
+    char *path = path_in_dir(name);
+    FILE *f = fopen(path, "w");
+    free(path);
+    if (f == NULL)
+    {
+        return -1;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        fprintf(f, "%s\n", line);
+    }
+    return fclose(f) == EOF ? -1 : 0;
+}
+
+/**
+ * Function: write_data
+ * --------------------
+ * Generates a file of text in the benchmark directory for the pipelines to copy
+ *
+ * name: the file name
+ *
+ * size: its size in bytes
+ *
+ * return: -1 on failure, 0 on success
+ */
+int write_data(const char *name, long size)
+{
+    char *buf = malloc(DATA_CHUNK_SIZE);
+    char *path = path_in_dir(name);
+    int fd = path == NULL ? -1 : open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    free(path);
+    if (buf == NULL || fd == -1)
+    {
+        free(buf);
+        return -1;
+    }
+    for (int i = 0; i < DATA_CHUNK_SIZE; i++)
+    {
+        buf[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+    }
+    for (long done = 0; done < size; done += DATA_CHUNK_SIZE)
+    {
+        size_t n = size - done < DATA_CHUNK_SIZE ? size - done : DATA_CHUNK_SIZE;
+        if (write(fd, buf, n) != (ssize_t)n)
+        {
+            close(fd);
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return close(fd);
+}
+
+/**
+ * Function: path_in_dir
+ * ---------------------
+ * Builds the path of a file in the benchmark directory
+ *
+ * name: the file name
+ *
+ * return: the path, which the caller frees, or NULL on failure
+ */
+char *path_in_dir(const char *name)
+{
+    char *path;
+    if (asprintf(&path, "%s/%s", dir, name) == -1)
+    {
+        return NULL;
+    }
+    return path;
+}
+
+/**
+ * Function: cleanup
+ * -----------------
+ * Removes the benchmark directory and everything generated in it, at exit
+ */
+void cleanup(void)
+{
+    const char *names[] = {"empty", "spawn", "loop", "data", "pipe", "parse", "short", "long"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        char *path = path_in_dir(names[i]);
+        if (path != NULL)
+        {
+            unlink(path);
+            free(path);
+        }
+    }
+    rmdir(dir);
+}
+
+/**
+ * Function: bench_spawn
+ * ---------------------
+ * Measures what it costs smash to start one command and wait for it,
+ * from a script of /bin/true lines, minus the cost of starting smash itself
+ *
+ * return: microseconds per command, or -1 on failure
+ */
+double bench_spawn(void)
+{
+    long count = 2000L * scale;
+    struct result empty, res;
+    char *empty_path = path_in_dir("empty");
+    char *path = path_in_dir("spawn");
+    int ret = path == NULL || empty_path == NULL || write_script("empty", "", 0) == -1 ||
+              write_script("spawn", "/bin/true", count) == -1 || best_of(empty_path, &empty) == -1 ||
+              best_of(path, &res) == -1;
+    free(empty_path);
+    free(path);
+    return ret ? -1 : (res.secs - empty.secs) / count * 1e6;
+}
+
+/**
+ * Function: bench_loop
+ * --------------------
+ * Measures how many commands "loop n /bin/true" gets through in a second
+ *
+ * return: commands per second, or -1 on failure
+ */
+double bench_loop(void)
+{
+    long count = 5000L * scale;
+    char line[64];
+    snprintf(line, sizeof(line), "loop %ld /bin/true", count);
+    struct result res;
+    char *path = path_in_dir("loop");
+    int ret = path == NULL || write_script("loop", line, 1) == -1 || best_of(path, &res) == -1;
+    free(path);
+    return ret ? -1 : count / res.secs;
+}
+
+/**
+ * Function: bench_pipeline
+ * ------------------------
+ * Measures how fast data flows through a pipeline of cat commands
+ *
+ * stages: the number of stages of the pipeline
+ *
+ * size: bytes pushed through the pipeline
+ *
+ * return: MB (2^20 bytes) per second, or -1 on failure
+ */
+double bench_pipeline(int stages, long size)
+{
+    char *data = path_in_dir("data");
+    struct stat st;
+    if (data == NULL || ((stat(data, &st) == -1 || st.st_size != size) && write_data("data", size) == -1))
+    {
+        free(data);
+        return -1;
+    }
+
+    // cat data | cat | ... | cat > /dev/null
+    size_t len = strlen(data) + 32 + stages * 6;
+    char *line = malloc(len);
+    char *path = path_in_dir("pipe");
+    if (line == NULL || path == NULL)
+    {
+        free(data);
+        free(line);
+        free(path);
+        return -1;
+    }
+    int n = snprintf(line, len, "cat %s", data);
+    for (int i = 1; i < stages; i++)
+    {
+        n += snprintf(line + n, len - n, " | cat");
+    }
+    snprintf(line + n, len - n, " > /dev/null");
+
+    struct result res;
+    int ret = write_script("pipe", line, 1) == -1 || best_of(path, &res) == -1;
+    free(data);
+    free(line);
+    free(path);
+    return ret ? -1 : size / 1048576.0 / res.secs;
+}
+
+/**
+ * Function: bench_parse
+ * ---------------------
+ * Measures how many lines smash gets through in a second when every line
+ * holds many short built-in commands separated with ";", so that reading,
+ * parsing and checking the lines is most of the work
+ *
+ * return: lines per second, or -1 on failure
+ */
+double bench_parse(void)
+{
+    long count = 20000L * scale;
+    char line[32 * 8 + 1] = "";
+    for (int i = 0; i < 32; i++)
+    {
+        strcat(line, i == 0 ? "cd ." : " ; cd .");
+    }
+    struct result res;
+    char *path = path_in_dir("parse");
+    int ret = path == NULL || write_script("parse", line, count) == -1 || best_of(path, &res) == -1;
+    free(path);
+    return ret ? -1 : count / res.secs;
+}
+
+/**
+ * Function: bench_rss
+ * -------------------
+ * Measures how much memory smash holds on to over a long session,
+ * by comparing its max RSS after a short and a long script of the same lines.
+ * The scripts are fed to standard input, which smash reads a chunk at a time,
+ * so pages of a mapped script don't count towards its RSS.
+ *
+ * short_kb: set to the max RSS after 1000 lines
+ *
+ * long_kb: set to the max RSS after 200000 lines (times the scale)
+ *
+ * return: -1 on failure, 0 on success
+ */
+int bench_rss(long *short_kb, long *long_kb)
+{
+    const char *line = "cd . ; loop 3 cd . ; hash ; jobs ; time cd . ; cd /tmp ; cd .";
+    struct result short_res, long_res;
+    char *short_path = path_in_dir("short");
+    char *long_path = path_in_dir("long");
+    int ret = short_path == NULL || long_path == NULL || write_script("short", line, 1000) == -1 ||
+              write_script("long", line, 200000L * scale) == -1 || run_smash(short_path, 1, &short_res) == -1 ||
+              run_smash(long_path, 1, &long_res) == -1;
+    free(short_path);
+    free(long_path);
+    if (ret)
+    {
+        return -1;
+    }
+    *short_kb = short_res.maxrss_kb;
+    *long_kb = long_res.maxrss_kb;
+    return 0;
+}
+
+/**
+ * Function: read_rss
+ * ------------------
+ * Reads the current resident set size of a running process
+ *
+ * pid: the process
+ *
+ * return: its RSS in kB, or -1 on failure
+ */
+long read_rss(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/**
+ * Function: soak
+ * --------------
+ * Keeps one smash session running for a given number of commands, writing
+ * them to its standard input as it goes, and samples its RSS every tenth of
+ * the way, once smash has caught up: it runs "cd dir ; pwd" and the sample is
+ * taken when the benchmark directory comes out of its standard output.
+ * Most lines hold built-in commands; every SOAK_EXTERNAL_EVERY lines a
+ * pipeline and a background job run, and every SOAK_LONG_EVERY lines comes a
+ * line of SOAK_LONG_CMDS commands, bigger than the shell's usual buffers.
+ * Prints the samples as JSON.
+ *
+ * commands: how many commands to run
+ *
+ * return: 0 if the RSS stayed within SOAK_MAX_GROWTH_KB of the first sample,
+ *         1 if it grew more, -1 on failure
+ */
+int soak(long commands)
+{
+    int in[2], out[2];
+    if (pipe(in) == -1)
+    {
+        return -1;
+    }
+    if (pipe(out) == -1)
+    {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDERR_FILENO);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+
+        // As a script, so there are no prompts on standard output
+        execl(smash, smash, "/dev/stdin", (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    FILE *f = pid == -1 ? NULL : fdopen(in[1], "w");
+    FILE *reply = pid == -1 ? NULL : fdopen(out[0], "r");
+    if (f == NULL || reply == NULL)
+    {
+        f == NULL ? close(in[1]) : fclose(f);
+        reply == NULL ? close(out[0]) : fclose(reply);
+        return -1;
+    }
+
+    // Lines of built-in commands, with how many commands each holds
+    // Nothing but the checkpoints may write to standard output, which is only read then
+    const char *line = "cd . ; loop 3 cd . ; hash > /dev/null ; jobs ; time cd . ; pipesize 64k ; cd /tmp ; cd .";
+    const long line_cmds = 8;
+    const char *external = "/bin/true | cat > /dev/null ; /bin/true & wait";
+    const long external_cmds = 4;
+
+    long rss[SOAK_SAMPLES];
+    long done = 0;
+    long lines = 0;
+    int ret = 0;
+    for (int i = 0; i < SOAK_SAMPLES && ret == 0; i++)
+    {
+        long target = commands / SOAK_SAMPLES * (i + 1);
+        while (done < target)
+        {
+            lines++;
+            if (lines % SOAK_LONG_EVERY == 0)
+            {
+                for (int j = 0; j < SOAK_LONG_CMDS; j++)
+                {
+                    fputs(j == 0 ? "cd ." : " ; cd .", f);
+                }
+                fputc('\n', f);
+                done += SOAK_LONG_CMDS;
+            }
+            else if (lines % SOAK_EXTERNAL_EVERY == 0)
+            {
+                fprintf(f, "%s\n", external);
+                done += external_cmds;
+            }
+            else
+            {
+                fprintf(f, "%s\n", line);
+                done += line_cmds;
+            }
+        }
+
+        // Wait for smash to get here
+        char buf[sizeof(dir) + 2];
+        fprintf(f, "cd %s ; pwd ; cd /tmp\n", dir);
+        if (fflush(f) == EOF || fgets(buf, sizeof(buf), reply) == NULL || strncmp(buf, dir, strlen(dir)) != 0 ||
+            (rss[i] = read_rss(pid)) == -1)
+        {
+            ret = -1;
+        }
+    }
+    fputs("exit\n", f);
+    fclose(f);
+    fclose(reply);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127 || ret == -1)
+    {
+        return -1;
+    }
+
+    long growth = rss[SOAK_SAMPLES - 1] - rss[0];
+    printf("{\n");
+    printf("  \"smash\": \"%s\",\n", smash);
+    printf("  \"soak_commands\": %ld,\n", done);
+    printf("  \"rss_kb\": [");
+    for (int i = 0; i < SOAK_SAMPLES; i++)
+    {
+        printf(i == 0 ? "%ld" : ", %ld", rss[i]);
+    }
+    printf("],\n");
+    printf("  \"rss_growth_kb\": %ld\n", growth);
+    printf("}\n");
+    return growth > SOAK_MAX_GROWTH_KB;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,1054 +8,9542 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <linux/ioprio.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+
+// File actions per child: two dup2()s, the open()s of /dev/null and the two redirections,
+// a setpgid(), the scheduling settings and the limits
+#define MAX_SPAWN_ACTIONS 8
+#define MAX_CPUS 65536 // Highest CPU number an affinity list may name, plus one
+
+// Scheduling settings a pipeline stage starts with, from its affinity, nice and ioprio prefixes
+struct stage_sched
+{
+    cpu_set_t *cpus;  // CPUs the stage may run on, or NULL to keep the shell's
+    size_t cpus_size; // Size of cpus in bytes, for sched_setaffinity()
+    int nice;         // Added to the niceness, 0 to keep it
+    int ioprio;       // I/O priority for ioprio_set(), -1 to keep it
+};
+
+#define NUM_RLIMITS 4 // Resources the limit built-in can cap with setrlimit(), see limit_resources
+
+// Caps the limit built-in puts on every process of a job
+struct job_limits
+{
+    rlim_t rlimits[NUM_RLIMITS]; // Caps on the resources in limit_resources, RLIM_INFINITY where none was given
+    long long memory_max;        // memory.max of the job's cgroup in bytes (-m), 0 for no cap
+    double cpus;                 // cpu.max of the job's cgroup in CPUs (-c), 0 for no cap
+    int cgroup_fd;               // The job's cgroup directory, or -1 if it isn't given one
+};
+
+// Types of file actions performed in a child between vfork() and execv()
+enum spawn_action_type
+{
+    SPAWN_DUP2,
+    SPAWN_CLOSE,
+    SPAWN_OPEN,
+    SPAWN_SETPGID,
+    SPAWN_SCHED,
+    SPAWN_LIMITS
+};
+
+// A single file action, performed in the child in the order it was added
+struct spawn_action
+{
+    enum spawn_action_type type;
+    int fd;           // The descriptor in the child being set up or closed; SPAWN_SETPGID: the group, 0 for a new one
+    int src_fd;       // SPAWN_DUP2: the descriptor duplicated onto fd
+    const char *path; // SPAWN_OPEN: the file opened onto fd
+    int flags;        // SPAWN_OPEN: flags for open()
+    mode_t mode;      // SPAWN_OPEN: mode for open()
+    struct timespec start, end; // SPAWN_OPEN: when the child called open() and when it returned, if tracing
+    const struct stage_sched *sched; // SPAWN_SCHED: the settings applied
+    const struct job_limits *limits; // SPAWN_LIMITS: the caps applied
+};
+
+// Everything the launcher needs to start one child process
+struct spawn_req
+{
+    const char *path;
+    char **argv;
+    char **envp; // The environment, set by whoever execs the binary (see var_environ())
+    struct spawn_action actions[MAX_SPAWN_ACTIONS];
+    int num_actions;
+};
+
+#define FORKSERVER_MAX_REQ 65536                     // Largest request for the fork server; bigger ones don't use it
+#define FORKSERVER_MAX_FDS (MAX_SPAWN_ACTIONS + 1)   // Descriptors passed per request: one per action, and the cwd
+#define FORKSERVER_STACK_SIZE 65536                  // Stack the fork server's children run on until they exec
+
+// Start of a request to the fork server, followed by the actions and the strings
+struct forkserver_hdr
+{
+    int argc;
+    int num_actions;
+    int num_fds; // Descriptors passed with SCM_RIGHTS
+    int chdir;   // 1 if the last descriptor is the shell's new working directory
+    int envc;    // Environment strings following the others, -1 if the server's is up to date
+};
+
+// A file action as sent to the fork server
+struct forkserver_action
+{
+    int type;   // An enum spawn_action_type
+    int fd;     // SPAWN_SCHED: the niceness increment
+    int src;    // SPAWN_DUP2: index of the descriptor to duplicate among the ones passed;
+                // SPAWN_LIMITS: index of the cgroup directory, -1 for none (the caps go with the strings)
+    int flags;  // SPAWN_SCHED: the I/O priority
+    mode_t mode; // SPAWN_SCHED: the size of the CPU mask, which goes with the strings (0 for none)
+};
+
+// The fork server's answer to a request
+struct forkserver_reply
+{
+    pid_t pid; // The child, or -1 if it couldn't be created
+    int err;   // errno of the failure, 0 if the child got to execv()
+};
+
+// A request being served, shared between the fork server and its child until the child execs
+struct forkserver_child
+{
+    struct spawn_req req;
+    const struct sigaction *old_int;  // Dispositions the child gets back
+    const struct sigaction *old_quit;
+    struct stage_sched sched; // Where a SPAWN_SCHED action's settings are rebuilt
+    struct job_limits limits; // Where a SPAWN_LIMITS action's caps are rebuilt
+    int err;
+};
+
+#define ARENA_CHUNK_SIZE 4096 // Default size of the memory blocks an arena hands out memory from
+
+// A block of memory owned by an arena
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size; // Bytes available in data
+    size_t used; // Bytes handed out so far
+    max_align_t data[];
+};
+
+// Bump allocator for everything that lives as long as one input line
+struct arena
+{
+    struct arena_chunk *head; // The chunk currently being allocated from
+};
+
+// Types of redirection
+enum redir_type
+{
+    REDIR_OUT,    // > file
+    REDIR_APPEND, // >> file
+    REDIR_IN      // < file
+};
+
+// A redirection attached to a simple command
+struct redir
+{
+    enum redir_type type;
+    char *target;
+    struct redir *next;
+};
+
+// A simple command: one stage of a pipeline
+struct command
+{
+    char **argv; // NULL-terminated, ready for execv()
+    int argc;
+    struct redir *redirs;
+    struct command *next; // The next stage of the pipeline
+};
+
+// Commands connected with "|"
+struct pipeline
+{
+    struct command *cmds;
+    int num_cmds;
+    int background;        // 1 if the pipeline ended with "&"
+    int expand;            // 1 if any of its words has a "$" in it or is a pattern, see expand_pipeline()
+    char *text;            // The pipeline as it was typed, for the jobs built-in
+    struct pipeline *next; // The next pipeline of the list
+};
+
+// Pipelines separated with ";" or "&", which run one after another
+struct cmd_list
+{
+    struct pipeline *pipelines;
+    int num_pipelines;
+};
+
+#define PROMPT "smash> " // Printed before each line read interactively
+#define INPUT_CHUNK_SIZE 65536 // Bytes read at a time from a script or standard input
+#define COPY_CHUNK_SIZE 1048576 // Bytes copied at a time by copy_fd()
+#define PROC_MIN_SLOTS 64        // Initial size of the table of children
+#define WAIT_EVENTS 64           // Events taken from epoll at a time by wait_children()
+#define TRACE_BUFFER_SIZE 65536  // Bytes of trace events buffered before they are written out
+#define HISTORY_MAGIC "smashhi1" // First bytes of a history index
+#define HISTORY_SCAN_SIZE 16384  // Bytes of the history log read at a time when indexing it
+
+// Start of the history index file, followed by the offset in the log of each entry, in order
+struct history_index
+{
+    char magic[8];     // HISTORY_MAGIC
+    uint64_t log_size; // Bytes of the log the entries cover, always whole lines
+};
+
+#define EDIT_MIN_SIZE 256        // Initial size of the line editor's buffer
+#define EDIT_ESCAPE_MS 50        // How long the line editor waits for the rest of an escape sequence
+#define EDIT_SEARCH_MAX 256      // Longest string the line editor's reverse search looks for
+#define COMPLETE_ASK 100         // Completions listed without asking first
+#define TRIE_MIN_NODES 1024      // Initial size of the trie of commands
+#define DIR_CACHE_SLOTS 8        // Directory listings kept for completing file names
+#define CTRL_KEY(c) ((c) & 0x1f) // The byte a control key sends
+
+// Keys the line editor reads as escape sequences, numbered after the bytes
+enum edit_key
+{
+    KEY_NONE = 256, // A sequence the editor doesn't know
+    KEY_EOF,        // The terminal went away
+    KEY_ESCAPE,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE
+};
+
+// The state of the line editor, which reads the lines typed at a terminal
+struct line_editor
+{
+    char *buf;             // The line, NUL-terminated
+    size_t size;           // Capacity of buf
+    size_t len;            // Bytes in the line
+    size_t pos;            // Where the cursor is
+    size_t scroll;         // First byte shown when the line is wider than the terminal
+    size_t hist;           // The history entry shown, history_count for the line being typed
+    char *saved;           // The line being typed, kept while browsing the history
+    size_t saved_len;
+    struct termios cooked; // The terminal's own settings, put back while commands run
+};
+
+// A node of the trie of commands completed by the line editor, see trie_add()
+struct trie_node
+{
+    uint32_t child;   // First child, 0 for none (node 0 is the root, which is no node's child)
+    uint32_t sibling; // Next child of the same parent, in byte order, 0 for none
+    uint32_t count;   // Directories (and the builtins) having the command that ends here
+    uint32_t words;   // Commands ending in this subtree, this node included
+    unsigned char c;  // The byte this node adds to its parent's prefix
+};
+
+// A directory in PATH, with the executables the trie of commands has from it
+struct trie_dir
+{
+    char *dir;
+    struct timespec mtime; // When the executables were read, {-1, -1} before they are
+    char *names;           // The executables, each NUL-terminated
+    size_t names_len;      // Bytes used in names
+    size_t names_size;     // Capacity of names
+    size_t num_names;
+};
+
+// A directory listing kept for completing file names
+struct dir_listing
+{
+    char *dir;             // The directory as typed ("" for the working one), NULL for an empty slot
+    dev_t dev;             // The directory listed, which a relative one changes to after cd
+    ino_t ino;
+    struct timespec mtime; // When it was listed
+    char **names;          // Hidden names first, each part sorted; directories have a "/" added
+    size_t count;
+    size_t hidden;         // Names starting with "."
+    char *block;           // The memory holding the names
+    unsigned long used;    // When it was last used, to replace the least recently used one
+};
+
+// Where the lines of input come from
+struct input
+{
+    int fd;       // The file descriptor read from, or -1 when the whole input is in memory
+    char *buf;    // Data read but not yet handed out (or the whole input)
+    size_t size;  // Capacity of buf
+    size_t start; // Offset of the next line in buf
+    size_t end;   // Offset of the end of the data in buf
+};
+
+// Built-in commands
+enum builtin_id
+{
+    BUILTIN_NONE,
+    BUILTIN_EXIT,
+    BUILTIN_CD,
+    BUILTIN_PWD,
+    BUILTIN_HASH,
+    BUILTIN_LOOP,
+    BUILTIN_JOBS,
+    BUILTIN_WAIT,
+    BUILTIN_TIME,
+    BUILTIN_CAT,
+    BUILTIN_PIPESIZE,
+    BUILTIN_PIPESTAT,
+    BUILTIN_TIMEOUT,
+    BUILTIN_AFFINITY,
+    BUILTIN_NICE,
+    BUILTIN_IOPRIO,
+    BUILTIN_LIMIT,
+    BUILTIN_HISTORY,
+    BUILTIN_EXPORT,
+    BUILTIN_UNSET,
+    BUILTIN_ASSIGN // NAME=value, which isn't in the builtins table
+};
+
+#define BUILTIN_SLOTS 32 // Size of the builtins table, a power of two
+
+// An entry of the builtins table
+struct builtin
+{
+    const char *name; // NULL for an empty slot
+    enum builtin_id id;
+    int min_args;     // Including the command name
+    int max_args;     // Including the command name, -1 for no limit
+    int in_process;   // 1 if it only prints (hash without arguments), so it can run in the shell as a pipeline stage
+};
+
+// What the pipes of the last pipeline got, for the pipestat built-in
+struct pipe_stats
+{
+    int num_pipes;
+    int min_size;    // Smallest and largest size in bytes, after the kernel rounded them
+    int max_size;
+    int num_refused; // Pipes for which F_SETPIPE_SZ failed
+};
+
+// Ways copy_fd() moves data, from the cheapest
+enum copy_method
+{
+    COPY_FILE_RANGE, // copy_file_range(), between regular files
+    COPY_SPLICE,     // splice(), to or from a pipe
+    COPY_SENDFILE,   // sendfile(), from a regular file
+    COPY_READ_WRITE  // Through a buffer
+};
+
+// Ways a compiled pipeline is run
+enum plan_type
+{
+    PLAN_EXEC,    // External commands
+    PLAN_BUILTIN, // A built-in command other than loop
+    PLAN_LOOP,    // loop n, repeating another plan
+    PLAN_TIME,    // time, measuring another plan
+    PLAN_TIMEOUT, // timeout, running another plan with a deadline
+    PLAN_LIMIT    // limit, running another plan with caps on its resources
+};
+
+// A pipeline stage with its binary already looked up
+struct plan_stage
+{
+    const char *path; // The binary to execute, NULL if it wasn't found
+    int error;        // errno from the lookup when path is NULL
+    char **argv;
+    struct redir *redirs;
+    enum builtin_id builtin; // The built-in command the stage runs, or BUILTIN_NONE
+    struct plan *plan;       // Built-in commands: the stage compiled on its own
+    struct stage_sched *sched; // Settings from the stage's affinity, nice and ioprio prefixes, or NULL
+};
+
+// A pipeline compiled once, which can then be run any number of times
+struct plan
+{
+    enum plan_type type;
+    enum builtin_id builtin;   // PLAN_BUILTIN: which built-in command
+    struct command *cmd;       // PLAN_BUILTIN: the command it runs with
+    struct plan_stage *stages; // PLAN_EXEC: the stages, in order
+    int num_stages;
+    int count;                 // PLAN_LOOP: number of iterations
+    int jobs;                  // PLAN_LOOP: iterations allowed to run at once (-j)
+    int buffered;              // PLAN_LOOP: 1 to hold each iteration's output until it is done (-b)
+    struct plan *body;         // PLAN_LOOP, PLAN_TIME, PLAN_TIMEOUT, PLAN_LIMIT: the plan repeated, measured or run
+    double timeout;            // PLAN_TIMEOUT: seconds before the signal is sent, 0 for never
+    double kill_after;         // PLAN_TIMEOUT: seconds after that before SIGKILL is sent, 0 for never
+    int signal;                // PLAN_TIMEOUT: the signal
+    struct job_limits *limits; // PLAN_LIMIT: the caps
+    int held_out;              // Output redirection target held open by an enclosing loop, or -1
+    const struct stage_sched *sched; // A built-in stage's prefixes, applied by the subshell running it, or NULL
+};
+
+// Resource usage of one stage of a pipeline run by the time built-in
+struct stage_usage
+{
+    int stage;             // Index of the stage in the plan, -1 if no more stages started
+    struct timespec start; // When it was spawned
+    struct timespec end;   // When it was reaped
+    struct rusage ru;      // As reported by wait4()
+};
+
+// Wall-clock times of the iterations of a loop run by the time built-in
+struct loop_samples
+{
+    double *secs; // In the order the iterations finished, with room for every iteration
+    int num;
+};
+
+// The processes of a pipeline that has been started
+struct job
+{
+    pid_t *pids;    // The stages that were started, with room for every stage
+    int num_pids;
+    int num_live;   // Stages not reaped yet, counted down by reap_child()
+    pid_t last_pid; // The last stage, whose exit status is the job's, or -1 if it didn't start
+    int status;     // Exit status, valid once num_live is 0
+    int out_fd;     // Where loop -b buffers the output, or -1
+    int id;         // Job number of a background job, 0 for a foreground one
+    char *text;     // Background jobs: the command line, for the jobs built-in
+    struct stage_usage *usage; // Filled in for each started stage when timed, or NULL
+    int fork_builtins;         // 1 if the shell won't wait for the job right away or times each stage,
+                               // so no stage may run in it
+    pid_t pgid;                // Process group of the job's processes: -1 for the shell's, 0 for a new one
+                               // (which becomes the pid of the first process started)
+    const struct job_limits *limits; // Caps every process of the job starts with, or NULL
+};
+
+// A timeout command's timer, watched by wait_children()
+struct deadline
+{
+    int fd;                // The timerfd
+    int fired;             // Times it ran out, counted by wait_children()
+    struct deadline *next; // The deadline of an enclosing timeout command
+};
+
+// An entry of the table mapping the pid of every running child to its job
+struct proc_slot
+{
+    pid_t pid; // 0 for an empty slot
+    int pidfd; // Watched by events_fd, or -1 when SIGCHLD is watched instead
+    struct job *job;
+};
+
+// State kept by parse_line() while it scans a line
+struct parser
+{
+    struct arena *arena;
+    struct cmd_list *list;
+    struct pipeline *pl;          // The pipeline being built, NULL until its first stage ends
+    struct command **cmd_tail;    // Where the next stage of pl is linked in
+    struct pipeline **pl_tail;    // Where the next pipeline of list is linked in
+    struct redir *redirs;         // Redirections of the command being built
+    struct redir **redir_tail;    // Where its next redirection is linked in
+    int want_target;              // 1 right after a redirection operator
+    enum redir_type want_type;    // The type of that redirection
+    const char *text_start;       // Where the text of the pipeline being built starts
+    int expand;                   // 1 once a word of the pipeline being built has a "$" in it or is a pattern
+};
+
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin" // Used when PATH is not set
+#define PATH_CACHE_MIN_SLOTS 64                      // Initial size of the command-location table
+#define GLOB_DENTS_SIZE (256 * 1024)                 // Bytes of directory entries read at a time while globbing
+
+// A remembered command location (see the hash built-in)
+struct path_cache_entry
+{
+    char *name; // The command as typed, NULL for an empty slot
+    char *path; // Where it was found in PATH
+    unsigned long hits;
+};
+
+// A directory in PATH, along with its mtime when the cache was last validated
+struct path_dir
+{
+    char *dir;
+    struct timespec mtime;
+};
+
+// Command-location cache, an open-addressing table with a power-of-two size
+static struct path_cache_entry *path_cache = NULL;
+static size_t path_cache_slots = 0;
+static size_t path_cache_used = 0;
+static char *path_cache_env = NULL; // The PATH the directory list was built from
+static unsigned long path_cache_line = 0; // The line the directories were last checked on
+static struct path_dir *path_dirs = NULL;
+static int num_path_dirs = 0;
+
+#define VARS_MIN_SLOTS 64 // Initial size of the table of shell variables
+
+// A shell variable
+struct var
+{
+    char *entry;     // "name=value", as it goes in the environment of commands; NULL for an empty slot
+    size_t name_len; // The name is the first name_len bytes of entry
+    int exported;    // 1 if commands get it in their environment
+    int set;         // 0 for a name exported before it was given a value, which has no value yet
+};
+
+// Shell variables, an open-addressing table with a power-of-two size
+static struct var *vars = NULL;
+static size_t var_slots = 0;
+static size_t num_vars = 0;
+
+// The environment of the commands the shell runs, rebuilt only after an exported variable changes
+static char **var_env = NULL;
+static unsigned long env_version = 0;           // Counts the changes to the exported variables
+static unsigned long var_env_version = 0;       // The version var_env was built for
+static size_t var_env_bytes = 0;                // The size of var_env's strings, NULs included
+static unsigned long forkserver_env_version = 0; // The version the fork server has
+
+// Built-in commands, each in the slot builtin_hash() gives for its name
+static const struct builtin builtins[BUILTIN_SLOTS] = {
+    [1] = {"wait", BUILTIN_WAIT, 1, 2, 0},
+    [2] = {"limit", BUILTIN_LIMIT, 2, -1, 0},
+    [3] = {"cat", BUILTIN_CAT, 1, -1, 1},
+    [5] = {"pipesize", BUILTIN_PIPESIZE, 1, 2, 0},
+    [8] = {"hash", BUILTIN_HASH, 1, 2, 1},
+    [9] = {"time", BUILTIN_TIME, 2, -1, 0},
+    [11] = {"exit", BUILTIN_EXIT, 1, 1, 0},
+    [12] = {"affinity", BUILTIN_AFFINITY, 3, -1, 0},
+    [15] = {"export", BUILTIN_EXPORT, 1, -1, 0},
+    [17] = {"cd", BUILTIN_CD, 2, 2, 0},
+    [20] = {"pipestat", BUILTIN_PIPESTAT, 1, 1, 1},
+    [22] = {"ioprio", BUILTIN_IOPRIO, 3, -1, 0},
+    [23] = {"nice", BUILTIN_NICE, 2, -1, 0},
+    [25] = {"jobs", BUILTIN_JOBS, 1, 1, 1},
+    [26] = {"pwd", BUILTIN_PWD, 1, 1, 1},
+    [28] = {"loop", BUILTIN_LOOP, 3, -1, 0},
+    [29] = {"unset", BUILTIN_UNSET, 2, -1, 0},
+    [30] = {"timeout", BUILTIN_TIMEOUT, 3, -1, 0},
+    [31] = {"history", BUILTIN_HISTORY, 1, 2, 1},
+};
+
+// Resources capped by the options of the limit built-in, in the order of job_limits.rlimits
+static const struct
+{
+    const char *option;
+    int resource;
+} limit_resources[NUM_RLIMITS] = {{"-v", RLIMIT_AS}, {"-t", RLIMIT_CPU}, {"-n", RLIMIT_NOFILE}, {"-u", RLIMIT_NPROC}};
+
+static int pipe_size = 0;             // Size of the pipes between stages (see pipesize), 0 for the kernel's default
+static struct pipe_stats pipe_stats; // Pipes sized for the last pipeline
+
+static struct arena line_arena = {NULL}; // Holds the parsed form of the current line
+static unsigned long line_number = 0;    // Counts the lines read, see path_cache_revalidate()
+static int last_status = 0;              // Exit status of the last pipeline, which the shell exits with at EOF
+static int interactive = 0;              // 1 when reading commands from standard input
+
+// Children being waited for, an open-addressing table keyed by pid with a power-of-two size
+static struct proc_slot *procs = NULL;
+static size_t proc_slots = 0;
+static size_t num_procs = 0;
+static int events_fd = -1;   // epoll instance watching the children, see wait_children()
+static int sigchld_fd = -1;  // signalfd for SIGCHLD, watched instead of pidfds on kernels without pidfd_open()
+static sigset_t child_mask;  // Signal mask the shell started with, which children get back
+static struct deadline *deadlines = NULL; // Timers of the running timeout commands, innermost first
+static struct sigaction child_sigpipe; // SIGPIPE disposition the shell started with, which children get back
+static struct rusage *timing = NULL; // Where the time built-in adds up the usage of reaped children
+static unsigned long num_cgroups = 0; // cgroups created for limit commands, which numbers their names
+static int in_cgroup = 0;             // 1 in a subshell put in a limit command's cgroup, where nested ones stay
+
+// The fork server (see forkserver_start()), unless it's off (SMASH_FORKSERVER=0) or gone
+static int forkserver_fd = -1;         // The shell's end of the socket to the server
+static pid_t forkserver_pid = -1;      // The server, which the shell reaps itself once it's gone
+static int forkserver_cwd_changed = 0; // 1 when the server's working directory is out of date
+static int stdio_moved = 0;            // 1 while a built-in command's redirection has moved the shell's stdin or stdout
+
+// History of the lines typed in (see history_open()), which is off unless history_fd is set
+static int history_fd = -1;                    // The log, one line per entry, opened for appending
+static int history_index_fd = -1;              // The index of the log
+static const char *history_log = NULL;         // The log, mapped
+static size_t history_log_size = 0;            // Bytes of the log mapped
+static const uint64_t *history_offsets = NULL; // The entries of the index, mapped
+static size_t history_index_size = 0;          // Bytes of the index mapped, its header included
+static size_t history_count = 0;               // Entries mapped
+static size_t history_checked = SIZE_MAX;      // Entries of the index checked against the log, SIZE_MAX until opened
+
+// Line editor, used for the lines typed at a terminal
+static int editing = 0; // 1 when lines are read with edit_line() rather than read_line()
+static struct line_editor editor;
+static struct arena complete_arena = {NULL}; // Holds the completions being listed
+
+// Trie of the commands in PATH, an array of nodes, along with the directories they were read from
+static struct trie_node *trie = NULL;
+static size_t trie_nodes = 0;
+static size_t trie_size = 0;
+static char *trie_path_env = NULL; // The PATH the trie was built for
+static struct trie_dir *trie_dirs = NULL;
+static int num_trie_dirs = 0;
+
+// Directory listings for completing file names, see dir_cache_get()
+static struct dir_listing dir_cache[DIR_CACHE_SLOTS];
+static unsigned long dir_cache_clock = 0; // Counts the listings used, see dir_listing.used
+
+// Tracing (SMASH_TRACE), which is off unless trace_file is set
+static FILE *trace_file = NULL;
+static struct timespec trace_epoch; // When tracing was turned on, the zero of the timestamps
+static pid_t trace_pid;             // The shell, which owns the trace
+static int trace_empty = 1;         // 1 until the first event is written
+
+// Background jobs, indexed by job number - 1
+static struct job **bg_jobs = NULL;
+static int bg_jobs_size = 0;
+static int max_job_id = 0;                      // Highest job number in use
+static int num_done_jobs = 0;                   // Background jobs that finished but weren't reported
+
+// Words of the command being parsed; reused from line to line
+static char **parse_words = NULL;
+static int num_parse_words = 0;
+static int parse_words_size = 0;
+
+// A string being sorted by sort_paths(), with its next 8 bytes packed into an integer
+struct sort_key
+{
+    uint64_t key;
+    char *s;
+};
+
+// Words of the command being expanded, see expand_pipeline(); reused from command to command
+static char **expand_words = NULL;
+static size_t num_expand_words = 0;
+static size_t expand_words_size = 0;
 
 // Function prototypes
-int lexer(char *line, char ***args, int *num_args, char *delim);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *s, size_t n);
+void arena_reset(struct arena *a);
+int input_open(struct input *in, const char *path);
+void input_init_fd(struct input *in, int fd);
+void input_init_string(struct input *in, const char *s, size_t len);
+ssize_t read_line(struct input *in, const char **line);
+int history_open(const char *path);
+int history_sync(struct history_index *hdr, size_t *count);
+int history_check(uint64_t log_size, size_t count);
+int history_add(const char *line, size_t len);
+int history_map(void);
+size_t history_entry(size_t i, const char **line);
+long history_find(const char *s, size_t len, size_t before, int anywhere);
+int history_expand(struct arena *a, const char **line, ssize_t *len);
+int run_history(char **args, int num_args);
+int edit_init(void);
+ssize_t edit_line(const char **line);
+int edit_read_key(void);
+void edit_refresh(const char *prompt, size_t prompt_len);
+size_t edit_columns(void);
+size_t edit_width(const char *s, size_t n);
+size_t edit_next_char(size_t i);
+size_t edit_prev_char(size_t i);
+int edit_insert(const char *s, size_t n);
+void edit_delete(size_t start, size_t end);
+int edit_set(const char *s, size_t n);
+int edit_save(void);
+int edit_history(int newer);
+int edit_search(void);
+int edit_complete(int list);
+int edit_confirm(size_t count);
+int edit_list(char **names, size_t count);
+void edit_bell(void);
+int parse_line(struct arena *a, const char *line, size_t len, struct cmd_list **list);
+int parse_end_command(struct parser *p);
+void parse_end_pipeline(struct parser *p, const char *end);
+struct pipeline *expand_pipeline(struct arena *a, struct pipeline *pl);
+char *expand_word(struct arena *a, char *word);
+const char *expand_ref(const char *c, size_t *skip, char *num);
+int has_glob(const char *s, size_t len);
+long glob_word(struct arena *a, const char *pattern);
+int glob_walk(struct arena *a, char *path, size_t len, const char *pattern);
+int glob_match(const char *pattern, size_t len, const char *name);
+size_t glob_match_char(const char *p, const char *end, unsigned char c);
+int glob_add(struct arena *a, const char *path, size_t len);
+int sort_paths(char **v, size_t n);
+void sort_keys(struct sort_key *k, struct sort_key *tmp, size_t n, size_t depth);
+uint64_t sort_key_at(const char *s);
+int expand_add(char *word);
+int is_delim(char c);
 void print_prompt(void);
 void print_error(void);
-int is_empty(const char *s);
 int run_pwd(char **path, size_t *path_size);
-int run_exec(char *line, int rd, int pipes);
-int run_loop(char *args[], int num_args, int rd, int pipes, char *line);
-void run_mult(char *line, char **args, int num_args);
-int check_mult_syntax(char **mult_args, int num_mult_args, char **args, int num_args);
+void run_list(struct cmd_list *list);
+int run_command(struct pipeline *pl);
+struct plan *compile_plan(struct arena *a, struct pipeline *pl);
+int run_plan(struct plan *plan);
+int run_builtin(enum builtin_id builtin, struct command *cmd);
+int run_builtin_to(struct plan *plan, int in_fd, int out_fd);
+int run_pipeline(struct plan *plan, struct stage_usage *usage);
+int start_pipeline(struct plan *plan, struct job *job, int out_fd);
+int run_background(struct pipeline *pl);
+int start_subshell(struct plan *plan, struct job *job, int in_fd);
+pid_t fork_subshell(struct plan *plan, int in_fd, int out_fd, const int *close_fds, int num_close,
+                    const struct job *job);
+int events_init(void);
+int wait_children(int timeout_ms);
+void reap_child(pid_t pid, int status, const struct rusage *ru);
+int proc_reserve(size_t n);
+int proc_add(pid_t pid, struct job *job);
+void proc_insert(pid_t pid, int pidfd, struct job *job);
+struct job *proc_take(pid_t pid);
+void notify_jobs(void);
+void free_job(struct job *job);
+int run_jobs(void);
+int run_wait(char **args, int num_args);
+int exit_status(int status);
+int copy_fd(int in_fd, int out_fd);
+int run_cat(char **args, int num_args);
+int has_redir(struct redir *r, enum redir_type type);
+int redir_flags(enum redir_type type);
+struct redir *output_redir(struct plan *plan);
+void hold_output(struct plan *plan, int fd);
+void spawn_init(struct spawn_req *req, const char *path, char **argv);
+int spawn_add_dup2(struct spawn_req *req, int src_fd, int fd);
+int spawn_add_close(struct spawn_req *req, int fd);
+int spawn_add_open(struct spawn_req *req, int fd, const char *path, int flags, mode_t mode);
+int spawn_add_setpgid(struct spawn_req *req, pid_t pgid);
+int spawn_add_sched(struct spawn_req *req, const struct stage_sched *sched);
+int apply_sched(const struct stage_sched *sched);
+int spawn_add_limits(struct spawn_req *req, const struct job_limits *limits);
+int apply_limits(const struct job_limits *limits);
+pid_t spawn_proc(struct spawn_req *req);
+int run_spawn_actions(struct spawn_req *req);
+void forkserver_start(void);
+void forkserver_run(int sock);
+int forkserver_child(void *arg);
+pid_t forkserver_spawn(struct spawn_req *req);
+size_t forkserver_pack(char *buf, size_t off, const char *s);
+size_t forkserver_pack_bytes(char *buf, size_t off, const void *data, size_t len);
+unsigned long hash_name(const char *s);
+unsigned long hash_bytes(const char *s, size_t len);
+void path_cache_clear(void);
+struct path_cache_entry *path_cache_find(const char *name);
+struct path_cache_entry *path_cache_insert(const char *name, const char *path);
+void path_cache_revalidate(void);
+const char *resolve_cmd(const char *name);
+int run_hash(char **args, int num_args);
+int trie_refresh(void);
+int trie_rebuild(void);
+int trie_scan(struct trie_dir *td);
+int trie_add(const char *name, int delta);
+long trie_find(const char *prefix, size_t len);
+long trie_collect(uint32_t node, char *prefix, size_t len, char **names, long n);
+struct dir_listing *dir_cache_get(const char *dir);
+int dir_list(struct dir_listing *l, const char *path);
+int compare_names(const void *a, const void *b);
+int vars_init(void);
+struct var *var_find(const char *name, size_t len);
+const char *var_get(const char *name);
+const char *var_lookup(const char *name, size_t len);
+int var_set(const char *name, size_t len, const char *value, int export);
+void var_unset(const char *name, size_t len);
+char **var_environ(void);
+size_t var_name_len(const char *s);
+int is_assignment(const char *word);
+int run_export(char **args, int num_args);
+int run_unset(char **args, int num_args);
+int run_assign(char **args, int num_args);
+int compare_vars(const void *a, const void *b);
+int run_pipesize(char **args, int num_args);
+int run_pipestat(void);
+long pipe_max_size(void);
+void size_pipe(int fd);
+size_t builtin_hash(const char *name, size_t len);
+const struct builtin *find_builtin(const char *name);
+enum builtin_id lookup_builtin(const char *name);
+int parse_loop(struct command *cmd, int *count, int *jobs, int *buffered);
+int parse_timeout(struct command *cmd, double *secs, int *sig, double *kill_after);
+int parse_duration(const char *s, double *secs);
+int parse_signal(const char *s);
+int is_sched_prefix(enum builtin_id id);
+int parse_nice(const char *s, int *inc);
+int parse_sched(struct arena *a, struct command *cmd, struct stage_sched *sched);
+int parse_cpus(const char *s, cpu_set_t *cpus, size_t size);
+int parse_ioprio(const char *s);
+void loop_body(struct pipeline *pl, int skip, struct pipeline *body, struct command *body_cmd);
+int run_loop(struct plan *plan, struct loop_samples *samples);
+int run_loop_parallel(struct plan *plan, struct loop_samples *samples);
+int run_time(struct plan *plan);
+void rusage_add(struct rusage *total, const struct rusage *ru);
+int run_timeout(struct plan *plan);
+int deadline_start(struct deadline *d, double secs);
+int deadline_set(struct deadline *d, double secs);
+void deadline_stop(struct deadline *d);
+int parse_limit(struct command *cmd, struct job_limits *limits);
+int parse_size(const char *s, long long *bytes);
+int run_limit(struct plan *plan);
+int cgroup_create(const char *root, const struct job_limits *limits, char *path, size_t size);
+int cgroup_write(int dir_fd, const char *file, const char *value);
+long long cgroup_read(int dir_fd, const char *file, const char *key);
+void cgroup_report(int dir_fd);
+void print_usage(const char *label, double real, const struct rusage *ru, const char *name);
+double elapsed(const struct timespec *start, const struct timespec *end);
+double percentile(const struct loop_samples *samples, int p);
+int compare_doubles(const void *a, const void *b);
+int trace_open(const char *path);
+void trace_close(void);
+double trace_now(void);
+double trace_time(const struct timespec *ts);
+void trace_event(const char *name, double start, double end, pid_t pid, char **argv, const char *path);
+void trace_string(const char *s);
+void trace_job(struct job *job, struct plan *plan);
+int check_syntax(struct cmd_list *list);
+int check_pipeline(struct pipeline *pl);
 
 int main(int argc, char *argv[])
 {
+    // Delcare variables for user input
+    struct input in;
+    const char *line;
+    ssize_t len;
+    struct cmd_list *list;
 
-    if (argc > 1)
+    // SMASH_FORKSERVER=0 makes the shell start its children itself
+    const char *forkserver = getenv("SMASH_FORKSERVER");
+    if (forkserver == NULL || strcmp(forkserver, "0") != 0)
     {
-        print_error();
+        forkserver_start();
     }
 
-    // Delcare variables for user input
-    char *line = NULL;
-    char **args;
-    int num_args;
-    size_t size_line = 0;
-    int rd = 0; // Used for redirection
-    int pipes = 0;
-
-    // Main loop for command line interpreter
-    while (1)
+    // The variables start out as the environment, which the fork server has too
+    if (vars_init() == -1)
     {
-        // Reset rd and pipes
-        rd = 0;
-        pipes = 0;
+        print_error();
+        exit(1);
+    }
 
-        print_prompt();
+    // smash, smash script or smash -c cmdline
+    if (argc == 1)
+    {
+        input_init_fd(&in, STDIN_FILENO);
+        interactive = 1;
+    }
+    else if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        input_init_string(&in, argv[2], strlen(argv[2]));
+    }
+    else if (argc != 2 || input_open(&in, argv[1]) == -1)
+    {
+        print_error();
+        exit(1);
+    }
 
-        if (getline(&line, &size_line, stdin) == -1)
-        {
-            print_error();
-            continue;
-        }
+    // SMASH_TRACE=file writes a Chrome trace of what the shell does to file
+    const char *trace_path = getenv("SMASH_TRACE");
+    if (trace_path != NULL && *trace_path != '\0' && trace_open(trace_path) == -1)
+    {
+        print_error();
+    }
 
-        // Check for empty input
-        if (is_empty(line) == 1)
+    // Lines typed at a terminal are kept in ~/.smash_history, or SMASH_HISTFILE (empty for no history)
+    const char *history_path = getenv("SMASH_HISTFILE");
+    if (interactive && (history_path != NULL || isatty(STDIN_FILENO)))
+    {
+        char default_path[PATH_MAX];
+        const char *home = getenv("HOME");
+        if (history_path == NULL && home != NULL &&
+            (size_t)snprintf(default_path, sizeof(default_path), "%s/.smash_history", home) < sizeof(default_path))
         {
-            continue;
+            history_path = default_path;
         }
-
-        // Check for syntax error on multiple commands, redirection and pipes
-        if (strstr(line, ";;") || strstr(line, ">>") || strstr(line, "||"))
+        if (history_path != NULL && *history_path != '\0' && history_open(history_path) == -1)
         {
             print_error();
-            continue;
-        }
-
-        // Check for multiple command mode
-        if (strstr(line, ";"))
-        {
-            run_mult(line, args, num_args);
-            continue;
         }
+    }
 
-        // Check for redirection
-        if (strstr(line, ">"))
-        {
-            rd = 1;
-        }
+    // Lines typed at a terminal can be edited as they're typed
+    if (interactive && edit_init() == -1)
+    {
+        print_error();
+    }
 
-        // Check for pipes
-        if (strstr(line, "|"))
-        {
-            pipes = 1;
-        }
+    // Children are waited for from one event loop, see wait_children()
+    sigprocmask(SIG_SETMASK, NULL, &child_mask);
+    if (events_init() == -1)
+    {
+        print_error();
+        exit(1);
+    }
 
-        char *line_copy = malloc(sizeof(char) * strlen(line) + sizeof(NULL));
-        strcpy(line_copy, line);
+    // Built-in commands write into pipes from the shell, which must outlive their readers
+    struct sigaction ignore;
+    ignore.sa_handler = SIG_IGN;
+    ignore.sa_flags = 0;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &child_sigpipe);
 
-        // Tokenize input
-        if (lexer(line, &args, &num_args, " \t\n") == -1)
+    // Main loop for command line interpreter
+    while (1)
+    {
+        // Background jobs that finished between commands mustn't linger as zombies
+        if (num_procs > 0)
         {
-            print_error();
-            continue;
+            wait_children(0);
         }
-
-        // exit command
-        if (strcmp(args[0], "exit") == 0)
+        if (interactive)
         {
-            if (num_args > 1)
-            {
-                print_error();
-                continue;
-            }
-            else
+            notify_jobs();
+
+            // The line editor draws the prompt itself
+            if (!editing)
             {
-                free(line);
-                free(args);
-                exit(0);
+                print_prompt();
             }
         }
 
-        // cd command
-        if (strcmp(args[0], "cd") == 0)
+        if ((len = editing ? edit_line(&line) : read_line(&in, &line)) <= 0)
         {
-            if (num_args == 1 || num_args > 2)
-            {
-                print_error();
-                continue;
-            }
-            if (chdir(args[1]) == -1)
+            if (len == -1)
             {
                 print_error();
             }
-            continue;
+            exit(last_status);
         }
+        line_number++;
 
-        // pwd command
-        if (strcmp(args[0], "pwd") == 0)
+        // Parse the whole line and check it for syntax errors before running any of it
+        arena_reset(&line_arena);
+        if (history_fd != -1)
         {
-            if (num_args > 1)
+            if (history_expand(&line_arena, &line, &len) == -1)
             {
                 print_error();
+                last_status = 1;
                 continue;
             }
-            size_t path_size = 16;
-            char *path = malloc(path_size);
-            if (path == NULL)
+
+            // Blank lines aren't worth keeping
+            size_t end = len;
+            while (end > 0 && isspace((unsigned char)line[end - 1]))
             {
-                print_error();
-                continue;
+                end--;
             }
-            if (run_pwd(&path, &path_size) == -1)
+            size_t start = 0;
+            while (start < end && isspace((unsigned char)line[start]))
             {
-                print_error();
-                continue;
+                start++;
             }
-            printf("%s\n", path);
-            free(path);
-            continue;
-        }
-
-        // Loop command
-        if (strcmp(args[0], "loop") == 0)
-        {
-            if (run_loop(args, num_args, rd, pipes, line_copy) == -1)
+            if (start < end && history_add(line + start, end - start) == -1)
             {
                 print_error();
             }
-            continue;
         }
-
-        // execv() command
-        if (run_exec(line_copy, rd, pipes) == -1)
+        double parse_start = trace_file != NULL ? trace_now() : 0;
+        int ret = parse_line(&line_arena, line, len, &list);
+        double check_start = trace_file != NULL ? trace_now() : 0;
+        if (ret == 0)
+        {
+            ret = check_syntax(list);
+        }
+        if (trace_file != NULL)
+        {
+            double check_end = trace_now();
+            trace_event("parse", parse_start, check_start, 0, NULL, NULL);
+            trace_event("check", check_start, check_end, 0, NULL, NULL);
+        }
+        if (ret == -1)
         {
             print_error();
+            last_status = 1;
             continue;
         }
+
+        run_list(list);
     }
 }
 
 /**
- * Function: lexer
- * ---------------
- * Takes a line and splits it into args similar to how argc and argv work in main
- *
- * line: The line being split up.  Will be mangled after completion of the function.
+ * Function: input_open
+ * --------------------
+ * Sets up reading lines from a script file.
+ * Regular files are mmap()ed, so lines are handed out straight from the page
+ * cache with no read() calls or copying at all.  Anything else (a FIFO, a
+ * device, an empty file) falls back to reading it in large chunks.
  *
- * args: A pointer to an array of strings that will be filled and allocated
- *       with the args from the line.
+ * in: the input being set up
  *
- * num_args: A pointer to an integer for the number of arguments in args.
+ * path: the script file
  *
- * delim: The delimiter for the string line
- *
- * return: 0 on success, -1 on failure.
+ * return: -1 on failure, 0 on success
  */
-int lexer(char *line, char ***args, int *num_args, char *delim)
+int input_open(struct input *in, const char *path)
 {
-    *num_args = 0;
-    // count number of args
-    char *l = strdup(line);
-    if (l == NULL)
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
         return -1;
     }
-    char *token = strtok(l, delim);
-    while (token != NULL)
-    {
-        (*num_args)++;
-        token = strtok(NULL, delim);
-    }
-    free(l);
-    // split line into args
-    *args = malloc(sizeof(char **) * *num_args);
-    *num_args = 0;
-    token = strtok(line, delim);
-    while (token != NULL)
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
     {
-        char *token_copy = strdup(token);
-        if (token_copy == NULL)
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
         {
-            return -1;
+            close(fd);
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            input_init_string(in, map, st.st_size);
+            return 0;
         }
-        (*args)[(*num_args)++] = token_copy;
-        token = strtok(NULL, delim);
     }
+    input_init_fd(in, fd);
     return 0;
 }
 
 /**
- * Function: print_prompt
- * ----------------------
- * Prints the prompt for the shell to the console, and subsequently flushes stdout
- */
-void print_prompt(void)
-{
-    printf("smash> ");
-    fflush(stdout);
-}
-
-/**
- * Function: print_error
- * ---------------------
- * Prints the error message to the console
+ * Function: input_init_fd
+ * -----------------------
+ * Sets up reading lines from a file descriptor, INPUT_CHUNK_SIZE bytes at a time
+ *
+ * in: the input being set up
+ *
+ * fd: the file descriptor to read from
  */
-void print_error(void)
+void input_init_fd(struct input *in, int fd)
 {
-    char error_message[30] = "An error has occurred\n";
-    write(STDERR_FILENO, error_message, strlen(error_message));
+    in->fd = fd;
+    in->buf = NULL;
+    in->size = 0;
+    in->start = 0;
+    in->end = 0;
 }
 
 /**
- * Function: is_empty
- * ------------------
- * Checks to see if a string is empty (all whitespace).
- * Taken from Stack Overflow at https://stackoverflow.com/a/3981593/6946494
+ * Function: input_init_string
+ * ---------------------------
+ * Sets up reading lines from memory (the string given with -c, or a mapped script)
+ *
+ * in: the input being set up
  *
- * s: The string to be checked for emptiness
+ * s: the lines, which don't need to be NUL-terminated
  *
- * return: 1 if the string is empty,
- *         0 if it has at least one non-whitespace character
+ * len: the number of bytes in s
  */
-int is_empty(const char *s)
+void input_init_string(struct input *in, const char *s, size_t len)
 {
-    while (*s != '\0')
-    {
-        if (!isspace((unsigned char)*s))
-            return 0;
-        s++;
-    }
-    return 1;
+    in->fd = -1;
+    in->buf = (char *)s;
+    in->size = len;
+    in->start = 0;
+    in->end = len;
 }
 
 /**
- * Function: run_pwd
- * -----------------
- * Helper function for pwd built-in command, updating path and path_size as needed
+ * Function: read_line
+ * -------------------
+ * Gets the next line of input.  The line stays valid until the next call.
  *
- * path: a pointer to a string where the path will be stored
+ * in: the input to read from
  *
- * path_size: a pointer to a size_t variable holding the size in bytes of path
+ * line: a pointer that will be set to the start of the line
  *
- * return: -1 on failure, 0 on success
+ * return: the length of the line including its newline (if it has one),
+ *         0 at the end of the input, -1 on a read error
  */
-int run_pwd(char **path, size_t *path_size)
+ssize_t read_line(struct input *in, const char **line)
 {
-    char *ret = getcwd(*path, *path_size);
-    while (ret == NULL)
+    size_t scanned = in->start; // Everything before this is known to have no newline
+    while (1)
     {
-        if (errno == ERANGE)
+        char *nl = memchr(in->buf + scanned, '\n', in->end - scanned);
+        if (nl != NULL)
         {
-            *path_size *= 2;
-            *path = realloc(*path, *path_size);
-            if (*path == NULL)
+            *line = in->buf + in->start;
+            size_t len = nl + 1 - *line;
+            in->start += len;
+            return len;
+        }
+        scanned = in->end;
+
+        // The last line doesn't need a newline
+        ssize_t n = 0;
+        if (in->fd != -1)
+        {
+            // Make room at the end of the buffer for another chunk
+            if (in->start > 0)
+            {
+                memmove(in->buf, in->buf + in->start, in->end - in->start);
+                in->end -= in->start;
+                scanned -= in->start;
+                in->start = 0;
+            }
+
+            // Give back what a long line made the buffer grow by, once it's gone
+            if (in->size > INPUT_CHUNK_SIZE * 4 && in->end < INPUT_CHUNK_SIZE)
+            {
+                char *buf = realloc(in->buf, INPUT_CHUNK_SIZE * 2);
+                if (buf != NULL)
+                {
+                    in->buf = buf;
+                    in->size = INPUT_CHUNK_SIZE * 2;
+                }
+            }
+            if (in->size - in->end < INPUT_CHUNK_SIZE)
+            {
+                size_t size = in->size == 0 ? INPUT_CHUNK_SIZE : in->size * 2;
+                char *buf = realloc(in->buf, size);
+                if (buf == NULL)
+                {
+                    return -1;
+                }
+                in->buf = buf;
+                in->size = size;
+            }
+            do
+            {
+                n = read(in->fd, in->buf + in->end, in->size - in->end);
+            } while (n == -1 && errno == EINTR);
+            if (n == -1)
             {
                 return -1;
             }
-            ret = getcwd(*path, *path_size);
+            in->end += n;
         }
-        else
+        if (n == 0)
         {
-            return -1;
+            *line = in->buf + in->start;
+            size_t len = in->end - in->start;
+            in->start = in->end;
+            return len;
         }
     }
-    *path = ret;
-    return 0;
 }
 
 /**
- * Function: run_exec
- * -----------------
- * Helper function for execv() system call.
- * Forks a process, letting the child process run the command with execv()
- * and then waits for it to finish before proceeding with the parent.
- *
- * line: the entire command to be executed, sometimes including redirection and pipes
- *
- * rd: 1 if the command uses redirection, 0 if not
+ * Function: history_open
+ * ----------------------
+ * Turns on the history: every line typed in is appended to a log, path,
+ * and its offset in the log to an index next to it (path with ".idx" added).
+ * Both are mapped rather than read, so opening a history of millions of lines
+ * costs the same as an empty one, and any entry is found in constant time.
+ * If the log has lines the index doesn't cover (it was written by something
+ * else, or a session died in between), only those are indexed.
  *
- * pipes: 1 if the command uses pipes, 0 if not
+ * path: the log
  *
- * return: -1 on failure, 0 on success.
+ * return: -1 on failure (the history stays off), 0 on success
  */
-int run_exec(char *line, int rd, int pipes)
+int history_open(const char *path)
 {
-    int rc = fork();
-    if (rc < 0)
+    char index_path[PATH_MAX];
+    if ((size_t)snprintf(index_path, sizeof(index_path), "%s.idx", path) >= sizeof(index_path))
     {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    else if (rc == 0)
+    int log_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (log_fd == -1)
     {
-        char **args;
-        int num_args;
-
-        if (pipes)
-        {
-            int pipefd[2];
-            char **pipe_cmds;
-            int num_pipe_cmds;
+        return -1;
+    }
+    int index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (index_fd == -1)
+    {
+        close(log_fd);
+        return -1;
+    }
+    history_fd = log_fd;
+    history_index_fd = index_fd;
+
+    struct history_index hdr;
+    size_t count;
+    flock(history_fd, LOCK_EX);
+    int ret = history_sync(&hdr, &count);
+    flock(history_fd, LOCK_UN);
+    if (ret == -1 || history_map() == -1)
+    {
+        close(history_fd);
+        close(history_index_fd);
+        history_fd = -1;
+        history_index_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function: history_sync
+ * ----------------------
+ * Brings the history index up to date with the log.  The log is only ever
+ * appended to, and every session holds a lock on it while it appends, so the
+ * index is normally up to date already and this only reads its header.
+ * Entries past what the header says the index covers (from a session that died
+ * between writing them and the header) are dropped and found again, and an
+ * index that doesn't match the log at all is rebuilt: one with the wrong
+ * header, or with an entry added since this session opened it that doesn't
+ * start a line of the log (see history_check()).  The entries that were there
+ * when it was opened aren't read until they are used (see history_entry()).
+ * The caller must hold the lock on the log.
+ *
+ * hdr: filled in with the header of the index, once up to date
+ *
+ * count: set to the number of entries in the index
+ *
+ * return: -1 on failure, 0 on success
+ */
+int history_sync(struct history_index *hdr, size_t *count)
+{
+    struct stat log_st, index_st;
+    if (fstat(history_fd, &log_st) == -1 || fstat(history_index_fd, &index_st) == -1)
+    {
+        return -1;
+    }
+    int valid = index_st.st_size >= (off_t)sizeof(*hdr) &&
+                pread(history_index_fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr) &&
+                memcmp(hdr->magic, HISTORY_MAGIC, sizeof(hdr->magic)) == 0 && hdr->log_size <= (uint64_t)log_st.st_size;
+    *count = 0;
+    if (valid)
+    {
+        *count = (index_st.st_size - sizeof(*hdr)) / sizeof(uint64_t);
+    }
+    else
+    {
+        memcpy(hdr->magic, HISTORY_MAGIC, sizeof(hdr->magic));
+        hdr->log_size = 0;
+    }
+    uint64_t last;
+    while (*count > 0 &&
+           (pread(history_index_fd, &last, sizeof(last), sizeof(*hdr) + (*count - 1) * sizeof(last)) != sizeof(last) ||
+            last >= hdr->log_size))
+    {
+        (*count)--;
+    }
+
+    // The index as it was opened is checked entry by entry as it is used, and only what is added after in full;
+    // another session may have rebuilt it since it was checked
+    if (history_checked == SIZE_MAX)
+    {
+        history_checked = *count;
+    }
+    else if (*count < history_checked)
+    {
+        history_checked = 0;
+    }
+    if (valid && history_check(hdr->log_size, *count) == -1)
+    {
+        valid = 0;
+        *count = 0;
+        hdr->log_size = 0;
+        history_checked = 0;
+    }
+    off_t size = sizeof(*hdr) + *count * sizeof(uint64_t);
+    if (size != index_st.st_size && ftruncate(history_index_fd, size) == -1)
+    {
+        return -1;
+    }
+    if (valid && hdr->log_size == (uint64_t)log_st.st_size)
+    {
+        return 0;
+    }
+
+    // Index the lines after the part of the log the index covers (every byte may start one)
+    static char buf[HISTORY_SCAN_SIZE];
+    static uint64_t offsets[HISTORY_SCAN_SIZE];
+    uint64_t pos = hdr->log_size;
+    int line_start = 1;
+    while (pos < (uint64_t)log_st.st_size)
+    {
+        ssize_t n = pread(history_fd, buf, sizeof(buf), pos);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        size_t num_offsets = 0;
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (line_start)
+            {
+                offsets[num_offsets++] = pos + i;
+            }
+            line_start = buf[i] == '\n';
+        }
+        if (pwrite(history_index_fd, offsets, num_offsets * sizeof(uint64_t), size) !=
+            (ssize_t)(num_offsets * sizeof(uint64_t)))
+        {
+            return -1;
+        }
+        size += num_offsets * sizeof(uint64_t);
+        *count += num_offsets;
+        pos += n;
+    }
+    hdr->log_size = pos;
+    history_checked = *count;
+    return pwrite(history_index_fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr) ? 0 : -1;
+}
+
+/**
+ * Function: history_check
+ * -----------------------
+ * Checks the entries other sessions added to the history index since this
+ * one last looked: they must go up, the first must be 0 and every other one
+ * must follow a newline in the log.  The log is mapped for the check, and the
+ * index read in large chunks.
+ * The caller must hold the lock on the log.
+ *
+ * log_size: the part of the log the index covers
+ *
+ * count: the number of entries in the index
+ *
+ * return: -1 if an entry is wrong (or can't be read), 0 if they're all right
+ */
+int history_check(uint64_t log_size, size_t count)
+{
+    if (history_checked >= count)
+    {
+        return 0;
+    }
+    const char *log = mmap(NULL, log_size, PROT_READ, MAP_SHARED, history_fd, 0);
+    if (log == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    // The entry before the first one to check is known to be right
+    static uint64_t offsets[HISTORY_SCAN_SIZE];
+    size_t i = history_checked > 0 ? history_checked - 1 : 0;
+    uint64_t prev = 0;
+    int ret = 0;
+    while (ret == 0 && i < count)
+    {
+        size_t n = count - i < HISTORY_SCAN_SIZE ? count - i : HISTORY_SCAN_SIZE;
+        ssize_t want = n * sizeof(uint64_t);
+        if (pread(history_index_fd, offsets, want, sizeof(struct history_index) + i * sizeof(uint64_t)) != want)
+        {
+            ret = -1;
+            break;
+        }
+        for (size_t j = 0; j < n; j++)
+        {
+            uint64_t offset = offsets[j];
+            if (i + j == 0 ? offset != 0
+                           : i + j >= history_checked &&
+                                 (offset <= prev || offset >= log_size || log[offset - 1] != '\n'))
+            {
+                ret = -1;
+                break;
+            }
+            prev = offset;
+        }
+        i += n;
+    }
+    munmap((void *)log, log_size);
+    if (ret == 0)
+    {
+        history_checked = count;
+    }
+    return ret;
+}
+
+/**
+ * Function: history_add
+ * ---------------------
+ * Appends a line to the history.  The line goes into the log with one write(),
+ * then its offset into the index and the index's header is updated, all under
+ * an flock() on the log, so sessions sharing the history can't interleave.
+ *
+ * line: the line, without its newline
+ *
+ * len: the length of line
+ *
+ * return: -1 on failure, 0 on success
+ */
+int history_add(const char *line, size_t len)
+{
+    struct history_index hdr;
+    size_t count;
+    flock(history_fd, LOCK_EX);
+    int ret = history_sync(&hdr, &count);
+    if (ret == 0)
+    {
+        uint64_t offset = hdr.log_size;
+        struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+        if (writev(history_fd, iov, 2) != (ssize_t)len + 1 ||
+            pwrite(history_index_fd, &offset, sizeof(offset), sizeof(hdr) + count * sizeof(offset)) != sizeof(offset))
+        {
+            ret = -1;
+        }
+        else
+        {
+            hdr.log_size += len + 1;
+            ret = pwrite(history_index_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) ? 0 : -1;
+        }
+    }
+    flock(history_fd, LOCK_UN);
+    return ret;
+}
+
+/**
+ * Function: history_map
+ * ---------------------
+ * Maps the history log and index, again if they grew since they were last
+ * mapped (by this session or another one sharing the history), so entries
+ * can be read straight from the page cache.
+ *
+ * return: -1 on failure, 0 on success
+ */
+int history_map(void)
+{
+    struct stat log_st, index_st;
+    if (fstat(history_fd, &log_st) == -1 || fstat(history_index_fd, &index_st) == -1)
+    {
+        return -1;
+    }
+    if ((size_t)log_st.st_size == history_log_size && (size_t)index_st.st_size == history_index_size)
+    {
+        return 0;
+    }
+    if (history_log != NULL)
+    {
+        munmap((void *)history_log, history_log_size);
+        munmap((void *)((const char *)history_offsets - sizeof(struct history_index)), history_index_size);
+    }
+    history_log = NULL;
+    history_offsets = NULL;
+    history_log_size = 0;
+    history_index_size = 0;
+    history_count = 0;
+    if (log_st.st_size == 0 || index_st.st_size <= (off_t)sizeof(struct history_index))
+    {
+        return 0;
+    }
+    void *log = mmap(NULL, log_st.st_size, PROT_READ, MAP_SHARED, history_fd, 0);
+    if (log == MAP_FAILED)
+    {
+        return -1;
+    }
+    void *index = mmap(NULL, index_st.st_size, PROT_READ, MAP_SHARED, history_index_fd, 0);
+    if (index == MAP_FAILED)
+    {
+        munmap(log, log_st.st_size);
+        return -1;
+    }
+    history_log = log;
+    history_log_size = log_st.st_size;
+    history_offsets = (const uint64_t *)((char *)index + sizeof(struct history_index));
+    history_index_size = index_st.st_size;
+
+    // Another session may have indexed a line the log wasn't mapped far enough for
+    history_count = (index_st.st_size - sizeof(struct history_index)) / sizeof(uint64_t);
+    while (history_count > 0 && history_offsets[history_count - 1] >= history_log_size)
+    {
+        history_count--;
+    }
+    return 0;
+}
+
+/**
+ * Function: history_entry
+ * -----------------------
+ * Finds an entry of the mapped history
+ *
+ * i: the entry, from 0 for the oldest to history_count - 1
+ *
+ * line: set to the start of the entry, which has no terminating NUL
+ *
+ * return: the length of the entry, without its newline
+ */
+size_t history_entry(size_t i, const char **line)
+{
+    // The offsets are checked as they're used, so a corrupt index gives empty entries rather than a crash
+    uint64_t start = history_offsets[i];
+    if (start >= history_log_size || (start > 0 && history_log[start - 1] != '\n'))
+    {
+        *line = history_log;
+        return 0;
+    }
+    *line = history_log + start;
+
+    // An entry ends where the next one starts, except the last
+    uint64_t end = i + 1 < history_count ? history_offsets[i + 1] : 0;
+    if (end > start && end <= history_log_size && history_log[end - 1] == '\n')
+    {
+        return end - start - 1;
+    }
+    size_t max = history_log_size - start;
+    const char *nl = memchr(*line, '\n', max);
+    return nl != NULL ? (size_t)(nl - *line) : max;
+}
+
+/**
+ * Function: history_find
+ * ----------------------
+ * Searches the mapped history backwards, from the newest entry before a
+ * given one, for an entry starting with (or containing) a string
+ *
+ * s: the string searched for
+ *
+ * len: the length of s
+ *
+ * before: the entry the search starts before (history_count to search all of it)
+ *
+ * anywhere: 1 to match s anywhere in an entry, 0 to match it at the start only
+ *
+ * return: the newest entry that matches, or -1 if none does
+ */
+long history_find(const char *s, size_t len, size_t before, int anywhere)
+{
+    for (size_t i = before; i-- > 0;)
+    {
+        const char *line;
+        size_t line_len = history_entry(i, &line);
+        if (anywhere ? memmem(line, line_len, s, len) != NULL : line_len >= len && memcmp(line, s, len) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Function: history_expand
+ * ------------------------
+ * Replaces a history reference at the start of a line with the entry it
+ * refers to: "!!" the last entry, "!n" entry n, "!-n" the nth last one and
+ * "!prefix" the last one starting with prefix.  The rest of the line is kept,
+ * so "!! | grep x" works.  Like other shells, smash prints the line it runs instead.
+ *
+ * a: the arena the new line is allocated from
+ *
+ * line: the line, replaced with the new one if it starts with a reference
+ *
+ * len: the length of line, including its newline; updated along with it
+ *
+ * return: -1 (with errno set) if the reference doesn't match any entry, 0 otherwise
+ */
+int history_expand(struct arena *a, const char **line, ssize_t *len)
+{
+    const char *start = *line;
+    const char *end = *line + *len;
+    while (start < end && (*start == ' ' || *start == '\t'))
+    {
+        start++;
+    }
+    if (start == end || *start != '!')
+    {
+        return 0;
+    }
+    const char *word = start + 1;
+    const char *rest = word;
+    while (rest < end && !is_delim(*rest))
+    {
+        rest++;
+    }
+    if (history_map() == -1)
+    {
+        return -1;
+    }
+
+    // Which entry the reference is to
+    long i = -1;
+    char *num_end;
+    long n = strtol(word, &num_end, 10);
+    if (rest - word == 1 && *word == '!')
+    {
+        i = (long)history_count - 1;
+    }
+    else if (num_end == rest && rest > word)
+    {
+        i = n > 0 ? n - 1 : (long)history_count + n;
+    }
+    else if (rest > word)
+    {
+        i = history_find(word, rest - word, history_count, 0);
+    }
+    if (i < 0 || i >= (long)history_count)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    const char *entry;
+    size_t entry_len = history_entry(i, &entry);
+    size_t rest_len = end - rest;
+    char *expanded = arena_alloc(a, entry_len + rest_len + 1);
+    if (expanded == NULL)
+    {
+        return -1;
+    }
+    memcpy(expanded, entry, entry_len);
+    memcpy(expanded + entry_len, rest, rest_len);
+    expanded[entry_len + rest_len] = '\n';
+    *len = entry_len + rest_len;
+    if (rest_len == 0 || rest[rest_len - 1] != '\n')
+    {
+        (*len)++;
+    }
+    *line = expanded;
+    printf("%.*s", (int)*len, expanded);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Function: run_history
+ * ---------------------
+ * Helper function for the history built-in command: prints the history, or
+ * its last n entries with "history n", numbered for "!n".  Lines other
+ * sessions sharing the history added since it was last mapped are included.
+ *
+ * args: the arguments, args[1] being n if given
+ *
+ * num_args: the number of arguments
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_history(char **args, int num_args)
+{
+    if (history_fd == -1)
+    {
+        return 0;
+    }
+    if (history_map() == -1)
+    {
+        return -1;
+    }
+    size_t n = history_count;
+    if (num_args == 2)
+    {
+        char *end;
+        long count = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0' || count < 0)
+        {
+            return -1;
+        }
+        if ((size_t)count < n)
+        {
+            n = count;
+        }
+    }
+    for (size_t i = history_count - n; i < history_count; i++)
+    {
+        const char *line;
+        size_t len = history_entry(i, &line);
+        printf("%5zu  %.*s\n", i + 1, (int)len, line);
+    }
+    return 0;
+}
+
+/**
+ * Function: edit_init
+ * -------------------
+ * Turns on the line editor when the shell is talking to a terminal, which
+ * doesn't happen for scripts, -c, pipes or TERM=dumb
+ *
+ * return: -1 on failure, 0 on success (whether or not the editor was turned on)
+ */
+int edit_init(void)
+{
+    const char *term = getenv("TERM");
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || (term != NULL && strcmp(term, "dumb") == 0))
+    {
+        return 0;
+    }
+    if (tcgetattr(STDIN_FILENO, &editor.cooked) == -1 || (editor.buf = malloc(EDIT_MIN_SIZE)) == NULL)
+    {
+        return -1;
+    }
+    editor.size = EDIT_MIN_SIZE;
+    editing = 1;
+    return 0;
+}
+
+/**
+ * Function: edit_line
+ * -------------------
+ * Reads a line typed at the terminal, which the user can edit as they type it.
+ * The terminal is put in raw mode for as long as the line is being typed, so
+ * the editor sees every key: the arrows and Ctrl-A/E/B/F move the cursor,
+ * Backspace, Delete and Ctrl-K/U/W delete, Up and Down (or Ctrl-P/N) go
+ * through the history, Ctrl-R searches it, Tab completes the word before the
+ * cursor and Ctrl-C gives the line up.  Keys already waiting (a paste) are
+ * handled before the line is drawn again.  The line stays valid until the next call.
+ *
+ * line: a pointer that will be set to the start of the line
+ *
+ * return: the length of the line including its newline,
+ *         0 at the end of the input (Ctrl-D on an empty line), -1 on failure
+ */
+ssize_t edit_line(const char **line)
+{
+    fflush(stdout);
+
+    // Commands may have changed the terminal's settings, which they get back after the line
+    if (tcgetattr(STDIN_FILENO, &editor.cooked) == -1)
+    {
+        return -1;
+    }
+    struct termios raw = editor.cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) == -1)
+    {
+        return -1;
+    }
+
+    editor.len = 0;
+    editor.pos = 0;
+    editor.scroll = 0;
+    editor.buf[0] = '\0';
+    if (history_fd != -1)
+    {
+        history_map();
+    }
+    editor.hist = history_count;
+
+    ssize_t ret;
+    int last_key = 0;
+    while (1)
+    {
+        int pending = 0;
+        if (ioctl(STDIN_FILENO, FIONREAD, &pending) == -1 || pending == 0)
+        {
+            edit_refresh(PROMPT, strlen(PROMPT));
+        }
+        int key = edit_read_key();
+        if (key == CTRL_KEY('R'))
+        {
+            key = edit_search();
+        }
+        if (key == -1)
+        {
+            ret = -1;
+            break;
+        }
+
+        int err = 0;
+        if (key == '\r' || key == '\n')
+        {
+            editor.pos = editor.len;
+            edit_refresh(PROMPT, strlen(PROMPT));
+            write(STDOUT_FILENO, "\n", 1);
+            ret = editor.len + 1;
+            if (edit_insert("\n", 1) == -1)
+            {
+                ret = -1;
+            }
+            break;
+        }
+        else if (key == KEY_EOF || (key == CTRL_KEY('D') && editor.len == 0))
+        {
+            if (key != KEY_EOF)
+            {
+                write(STDOUT_FILENO, "\n", 1);
+            }
+            ret = 0;
+            break;
+        }
+        else if (key == CTRL_KEY('C'))
+        {
+            // The line is given up, leaving an empty one to run
+            write(STDOUT_FILENO, "^C\n", 3);
+            editor.len = 0;
+            editor.pos = 0;
+            ret = 1;
+            if (edit_insert("\n", 1) == -1)
+            {
+                ret = -1;
+            }
+            break;
+        }
+        else if (key == '\t')
+        {
+            err = edit_complete(last_key == '\t');
+        }
+        else if (key >= ' ' && key < 256 && key != 127)
+        {
+            char c = key;
+            err = edit_insert(&c, 1);
+        }
+        else if (key == 127 || key == CTRL_KEY('H'))
+        {
+            if (editor.pos > 0)
+            {
+                edit_delete(edit_prev_char(editor.pos), editor.pos);
+            }
+        }
+        else if (key == KEY_DELETE || key == CTRL_KEY('D'))
+        {
+            if (editor.pos < editor.len)
+            {
+                edit_delete(editor.pos, edit_next_char(editor.pos));
+            }
+        }
+        else if (key == KEY_LEFT || key == CTRL_KEY('B'))
+        {
+            if (editor.pos > 0)
+            {
+                editor.pos = edit_prev_char(editor.pos);
+            }
+        }
+        else if (key == KEY_RIGHT || key == CTRL_KEY('F'))
+        {
+            if (editor.pos < editor.len)
+            {
+                editor.pos = edit_next_char(editor.pos);
+            }
+        }
+        else if (key == KEY_HOME || key == CTRL_KEY('A'))
+        {
+            editor.pos = 0;
+        }
+        else if (key == KEY_END || key == CTRL_KEY('E'))
+        {
+            editor.pos = editor.len;
+        }
+        else if (key == KEY_UP || key == CTRL_KEY('P'))
+        {
+            err = edit_history(0);
+        }
+        else if (key == KEY_DOWN || key == CTRL_KEY('N'))
+        {
+            err = edit_history(1);
+        }
+        else if (key == CTRL_KEY('K'))
+        {
+            edit_delete(editor.pos, editor.len);
+        }
+        else if (key == CTRL_KEY('U'))
+        {
+            edit_delete(0, editor.pos);
+        }
+        else if (key == CTRL_KEY('W'))
+        {
+            // Back over the spaces before the cursor, then the word before them
+            size_t start = editor.pos;
+            while (start > 0 && isspace((unsigned char)editor.buf[start - 1]))
+            {
+                start--;
+            }
+            while (start > 0 && !isspace((unsigned char)editor.buf[start - 1]))
+            {
+                start--;
+            }
+            edit_delete(start, editor.pos);
+        }
+        else if (key == CTRL_KEY('L'))
+        {
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        }
+        if (err == -1)
+        {
+            ret = -1;
+            break;
+        }
+        last_key = key;
+    }
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &editor.cooked);
+    *line = editor.buf;
+    return ret;
+}
+
+/**
+ * Function: edit_read_key
+ * -----------------------
+ * Reads a key from the terminal, turning the escape sequences the arrows,
+ * Home, End and Delete send into the keys of enum edit_key
+ *
+ * return: the byte read or the key, or -1 on failure
+ */
+int edit_read_key(void)
+{
+    unsigned char c;
+    ssize_t n;
+    do
+    {
+        n = read(STDIN_FILENO, &c, 1);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+    {
+        return n == 0 ? KEY_EOF : -1;
+    }
+    if (c != 27)
+    {
+        return c;
+    }
+
+    // An escape sequence comes all at once; on its own the escape key is just that
+    unsigned char seq[16];
+    size_t len = 0;
+    while (len < sizeof(seq))
+    {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, EDIT_ESCAPE_MS) <= 0 || read(STDIN_FILENO, &seq[len], 1) != 1)
+        {
+            return KEY_ESCAPE;
+        }
+
+        // "[" or "O", then maybe numbers separated by ";", then the final byte
+        len++;
+        if (len == 1 ? seq[0] != '[' && seq[0] != 'O' : !isdigit(seq[len - 1]) && seq[len - 1] != ';')
+        {
+            break;
+        }
+    }
+    if (len < 2)
+    {
+        return KEY_ESCAPE;
+    }
+    switch (seq[len - 1])
+    {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    case 'H':
+        return KEY_HOME;
+    case 'F':
+        return KEY_END;
+    case '~':
+        switch (atoi((char *)seq + 1))
+        {
+        case 1:
+        case 7:
+            return KEY_HOME;
+        case 3:
+            return KEY_DELETE;
+        case 4:
+        case 8:
+            return KEY_END;
+        }
+    }
+    return KEY_NONE;
+}
+
+/**
+ * Function: edit_refresh
+ * ----------------------
+ * Draws the line being edited over the one on the screen, with one write().
+ * A line wider than the terminal scrolls sideways to keep the cursor in view.
+ *
+ * prompt: printed before the line
+ *
+ * prompt_len: the length of prompt
+ */
+void edit_refresh(const char *prompt, size_t prompt_len)
+{
+    size_t prompt_width = edit_width(prompt, prompt_len);
+    size_t cols = edit_columns();
+    size_t room = cols > prompt_width + 1 ? cols - prompt_width - 1 : 1;
+
+    // Scroll just far enough for the cursor to show
+    if (editor.pos < editor.scroll)
+    {
+        editor.scroll = editor.pos;
+    }
+    size_t cursor = edit_width(editor.buf + editor.scroll, editor.pos - editor.scroll);
+    while (cursor > room)
+    {
+        editor.scroll = edit_next_char(editor.scroll);
+        cursor--;
+    }
+    size_t end = editor.scroll;
+    for (size_t width = 0; end < editor.len && width < room; width++)
+    {
+        end = edit_next_char(end);
+    }
+
+    char tail[32];
+    int tail_len = snprintf(tail, sizeof(tail), "\x1b[0K\r\x1b[%zuC", prompt_width + cursor);
+    struct iovec iov[4] = {
+        {"\r", 1},
+        {(void *)prompt, prompt_len},
+        {editor.buf + editor.scroll, end - editor.scroll},
+        {tail, tail_len},
+    };
+    writev(STDOUT_FILENO, iov, 4);
+}
+
+/**
+ * Function: edit_columns
+ * ----------------------
+ * Gives the width of the terminal, which can change at any time
+ *
+ * return: the number of columns, 80 if the terminal doesn't say
+ */
+size_t edit_columns(void)
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+    {
+        return ws.ws_col;
+    }
+    return 80;
+}
+
+/**
+ * Function: edit_width
+ * --------------------
+ * Counts the columns a string takes on the terminal, one for each UTF-8 character
+ *
+ * s: the string
+ *
+ * n: the number of bytes in s
+ *
+ * return: the width of s
+ */
+size_t edit_width(const char *s, size_t n)
+{
+    size_t width = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            width++;
+        }
+    }
+    return width;
+}
+
+/**
+ * Function: edit_next_char
+ * ------------------------
+ * Finds the start of the character after the one at an offset of the line,
+ * stepping over the continuation bytes of a UTF-8 character
+ *
+ * i: the offset, before the end of the line
+ *
+ * return: the offset of the next character, or the end of the line
+ */
+size_t edit_next_char(size_t i)
+{
+    i++;
+    while (i < editor.len && (editor.buf[i] & 0xc0) == 0x80)
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Function: edit_prev_char
+ * ------------------------
+ * Finds the start of the character before an offset of the line
+ *
+ * i: the offset, after the start of the line
+ *
+ * return: the offset of the previous character
+ */
+size_t edit_prev_char(size_t i)
+{
+    i--;
+    while (i > 0 && (editor.buf[i] & 0xc0) == 0x80)
+    {
+        i--;
+    }
+    return i;
+}
+
+/**
+ * Function: edit_insert
+ * ---------------------
+ * Inserts bytes into the line at the cursor, which moves past them
+ *
+ * s: the bytes
+ *
+ * n: the number of bytes
+ *
+ * return: -1 on failure, 0 on success
+ */
+int edit_insert(const char *s, size_t n)
+{
+    if (editor.len + n + 1 > editor.size)
+    {
+        size_t size = editor.size * 2;
+        while (size < editor.len + n + 1)
+        {
+            size *= 2;
+        }
+        char *buf = realloc(editor.buf, size);
+        if (buf == NULL)
+        {
+            return -1;
+        }
+        editor.buf = buf;
+        editor.size = size;
+    }
+    memmove(editor.buf + editor.pos + n, editor.buf + editor.pos, editor.len - editor.pos + 1);
+    memcpy(editor.buf + editor.pos, s, n);
+    editor.len += n;
+    editor.pos += n;
+    return 0;
+}
+
+/**
+ * Function: edit_delete
+ * ---------------------
+ * Deletes part of the line, moving the cursor along with the text after it
+ *
+ * start: the offset of the first byte deleted
+ *
+ * end: the offset after the last byte deleted
+ */
+void edit_delete(size_t start, size_t end)
+{
+    memmove(editor.buf + start, editor.buf + end, editor.len - end + 1);
+    editor.len -= end - start;
+    if (editor.pos >= end)
+    {
+        editor.pos -= end - start;
+    }
+    else if (editor.pos > start)
+    {
+        editor.pos = start;
+    }
+}
+
+/**
+ * Function: edit_set
+ * ------------------
+ * Replaces the whole line, leaving the cursor at its end
+ *
+ * s: the new line
+ *
+ * n: the length of s
+ *
+ * return: -1 on failure, 0 on success
+ */
+int edit_set(const char *s, size_t n)
+{
+    editor.len = 0;
+    editor.pos = 0;
+    editor.buf[0] = '\0';
+    return edit_insert(s, n);
+}
+
+/**
+ * Function: edit_save
+ * -------------------
+ * Keeps the line being typed before it's replaced with a history entry, so
+ * going back down the history gets it back
+ *
+ * return: -1 on failure, 0 on success
+ */
+int edit_save(void)
+{
+    if (editor.hist != history_count)
+    {
+        return 0;
+    }
+    char *saved = realloc(editor.saved, editor.len + 1);
+    if (saved == NULL)
+    {
+        return -1;
+    }
+    memcpy(saved, editor.buf, editor.len);
+    editor.saved = saved;
+    editor.saved_len = editor.len;
+    return 0;
+}
+
+/**
+ * Function: edit_history
+ * ----------------------
+ * Replaces the line with the history entry before (Up) or after (Down) the
+ * one shown.  Going down past the newest entry gets back the line being typed.
+ *
+ * newer: 1 to go to the next newer entry, 0 to go to the next older one
+ *
+ * return: -1 on failure, 0 on success
+ */
+int edit_history(int newer)
+{
+    if (newer ? editor.hist >= history_count : editor.hist == 0)
+    {
+        edit_bell();
+        return 0;
+    }
+    if (edit_save() == -1)
+    {
+        return -1;
+    }
+    editor.hist += newer ? 1 : -1;
+    if (editor.hist == history_count)
+    {
+        return edit_set(editor.saved, editor.saved_len);
+    }
+    const char *entry;
+    size_t len = history_entry(editor.hist, &entry);
+    return edit_set(entry, len);
+}
+
+/**
+ * Function: edit_search
+ * ---------------------
+ * Searches the history backwards as a string is typed (Ctrl-R), showing the
+ * newest entry containing it with the cursor on the match.  Ctrl-R again
+ * finds the next older match, Ctrl-G or Ctrl-C gives the search up and any
+ * other key takes the entry shown and is handled as usual, Enter running it.
+ *
+ * return: the key that ended the search, KEY_NONE if there is nothing more
+ *         to do with it, or -1 on failure
+ */
+int edit_search(void)
+{
+    char query[EDIT_SEARCH_MAX];
+    size_t query_len = 0;
+    long match = -1; // The entry shown
+    int failed = 0;
+    char prompt[EDIT_SEARCH_MAX + 32];
+
+    // The line being edited comes back if the search is given up
+    size_t orig_hist = editor.hist;
+    char *orig = edit_save() == 0 ? strndup(editor.buf, editor.len) : NULL;
+    if (orig == NULL)
+    {
+        return -1;
+    }
+
+    while (1)
+    {
+        int prompt_len = snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", failed ? "failed " : "",
+                                  (int)query_len, query);
+        edit_refresh(prompt, prompt_len);
+        int key = edit_read_key();
+
+        // Where the search starts, history_count + 1 for no search
+        size_t before = history_count + 1;
+        if (key == CTRL_KEY('R'))
+        {
+            before = match >= 0 ? (size_t)match : history_count;
+        }
+        else if (key == 127 || key == CTRL_KEY('H'))
+        {
+            while (query_len > 0 && (query[query_len - 1] & 0xc0) == 0x80)
+            {
+                query_len--;
+            }
+            if (query_len > 0)
+            {
+                query_len--;
+            }
+            before = history_count;
+        }
+        else if (key >= ' ' && key < 256 && key != 127)
+        {
+            if (query_len < sizeof(query))
+            {
+                query[query_len++] = key;
+            }
+            before = match >= 0 ? (size_t)match + 1 : history_count;
+        }
+        else if (key == CTRL_KEY('G') || key == CTRL_KEY('C'))
+        {
+            editor.hist = orig_hist;
+            int ret = edit_set(orig, strlen(orig));
+            free(orig);
+            return ret == -1 ? -1 : KEY_NONE;
+        }
+        else
+        {
+            free(orig);
+            return key == KEY_ESCAPE ? KEY_NONE : key;
+        }
+
+        failed = 0;
+        if (before <= history_count && query_len > 0)
+        {
+            long i = history_find(query, query_len, before, 1);
+            failed = i == -1;
+            if (i != -1)
+            {
+                const char *entry;
+                size_t len = history_entry(i, &entry);
+                if (edit_set(entry, len) == -1)
+                {
+                    free(orig);
+                    return -1;
+                }
+                editor.pos = (const char *)memmem(entry, len, query, query_len) - entry;
+                editor.hist = i;
+                match = i;
+            }
+        }
+    }
+}
+
+/**
+ * Function: edit_complete
+ * -----------------------
+ * Completes the word before the cursor (Tab).  The first word of a command
+ * is completed from the trie of commands (see trie_refresh()) unless it has
+ * a "/" in it; anything else is completed from the listing of the directory
+ * it names (see dir_cache_get()), hidden files only when the word starts
+ * with ".".  The word is extended as far as all the completions agree; one
+ * that's the only completion is followed by a space, or a "/" for a
+ * directory.  If there are several, pressing Tab again lists them.
+ *
+ * list: 1 to list the completions when there are several
+ *
+ * return: -1 on failure, 0 on success (including when nothing completes)
+ */
+int edit_complete(int list)
+{
+    size_t start = editor.pos;
+    while (start > 0 && !is_delim(editor.buf[start - 1]))
+    {
+        start--;
+    }
+    const char *word = editor.buf + start;
+    size_t word_len = editor.pos - start;
+    size_t before = start;
+    while (before > 0 && (editor.buf[before - 1] == ' ' || editor.buf[before - 1] == '\t'))
+    {
+        before--;
+    }
+    int command = (before == 0 || strchr(";|&", editor.buf[before - 1]) != NULL) && memchr(word, '/', word_len) == NULL;
+
+    // Everything from here on completes is extended by ext, if they agree on anything more
+    char ext_buf[NAME_MAX + 1];
+    const char *ext = ext_buf;
+    size_t ext_len = 0;
+    size_t count;
+    char **names = NULL;
+    long node = -1;
+    if (command)
+    {
+        if (trie_refresh() == -1 || word_len > NAME_MAX || (node = trie_find(word, word_len)) == -1)
+        {
+            edit_bell();
+            return 0;
+        }
+        count = trie[node].words;
+
+        // Follow the trie as long as there's only one way to go
+        for (uint32_t n = node; trie[n].count == 0;)
+        {
+            uint32_t next = 0;
+            int live = 0;
+            for (uint32_t c = trie[n].child; c != 0; c = trie[c].sibling)
+            {
+                if (trie[c].words > 0)
+                {
+                    next = c;
+                    live++;
+                }
+            }
+            if (live != 1)
+            {
+                break;
+            }
+            ext_buf[ext_len++] = trie[next].c;
+            n = next;
+        }
+    }
+    else
+    {
+        const char *slash = memrchr(word, '/', word_len);
+        size_t dir_len = slash != NULL ? (size_t)(slash + 1 - word) : 0;
+        char dir[PATH_MAX];
+        struct dir_listing *l = NULL;
+        if (dir_len < sizeof(dir))
+        {
+            memcpy(dir, word, dir_len);
+            dir[dir_len] = '\0';
+            l = dir_cache_get(dir);
+        }
+        if (l == NULL)
+        {
+            edit_bell();
+            return 0;
+        }
+        const char *base = word + dir_len;
+        size_t base_len = word_len - dir_len;
+
+        // The names starting with base are next to each other in either part of the listing
+        size_t lo = 0;
+        size_t hi = l->hidden;
+        if (base_len == 0 || base[0] != '.')
+        {
+            lo = l->hidden;
+            hi = l->count;
+        }
+        size_t end = hi;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (strncmp(l->names[mid], base, base_len) < 0)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        hi = end;
+        for (end = lo; end < hi;)
+        {
+            size_t mid = end + (hi - end) / 2;
+            if (strncmp(l->names[mid], base, base_len) <= 0)
+            {
+                end = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        names = l->names + lo;
+        count = end - lo;
+
+        // Sorted, the first and the last agree on what all of them do
+        if (count > 0)
+        {
+            ext = names[0] + base_len;
+            while (ext[ext_len] != '\0' && ext[ext_len] == names[count - 1][base_len + ext_len])
+            {
+                ext_len++;
+            }
+        }
+    }
+
+    if (count == 0)
+    {
+        edit_bell();
+        return 0;
+    }
+    if (ext_len > 0 || count == 1)
+    {
+        if (edit_insert(ext, ext_len) == -1)
+        {
+            return -1;
+        }
+        if (count == 1 && (ext_len == 0 || ext[ext_len - 1] != '/'))
+        {
+            return edit_insert(" ", 1);
+        }
+        return 0;
+    }
+    if (!list)
+    {
+        edit_bell();
+        return 0;
+    }
+
+    // The commands are only gathered when they're listed
+    int ret = edit_confirm(count);
+    if (ret != 1)
+    {
+        return ret;
+    }
+    if (command)
+    {
+        char prefix[NAME_MAX + 1];
+        memcpy(prefix, word, word_len);
+        arena_reset(&complete_arena);
+        if ((names = arena_alloc(&complete_arena, count * sizeof(char *))) == NULL ||
+            trie_collect(node, prefix, word_len, names, 0) == -1)
+        {
+            return -1;
+        }
+    }
+    return edit_list(names, count);
+}
+
+/**
+ * Function: edit_confirm
+ * ----------------------
+ * Asks before listing more than COMPLETE_ASK completions
+ *
+ * count: the number of completions
+ *
+ * return: 1 to list them, 0 not to, -1 on failure
+ */
+int edit_confirm(size_t count)
+{
+    if (count <= COMPLETE_ASK)
+    {
+        return 1;
+    }
+    printf("\nDisplay all %zu possibilities? (y or n)", count);
+    fflush(stdout);
+    int key = edit_read_key();
+    if (key == -1)
+    {
+        return -1;
+    }
+    if (key == 'y' || key == 'Y')
+    {
+        return 1;
+    }
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Function: edit_list
+ * -------------------
+ * Lists completions under the line being edited, in columns like ls
+ *
+ * names: the completions, sorted
+ *
+ * count: the number of completions
+ *
+ * return: -1 on failure, 0 on success
+ */
+int edit_list(char **names, size_t count)
+{
+    size_t width = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t w = edit_width(names[i], strlen(names[i]));
+        if (w > width)
+        {
+            width = w;
+        }
+    }
+    width += 2;
+    size_t per_row = edit_columns() / width;
+    if (per_row == 0)
+    {
+        per_row = 1;
+    }
+    size_t rows = (count + per_row - 1) / per_row;
+    printf("\n");
+    for (size_t r = 0; r < rows; r++)
+    {
+        for (size_t c = 0; c < per_row && c * rows + r < count; c++)
+        {
+            const char *name = names[c * rows + r];
+            int pad = c + 1 < per_row && (c + 1) * rows + r < count ? width - edit_width(name, strlen(name)) : 0;
+            printf("%s%*s", name, pad, "");
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Function: edit_bell
+ * -------------------
+ * Rings the terminal's bell, when a key can't do anything
+ */
+void edit_bell(void)
+{
+    write(STDOUT_FILENO, "\a", 1);
+}
+
+/**
+ * Function: arena_alloc
+ * ---------------------
+ * Allocates memory from an arena.  Memory from an arena is never freed on its own,
+ * all of it is released at once by arena_reset().
+ * Each new chunk is twice as big as the one before, so a long line takes a few
+ * big chunks, which malloc() maps on their own and gives back to the kernel when
+ * they're freed, rather than many small ones other allocations get stuck between.
+ *
+ * a: the arena to allocate from
+ *
+ * size: the number of bytes needed
+ *
+ * return: a pointer to the memory (suitably aligned for any type), or NULL on failure
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    struct arena_chunk *chunk = a->head;
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        size_t chunk_size = chunk == NULL ? ARENA_CHUNK_SIZE : chunk->size * 2;
+        if (chunk_size < size)
+        {
+            chunk_size = size;
+        }
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = a->head;
+        a->head = chunk;
+    }
+    void *p = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/**
+ * Function: arena_strndup
+ * -----------------------
+ * Copies the first n characters of a string into an arena
+ *
+ * return: the NUL-terminated copy, or NULL on failure
+ */
+char *arena_strndup(struct arena *a, const char *s, size_t n)
+{
+    char *copy = arena_alloc(a, n + 1);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+/**
+ * Function: arena_reset
+ * ---------------------
+ * Releases everything allocated from an arena.
+ * One chunk of the default size is kept for the next line, so a line that fits
+ * in it costs no calls to malloc() or free() at all.  Bigger chunks, made for
+ * a single long line, are always freed, so one huge line doesn't leave the
+ * shell holding its memory for the rest of the session.
+ *
+ * a: the arena to reset
+ */
+void arena_reset(struct arena *a)
+{
+    struct arena_chunk *keep = NULL;
+    struct arena_chunk *chunk = a->head;
+    while (chunk != NULL)
+    {
+        struct arena_chunk *next = chunk->next;
+        if (keep == NULL && chunk->size == ARENA_CHUNK_SIZE)
+        {
+            keep = chunk;
+        }
+        else
+        {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    if (keep != NULL)
+    {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    a->head = keep;
+}
+
+/**
+ * Function: parse_line
+ * --------------------
+ * Turns a line into a list of pipelines in a single pass over its characters.
+ * Words end at whitespace or at one of the operators ";", "&", "|", ">" and "<", so
+ * the operators don't need spaces around them.  "&" ends a pipeline like ";"
+ * does, but marks it to run in the background.  Every word, argument array and AST
+ * node is allocated from the arena, and the line itself is left untouched.
+ *
+ * Empty commands are allowed between ";"s (e.g. "cmd ;" or "; cmd"), but the
+ * stages of a pipeline can't be empty, and redirections need a command and must
+ * come at the very end of it.  A command can have one "<" and one ">" or ">>",
+ * but only the last stage can redirect its output.  ";;", "&&", "||" and "<<" are errors.
+ *
+ * a: the arena the AST is allocated from
+ *
+ * line: the line being parsed, which doesn't need to be NUL-terminated
+ *
+ * len: the length of the line
+ *
+ * list: a pointer that will be set to the parsed list of pipelines (empty for a blank line)
+ *
+ * return: 0 on success, -1 on a syntax error or allocation failure
+ */
+int parse_line(struct arena *a, const char *line, size_t len, struct cmd_list **list)
+{
+    struct parser p;
+    p.arena = a;
+    p.list = arena_alloc(a, sizeof(struct cmd_list));
+    if (p.list == NULL)
+    {
+        return -1;
+    }
+    p.list->pipelines = NULL;
+    p.list->num_pipelines = 0;
+    p.pl = NULL;
+    p.pl_tail = &p.list->pipelines;
+    p.redirs = NULL;
+    p.redir_tail = &p.redirs;
+    p.want_target = 0;
+    p.text_start = NULL;
+    p.expand = 0;
+    num_parse_words = 0;
+
+    const char *c = line;
+    const char *end = line + len;
+    while (1)
+    {
+        if (c < end && (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\0'))
+        {
+            c++;
+            continue;
+        }
+        if (p.text_start == NULL)
+        {
+            p.text_start = c;
+        }
+
+        if (c < end && *c == '&')
+        {
+            // A background pipeline can't be empty
+            if ((c + 1 < end && c[1] == '&') || parse_end_command(&p) != 0)
+            {
+                return -1;
+            }
+            p.pl->background = 1;
+            parse_end_pipeline(&p, c);
+            c++;
+        }
+        else if (c == end || *c == ';')
+        {
+            if (c + 1 < end && *c == ';' && c[1] == ';')
+            {
+                return -1;
+            }
+            int rc = parse_end_command(&p);
+
+            // An empty command is fine on its own, but not as the last stage of a pipeline
+            if (rc == -1 || (rc == 1 && p.pl != NULL))
+            {
+                return -1;
+            }
+            parse_end_pipeline(&p, c);
+            if (c == end)
+            {
+                break;
+            }
+            c++;
+        }
+        else if (*c == '|')
+        {
+            // Only the last stage of a pipeline may redirect its output
+            if ((c + 1 < end && c[1] == '|') || has_redir(p.redirs, REDIR_OUT) || has_redir(p.redirs, REDIR_APPEND) ||
+                parse_end_command(&p) != 0)
+            {
+                return -1;
+            }
+            c++;
+        }
+        else if (*c == '>' || *c == '<')
+        {
+            // Each command gets at most one input and one output redirection
+            enum redir_type type = REDIR_IN;
+            if (*c == '>')
+            {
+                type = c + 1 < end && c[1] == '>' ? REDIR_APPEND : REDIR_OUT;
+            }
+            c += type == REDIR_APPEND ? 2 : 1;
+            int taken = type == REDIR_IN ? has_redir(p.redirs, REDIR_IN)
+                                         : has_redir(p.redirs, REDIR_OUT) || has_redir(p.redirs, REDIR_APPEND);
+            if ((c < end && (*c == '>' || *c == '<')) || taken || p.want_target)
+            {
+                return -1;
+            }
+            p.want_target = 1;
+            p.want_type = type;
+        }
+        else
+        {
+            const char *start = c;
+            while (c < end && !is_delim(*c))
+            {
+                c++;
+            }
+            char *word = arena_strndup(a, start, c - start);
+            if (word == NULL)
+            {
+                return -1;
+            }
+
+            // Variables and patterns are expanded when the pipeline runs, since an earlier one may change them
+            if (memchr(word, '$', c - start) != NULL || has_glob(word, c - start))
+            {
+                p.expand = 1;
+            }
+
+            if (p.want_target)
+            {
+                struct redir *r = arena_alloc(a, sizeof(struct redir));
+                if (r == NULL)
+                {
+                    return -1;
+                }
+                r->type = p.want_type;
+                r->target = word;
+                r->next = NULL;
+                *p.redir_tail = r;
+                p.redir_tail = &r->next;
+                p.want_target = 0;
+                continue;
+            }
+
+            // Nothing may follow the target of a redirection
+            if (p.redirs != NULL)
+            {
+                return -1;
+            }
+            if (num_parse_words == parse_words_size)
+            {
+                int new_size = parse_words_size == 0 ? 16 : parse_words_size * 2;
+                char **words = realloc(parse_words, sizeof(char *) * new_size);
+                if (words == NULL)
+                {
+                    return -1;
+                }
+                parse_words = words;
+                parse_words_size = new_size;
+            }
+            parse_words[num_parse_words++] = word;
+        }
+    }
+
+    *list = p.list;
+    return 0;
+}
+
+/**
+ * Function: parse_end_command
+ * ---------------------------
+ * Finishes the simple command being parsed and appends it to the current
+ * pipeline, starting a new pipeline if there is none.
+ *
+ * p: the parser state
+ *
+ * return: 0 on success, 1 if the command was empty (and nothing was added),
+ *         -1 on a syntax error or allocation failure
+ */
+int parse_end_command(struct parser *p)
+{
+    if (p->want_target)
+    {
+        return -1;
+    }
+    if (num_parse_words == 0)
+    {
+        // A redirection without a command
+        return p->redirs == NULL ? 1 : -1;
+    }
+
+    struct command *cmd = arena_alloc(p->arena, sizeof(struct command));
+    char **argv = arena_alloc(p->arena, sizeof(char *) * (num_parse_words + 1));
+    if (cmd == NULL || argv == NULL)
+    {
+        return -1;
+    }
+    memcpy(argv, parse_words, sizeof(char *) * num_parse_words);
+    argv[num_parse_words] = NULL;
+    cmd->argv = argv;
+    cmd->argc = num_parse_words;
+    cmd->redirs = p->redirs;
+    cmd->next = NULL;
+    num_parse_words = 0;
+    p->redirs = NULL;
+    p->redir_tail = &p->redirs;
+
+    if (p->pl == NULL)
+    {
+        p->pl = arena_alloc(p->arena, sizeof(struct pipeline));
+        if (p->pl == NULL)
+        {
+            return -1;
+        }
+        p->pl->cmds = NULL;
+        p->pl->num_cmds = 0;
+        p->pl->background = 0;
+        p->pl->expand = 0;
+        p->pl->text = NULL;
+        p->pl->next = NULL;
+        p->cmd_tail = &p->pl->cmds;
+    }
+    *p->cmd_tail = cmd;
+    p->cmd_tail = &cmd->next;
+    p->pl->num_cmds++;
+    return 0;
+}
+
+/**
+ * Function: parse_end_pipeline
+ * ----------------------------
+ * Appends the pipeline being parsed (if it has any stages) to the list,
+ * keeping its text for the jobs built-in
+ *
+ * p: the parser state
+ *
+ * end: where the pipeline's text ends (its ";", "&" or the end of the line)
+ */
+void parse_end_pipeline(struct parser *p, const char *end)
+{
+    const char *start = p->text_start;
+    int expand = p->expand;
+    p->text_start = NULL;
+    p->expand = 0;
+    if (p->pl == NULL)
+    {
+        return;
+    }
+    p->pl->expand = expand;
+    while (end > start && isspace((unsigned char)end[-1]))
+    {
+        end--;
+    }
+    p->pl->text = arena_strndup(p->arena, start, end - start);
+    *p->pl_tail = p->pl;
+    p->pl_tail = &p->pl->next;
+    p->list->num_pipelines++;
+    p->pl = NULL;
+}
+
+/**
+ * Function: expand_pipeline
+ * -------------------------
+ * Expands the variables and patterns in the words of a pipeline, just before
+ * it runs.  Words without a "$" are shared with the parsed pipeline, and the
+ * others are copied with their variables filled in (see expand_word()).  There
+ * is no splitting: a variable's value stays part of the one word, however many
+ * spaces it has, and it isn't parsed again.  Words that come out empty are
+ * dropped, as an unset variable is meant to be.
+ * Then each word that is a pattern (other than the assignments a command
+ * starts with) is replaced with the paths it matches, in order (see
+ * glob_word()), or kept as it is if there are none.  A redirection target
+ * may match a single path.
+ *
+ * a: the arena the expanded pipeline is allocated from
+ *
+ * pl: the parsed pipeline
+ *
+ * return: the expanded pipeline, whose cmds is NULL if it was a single command that expanded
+ *         to nothing, or NULL (with errno set) if a reference is malformed, any other
+ *         command or a redirection target is empty, a redirection target matches more
+ *         than one path, or there is no memory
+ */
+struct pipeline *expand_pipeline(struct arena *a, struct pipeline *pl)
+{
+    struct pipeline *out = arena_alloc(a, sizeof(struct pipeline));
+    if (out == NULL)
+    {
+        return NULL;
+    }
+    *out = *pl;
+    struct command **cmd_tail = &out->cmds;
+    for (struct command *cmd = pl->cmds; cmd != NULL; cmd = cmd->next)
+    {
+        num_expand_words = 0;
+        int assigning = 1;
+        for (int i = 0; i < cmd->argc; i++)
+        {
+            char *word = strchr(cmd->argv[i], '$') != NULL ? expand_word(a, cmd->argv[i]) : cmd->argv[i];
+            if (word == NULL)
+            {
+                return NULL;
+            }
+            assigning = assigning && is_assignment(word);
+            long matches = 0;
+            if (!assigning && has_glob(word, strlen(word)) && (matches = glob_word(a, word)) == -1)
+            {
+                return NULL;
+            }
+            if (matches == 0 && *word != '\0' && expand_add(word) == -1)
+            {
+                return NULL;
+            }
+        }
+        int argc = num_expand_words;
+        struct command *c = arena_alloc(a, sizeof(struct command));
+        char **argv = arena_alloc(a, sizeof(char *) * (argc + 1));
+        if (c == NULL || argv == NULL)
+        {
+            return NULL;
+        }
+        memcpy(argv, expand_words, sizeof(char *) * argc);
+        argv[argc] = NULL;
+
+        c->argv = argv;
+        c->argc = argc;
+        c->redirs = NULL;
+        c->next = NULL;
+        struct redir **redir_tail = &c->redirs;
+        for (struct redir *r = cmd->redirs; r != NULL; r = r->next)
+        {
+            struct redir *copy = arena_alloc(a, sizeof(struct redir));
+            if (copy == NULL)
+            {
+                return NULL;
+            }
+            copy->target = strchr(r->target, '$') != NULL ? expand_word(a, r->target) : r->target;
+            if (copy->target == NULL)
+            {
+                return NULL;
+            }
+            long matches = 0;
+            num_expand_words = 0;
+            if (has_glob(copy->target, strlen(copy->target)) && (matches = glob_word(a, copy->target)) == -1)
+            {
+                return NULL;
+            }
+            if (matches == 1)
+            {
+                copy->target = expand_words[0];
+            }
+            if (*copy->target == '\0' || matches > 1)
+            {
+                errno = EINVAL;
+                return NULL;
+            }
+            copy->type = r->type;
+            copy->next = NULL;
+            *redir_tail = copy;
+            redir_tail = &copy->next;
+        }
+
+        if (argc == 0 && (pl->num_cmds > 1 || c->redirs != NULL))
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (argc == 0)
+        {
+            out->cmds = NULL;
+            return out;
+        }
+        *cmd_tail = c;
+        cmd_tail = &c->next;
+    }
+    return out;
+}
+
+/**
+ * Function: expand_word
+ * ---------------------
+ * Fills in the variables of a word: "$NAME" and "${NAME}" are replaced with
+ * the variable's value (nothing if it isn't set), "$?" with the status of the
+ * last pipeline and "$$" with the shell's pid.  A "$" that doesn't start one
+ * of those is kept as it is.
+ * The expanded word is measured first, so it is allocated once.
+ *
+ * a: the arena the expanded word is allocated from
+ *
+ * word: the word to expand
+ *
+ * return: the expanded word, or NULL (with errno set) if a "${" isn't closed
+ *         around a name or there is no memory
+ */
+char *expand_word(struct arena *a, char *word)
+{
+    char *out = NULL;
+    size_t len = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t n = 0;
+        const char *c = word;
+        while (*c != '\0')
+        {
+            // Copy everything up to the next "$" in one go
+            const char *dollar = strchr(c, '$');
+            size_t plain = dollar == NULL ? strlen(c) : (size_t)(dollar - c);
+            if (out != NULL)
+            {
+                memcpy(out + n, c, plain);
+            }
+            n += plain;
+            c += plain;
+            if (*c == '\0')
+            {
+                break;
+            }
+
+            char num[24];
+            size_t skip;
+            const char *value = expand_ref(c, &skip, num);
+            if (skip == 0)
+            {
+                errno = EINVAL;
+                return NULL;
+            }
+            size_t value_len = value == NULL ? 0 : strlen(value);
+            if (out != NULL)
+            {
+                memcpy(out + n, value, value_len);
+            }
+            n += value_len;
+            c += skip;
+        }
+
+        if (pass == 0)
+        {
+            len = n;
+            if ((out = arena_alloc(a, len + 1)) == NULL)
+            {
+                return NULL;
+            }
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/**
+ * Function: expand_ref
+ * --------------------
+ * Finds the value of the variable reference at a "$"
+ *
+ * c: the "$"
+ *
+ * skip: set to the length of the reference, or 0 if it is a malformed "${"
+ *
+ * num: room for the digits of "$?" or "$$" (at least 24 bytes)
+ *
+ * return: the value, which is "$" itself for a lone "$", or NULL if the variable isn't set
+ */
+const char *expand_ref(const char *c, size_t *skip, char *num)
+{
+    if (c[1] == '?' || c[1] == '$')
+    {
+        snprintf(num, 24, "%ld", c[1] == '?' ? (long)last_status : (long)getpid());
+        *skip = 2;
+        return num;
+    }
+    if (c[1] == '{')
+    {
+        size_t len = var_name_len(c + 2);
+        if (len == 0 || c[2 + len] != '}')
+        {
+            *skip = 0;
+            return NULL;
+        }
+        *skip = len + 3;
+        return var_lookup(c + 2, len);
+    }
+    size_t len = var_name_len(c + 1);
+    *skip = len + 1;
+    return len == 0 ? "$" : var_lookup(c + 1, len);
+}
+
+/**
+ * Function: has_glob
+ * ------------------
+ * Checks whether a word (or part of one) is a pattern: whether it has a "*",
+ * a "?" or a "[" closed by a "]" later on.  A lone "[" (like the test command)
+ * is just a word.
+ *
+ * s: the word
+ *
+ * len: its length
+ *
+ * return: 1 if it is a pattern, 0 otherwise
+ */
+int has_glob(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] == '*' || s[i] == '?' || (s[i] == '[' && memchr(s + i + 1, ']', len - i - 1) != NULL))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: glob_word
+ * -------------------
+ * Expands a pattern into the paths it matches, which are added to
+ * expand_words in sorted order (see sort_paths()).  The pattern is walked one
+ * "/"-separated component at a time (see glob_walk()), so only the
+ * directories it can match in are read.
+ *
+ * a: the arena the paths are allocated from
+ *
+ * pattern: the pattern
+ *
+ * return: the number of paths added (0 if nothing matched), or -1 on failure
+ */
+long glob_word(struct arena *a, const char *pattern)
+{
+    char path[PATH_MAX];
+    size_t len = 0;
+    if (*pattern == '/')
+    {
+        path[len++] = '/';
+    }
+    size_t start = num_expand_words;
+    if (glob_walk(a, path, len, pattern + len) == -1)
+    {
+        num_expand_words = start;
+        return -1;
+    }
+    if (sort_paths(expand_words + start, num_expand_words - start) == -1)
+    {
+        num_expand_words = start;
+        return -1;
+    }
+    return num_expand_words - start;
+}
+
+/**
+ * Function: glob_walk
+ * -------------------
+ * Matches the rest of a pattern against what's in one directory.
+ * Components without wildcards are taken as they are, without reading the
+ * directory.  Otherwise the directory is read in large getdents64() batches,
+ * and each name is matched (see glob_match()) right in the buffer, so the only
+ * names ever copied are the ones that match.  The subdirectories to go on into
+ * are collected in one block while the directory is read, and only walked once
+ * it is closed, so the batch buffer is shared by the whole walk.
+ * A "**" component matches any number of directories (not following symbolic
+ * links), and names starting with "." are only matched by a component that
+ * starts with "." too.
+ *
+ * a: the arena the paths are allocated from
+ *
+ * path: the directory so far, ending with a "/" unless it's empty (for the
+ *       working directory); PATH_MAX bytes long, and the walk writes after len
+ *
+ * len: the length of the directory
+ *
+ * pattern: the rest of the pattern
+ *
+ * return: -1 on failure, 0 on success (even if nothing matched)
+ */
+int glob_walk(struct arena *a, char *path, size_t len, const char *pattern)
+{
+    while (*pattern == '/')
+    {
+        pattern++;
+    }
+
+    // A pattern ending with "/" only matches directories
+    if (*pattern == '\0')
+    {
+        struct stat st;
+        path[len] = '\0';
+        return stat(path, &st) == 0 && S_ISDIR(st.st_mode) ? glob_add(a, path, len) : 0;
+    }
+
+    const char *slash = strchr(pattern, '/');
+    size_t comp_len = slash == NULL ? strlen(pattern) : (size_t)(slash - pattern);
+    const char *rest = slash;
+    if (len + comp_len + 2 > PATH_MAX)
+    {
+        return 0;
+    }
+    if (!has_glob(pattern, comp_len))
+    {
+        memcpy(path + len, pattern, comp_len);
+        len += comp_len;
+        path[len] = '\0';
+        if (rest == NULL)
+        {
+            struct stat st;
+            return lstat(path, &st) == 0 ? glob_add(a, path, len) : 0;
+        }
+        path[len] = '/';
+        return glob_walk(a, path, len + 1, rest);
+    }
+
+    // "**" matches no directories at all, as well as any number of them (and on its own, everything under them)
+    int recurse = comp_len == 2 && pattern[0] == '*' && pattern[1] == '*';
+    if (recurse && glob_walk(a, path, len, rest == NULL ? "*" : rest) == -1)
+    {
+        return -1;
+    }
+
+    path[len] = '\0';
+    int fd = open(len == 0 ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    char *dirs = NULL; // The subdirectories to go into, NUL-terminated one after another
+    size_t dirs_len = 0;
+    size_t dirs_size = 0;
+    int ret = 0;
+    static char dents[GLOB_DENTS_SIZE] __attribute__((aligned(8)));
+    long n;
+    while (ret == 0 && (n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0)
+    {
+        for (long off = 0; off < n && ret == 0;)
+        {
+            struct dirent64 *d = (struct dirent64 *)(dents + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (pattern[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+            if (!recurse && !glob_match(pattern, comp_len, name))
+            {
+                continue;
+            }
+            size_t name_len = strlen(name);
+            if (!recurse && rest == NULL)
+            {
+                if (len + name_len < PATH_MAX)
+                {
+                    memcpy(path + len, name, name_len + 1);
+                    ret = glob_add(a, path, len + name_len);
+                }
+                continue;
+            }
+
+            // "**" only goes into real directories; a symbolic link (or an unknown type) is tried for the rest
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN && recurse)
+            {
+                struct stat st;
+                type = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type != DT_DIR && (recurse || (type != DT_LNK && type != DT_UNKNOWN)))
+            {
+                continue;
+            }
+            if (dirs_len + name_len + 1 > dirs_size)
+            {
+                size_t new_size = dirs_size == 0 ? 4096 : dirs_size * 2;
+                while (new_size < dirs_len + name_len + 1)
+                {
+                    new_size *= 2;
+                }
+                char *new_dirs = realloc(dirs, new_size);
+                if (new_dirs == NULL)
+                {
+                    ret = -1;
+                    break;
+                }
+                dirs = new_dirs;
+                dirs_size = new_size;
+            }
+            memcpy(dirs + dirs_len, name, name_len + 1);
+            dirs_len += name_len + 1;
+        }
+    }
+    close(fd);
+
+    // "**" carries on into each subdirectory as it is
+    for (size_t i = 0; ret == 0 && i < dirs_len;)
+    {
+        size_t name_len = strlen(dirs + i);
+        if (len + name_len + 2 <= PATH_MAX)
+        {
+            memcpy(path + len, dirs + i, name_len);
+            path[len + name_len] = '/';
+            ret = glob_walk(a, path, len + name_len + 1, recurse ? pattern : rest);
+        }
+        i += name_len + 1;
+    }
+    free(dirs);
+    return ret;
+}
+
+/**
+ * Function: glob_match
+ * --------------------
+ * Matches a name against one component of a pattern: "*" matches any
+ * number of characters, "?" any one character and "[...]" one of the
+ * characters (or ranges, like "a-z") in the brackets, or one that isn't among
+ * them after "[!" or "[^".  Each "*" is only ever backtracked to once, so a
+ * match takes time proportional to the lengths of the two.
+ *
+ * pattern: the component
+ *
+ * len: its length
+ *
+ * name: the NUL-terminated name
+ *
+ * return: 1 if it matches, 0 otherwise
+ */
+int glob_match(const char *pattern, size_t len, const char *name)
+{
+    const char *p = pattern;
+    const char *end = pattern + len;
+    const char *star = NULL;      // Just after the last "*" seen
+    const char *star_name = NULL; // Where the name was when it was seen
+    while (*name != '\0')
+    {
+        if (p < end && *p == '*')
+        {
+            star = ++p;
+            star_name = name;
+            continue;
+        }
+        size_t used = p < end ? glob_match_char(p, end, (unsigned char)*name) : 0;
+        if (used > 0)
+        {
+            // A wildcard takes a whole UTF-8 character
+            name++;
+            if (*p == '?' || *p == '[')
+            {
+                while (((unsigned char)*name & 0xc0) == 0x80)
+                {
+                    name++;
+                }
+            }
+            p += used;
+            continue;
+        }
+        if (star == NULL)
+        {
+            return 0;
+        }
+
+        // Let the last "*" take one more character
+        p = star;
+        name = ++star_name;
+    }
+    while (p < end && *p == '*')
+    {
+        p++;
+    }
+    return p == end;
+}
+
+/**
+ * Function: glob_match_char
+ * -------------------------
+ * Matches a character against the next "?", bracket expression or plain
+ * character of a pattern
+ *
+ * p: where the pattern is
+ *
+ * end: the end of the pattern component
+ *
+ * c: the character
+ *
+ * return: the number of bytes of the pattern it used up, 0 if c doesn't match
+ */
+size_t glob_match_char(const char *p, const char *end, unsigned char c)
+{
+    if (*p == '?')
+    {
+        return 1;
+    }
+    if (*p != '[')
+    {
+        return (unsigned char)*p == c;
+    }
+
+    const char *q = p + 1;
+    int negate = q < end && (*q == '!' || *q == '^');
+    q += negate;
+    int found = 0;
+
+    // A "]" right at the start is part of the set
+    for (const char *first = q; q < end && (*q != ']' || q == first); q++)
+    {
+        unsigned char lo = *q;
+        unsigned char hi = lo;
+        if (q + 2 < end && q[1] == '-' && q[2] != ']')
+        {
+            hi = q[2];
+            q += 2;
+        }
+        found |= lo <= c && c <= hi;
+    }
+
+    // Without its "]", the "[" is just a character
+    if (q == end)
+    {
+        return c == '[';
+    }
+    return found != negate ? q + 1 - p : 0;
+}
+
+/**
+ * Function: glob_add
+ * ------------------
+ * Adds a path that a pattern matched to expand_words, copied into the arena
+ *
+ * a: the arena
+ *
+ * path: the path
+ *
+ * len: its length
+ *
+ * return: -1 on failure, 0 on success
+ */
+int glob_add(struct arena *a, const char *path, size_t len)
+{
+    char *copy = arena_strndup(a, path, len);
+    return copy == NULL ? -1 : expand_add(copy);
+}
+
+/**
+ * Function: sort_paths
+ * --------------------
+ * Sorts strings in strcmp() order.  Each string is given a key holding its
+ * next 8 bytes, and the keys are radix sorted (see sort_keys()), so the work
+ * is a few passes over integers next to each other in memory rather than
+ * n log n comparisons following pointers into the strings.
+ *
+ * v: the strings
+ *
+ * n: how many there are
+ *
+ * return: -1 if there is no memory for the keys, 0 on success
+ */
+int sort_paths(char **v, size_t n)
+{
+    if (n < 2)
+    {
+        return 0;
+    }
+
+    // The keys, then room for the radix sort to move them into
+    struct sort_key *keys = malloc(sizeof(struct sort_key) * n * 2);
+    if (keys == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i].key = sort_key_at(v[i]);
+        keys[i].s = v[i];
+    }
+    sort_keys(keys, keys + n, n, 0);
+    for (size_t i = 0; i < n; i++)
+    {
+        v[i] = keys[i].s;
+    }
+    free(keys);
+    return 0;
+}
+
+/**
+ * Function: sort_keys
+ * -------------------
+ * Sorts strings by their keys, the 8 bytes starting at depth, with an LSD
+ * radix sort: one pass counts every byte of every key, then the keys are
+ * moved into place one byte at a time, skipping the bytes they all share
+ * (like the directory every match of a pattern starts with).  Strings whose
+ * keys are the same and don't end within them are then given their next 8
+ * bytes as keys and sorted on those.  Short runs are sorted by insertion.
+ *
+ * k: the strings and their keys
+ *
+ * tmp: room for n more
+ *
+ * n: how many there are
+ *
+ * depth: where in the strings the keys were taken from
+ */
+void sort_keys(struct sort_key *k, struct sort_key *tmp, size_t n, size_t depth)
+{
+    if (n < 32)
+    {
+        for (size_t i = 1; i < n; i++)
+        {
+            struct sort_key x = k[i];
+            size_t j = i;
+            for (; j > 0 && (k[j - 1].key != x.key ? k[j - 1].key > x.key
+                                                    : strcmp(k[j - 1].s + depth, x.s + depth) > 0);
+                 j--)
+            {
+                k[j] = k[j - 1];
+            }
+            k[j] = x;
+        }
+        return;
+    }
+
+    static size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < n; i++)
+    {
+        for (int b = 0; b < 8; b++)
+        {
+            counts[b][(k[i].key >> (b * 8)) & 0xff]++;
+        }
+    }
+    struct sort_key *from = k;
+    struct sort_key *to = tmp;
+    for (int b = 0; b < 8; b++)
+    {
+        // A byte every key has in common doesn't move anything
+        if (counts[b][(k[0].key >> (b * 8)) & 0xff] == n)
+        {
+            continue;
+        }
+        size_t offset = 0;
+        for (int c = 0; c < 256; c++)
+        {
+            size_t count = counts[b][c];
+            counts[b][c] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            to[counts[b][(from[i].key >> (b * 8)) & 0xff]++] = from[i];
+        }
+        struct sort_key *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != k)
+    {
+        memcpy(k, from, sizeof(struct sort_key) * n);
+    }
+
+    // Runs of the same key, unless the strings end within it, go on to their next 8 bytes
+    for (size_t i = 0; i < n;)
+    {
+        size_t j = i + 1;
+        while (j < n && k[j].key == k[i].key)
+        {
+            j++;
+        }
+        if (j - i > 1 && (k[i].key & 0xff) != 0)
+        {
+            for (size_t m = i; m < j; m++)
+            {
+                k[m].key = sort_key_at(k[m].s + depth + 8);
+            }
+            sort_keys(k + i, tmp, j - i, depth + 8);
+        }
+        i = j;
+    }
+}
+
+/**
+ * Function: sort_key_at
+ * ---------------------
+ * Packs the next 8 bytes of a string into an integer that compares the way
+ * strcmp() would, padded with zeros past its end
+ *
+ * s: the string
+ *
+ * return: the key
+ */
+uint64_t sort_key_at(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        key <<= 8;
+        if (*s != '\0')
+        {
+            key |= (unsigned char)*s++;
+        }
+    }
+    return key;
+}
+
+/**
+ * Function: expand_add
+ * --------------------
+ * Adds a word to expand_words, the words of the command being expanded
+ *
+ * word: the word
+ *
+ * return: -1 on failure, 0 on success
+ */
+int expand_add(char *word)
+{
+    if (num_expand_words == expand_words_size)
+    {
+        size_t new_size = expand_words_size == 0 ? 16 : expand_words_size * 2;
+        char **words = realloc(expand_words, sizeof(char *) * new_size);
+        if (words == NULL)
+        {
+            return -1;
+        }
+        expand_words = words;
+        expand_words_size = new_size;
+    }
+    expand_words[num_expand_words++] = word;
+    return 0;
+}
+
+/**
+ * Function: is_delim
+ * ------------------
+ * Checks whether a character ends a word
+ *
+ * c: the character being checked
+ *
+ * return: 1 for whitespace, operators and the end of the line, 0 otherwise
+ */
+int is_delim(char c)
+{
+    switch (c)
+    {
+    case '\0':
+    case ' ':
+    case '\t':
+    case '\n':
+    case ';':
+    case '&':
+    case '|':
+    case '>':
+    case '<':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Function: has_redir
+ * -------------------
+ * Checks a list of redirections for one of a given type
+ *
+ * r: the first redirection of the list, or NULL
+ *
+ * type: the type looked for
+ *
+ * return: 1 if there is one, 0 otherwise
+ */
+int has_redir(struct redir *r, enum redir_type type)
+{
+    for (; r != NULL; r = r->next)
+    {
+        if (r->type == type)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: redir_flags
+ * ---------------------
+ * Gives the open() flags for the target of a redirection
+ *
+ * type: the type of redirection
+ *
+ * return: the flags
+ */
+int redir_flags(enum redir_type type)
+{
+    switch (type)
+    {
+    case REDIR_IN:
+        return O_RDONLY;
+    case REDIR_APPEND:
+        return O_CREAT | O_APPEND | O_WRONLY;
+    default:
+        return O_CREAT | O_TRUNC | O_WRONLY;
+    }
+}
+
+/**
+ * Function: print_prompt
+ * ----------------------
+ * Prints the prompt for the shell to the console, and subsequently flushes stdout
+ */
+void print_prompt(void)
+{
+    printf(PROMPT);
+    fflush(stdout);
+}
+
+/**
+ * Function: print_error
+ * ---------------------
+ * Prints the error message to the console
+ */
+void print_error(void)
+{
+    char error_message[30] = "An error has occurred\n";
+    write(STDERR_FILENO, error_message, strlen(error_message));
+}
+
+/**
+ * Function: run_pwd
+ * -----------------
+ * Helper function for pwd built-in command, updating path and path_size as needed
+ *
+ * path: a pointer to a string where the path will be stored
+ *
+ * path_size: a pointer to a size_t variable holding the size in bytes of path
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_pwd(char **path, size_t *path_size)
+{
+    char *ret = getcwd(*path, *path_size);
+    while (ret == NULL)
+    {
+        if (errno == ERANGE)
+        {
+            *path_size *= 2;
+            *path = realloc(*path, *path_size);
+            if (*path == NULL)
+            {
+                return -1;
+            }
+            ret = getcwd(*path, *path_size);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    *path = ret;
+    return 0;
+}
+
+/**
+ * Function: run_list
+ * ------------------
+ * Runs the pipelines of a list from left to right.
+ * A pipeline that fails prints an error, and the rest of the list still runs.
+ * last_status is left with the status of the last pipeline.
+ * A pipeline with variables in it is expanded just before it runs, and only
+ * then checked (see check_syntax()), so it sees what the pipelines before it set.
+ *
+ * list: the parsed line
+ */
+void run_list(struct cmd_list *list)
+{
+    for (struct pipeline *pl = list->pipelines; pl != NULL; pl = pl->next)
+    {
+        struct pipeline *run = pl;
+        if (pl->expand &&
+            ((run = expand_pipeline(&line_arena, pl)) == NULL || (run->cmds != NULL && check_pipeline(run) == -1)))
+        {
+            print_error();
+            last_status = 1;
+            continue;
+        }
+        last_status = 0;
+
+        // It expanded to nothing at all
+        if (run->cmds == NULL)
+        {
+            continue;
+        }
+        if ((run->background ? run_background(run) : run_command(run)) == -1)
+        {
+            print_error();
+            last_status = 1;
+        }
+    }
+}
+
+/**
+ * Function: run_command
+ * ---------------------
+ * Runs a single pipeline, by compiling it with compile_plan() and running the plan once.
+ * Arguments have already been checked by check_syntax().
+ *
+ * pl: the pipeline to run
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_command(struct pipeline *pl)
+{
+    struct plan *plan = compile_plan(&line_arena, pl);
+    if (plan == NULL)
+    {
+        return -1;
+    }
+    return run_plan(plan);
+}
+
+/**
+ * Function: compile_plan
+ * ----------------------
+ * Does all of the work of running a pipeline that doesn't have to be repeated
+ * each time it runs: finding the built-in command, taking a loop's variable and
+ * body apart and looking up the binary of every external stage.
+ *
+ * a: the arena the plan is allocated from
+ *
+ * pl: the pipeline being compiled
+ *
+ * return: the plan, or NULL on failure
+ */
+struct plan *compile_plan(struct arena *a, struct pipeline *pl)
+{
+    struct plan *plan = arena_alloc(a, sizeof(struct plan));
+    if (plan == NULL)
+    {
+        return NULL;
+    }
+    plan->builtin = lookup_builtin(pl->cmds->argv[0]);
+    plan->held_out = -1;
+    plan->sched = NULL;
+
+    // Loop command
+    if (plan->builtin == BUILTIN_LOOP)
+    {
+        struct pipeline *body = arena_alloc(a, sizeof(struct pipeline));
+        struct command *body_cmd = arena_alloc(a, sizeof(struct command));
+        if (body == NULL || body_cmd == NULL)
+        {
+            return NULL;
+        }
+        int skip = parse_loop(pl->cmds, &plan->count, &plan->jobs, &plan->buffered);
+        loop_body(pl, skip, body, body_cmd);
+        plan->type = PLAN_LOOP;
+        plan->body = compile_plan(a, body);
+        return plan->body == NULL ? NULL : plan;
+    }
+
+    // Time command
+    if (plan->builtin == BUILTIN_TIME)
+    {
+        struct pipeline *body = arena_alloc(a, sizeof(struct pipeline));
+        struct command *body_cmd = arena_alloc(a, sizeof(struct command));
+        if (body == NULL || body_cmd == NULL)
+        {
+            return NULL;
+        }
+        loop_body(pl, 1, body, body_cmd);
+        plan->type = PLAN_TIME;
+        plan->body = compile_plan(a, body);
+        return plan->body == NULL ? NULL : plan;
+    }
+
+    // Timeout command
+    if (plan->builtin == BUILTIN_TIMEOUT)
+    {
+        struct pipeline *body = arena_alloc(a, sizeof(struct pipeline));
+        struct command *body_cmd = arena_alloc(a, sizeof(struct command));
+        if (body == NULL || body_cmd == NULL)
+        {
+            return NULL;
+        }
+        int skip = parse_timeout(pl->cmds, &plan->timeout, &plan->signal, &plan->kill_after);
+        loop_body(pl, skip, body, body_cmd);
+        plan->type = PLAN_TIMEOUT;
+        plan->body = compile_plan(a, body);
+        return plan->body == NULL ? NULL : plan;
+    }
+
+    // Limit command
+    if (plan->builtin == BUILTIN_LIMIT)
+    {
+        struct pipeline *body = arena_alloc(a, sizeof(struct pipeline));
+        struct command *body_cmd = arena_alloc(a, sizeof(struct command));
+        plan->limits = arena_alloc(a, sizeof(struct job_limits));
+        if (body == NULL || body_cmd == NULL || plan->limits == NULL)
+        {
+            return NULL;
+        }
+        int skip = parse_limit(pl->cmds, plan->limits);
+        loop_body(pl, skip, body, body_cmd);
+        plan->type = PLAN_LIMIT;
+        plan->body = compile_plan(a, body);
+        return plan->body == NULL ? NULL : plan;
+    }
+
+    if (plan->builtin != BUILTIN_NONE && !is_sched_prefix(plan->builtin) && pl->num_cmds == 1)
+    {
+        plan->type = PLAN_BUILTIN;
+        plan->cmd = pl->cmds;
+        return plan;
+    }
+
+    // execv() command, or a pipeline with built-in commands as some of its stages
+    plan->type = PLAN_EXEC;
+    plan->num_stages = pl->num_cmds;
+    plan->stages = arena_alloc(a, sizeof(struct plan_stage) * pl->num_cmds);
+    if (plan->stages == NULL)
+    {
+        return NULL;
+    }
+    struct plan_stage *stage = plan->stages;
+    for (struct command *cmd = pl->cmds; cmd != NULL; cmd = cmd->next, stage++)
+    {
+        // Prefixes setting the stage's scheduling are taken off its arguments
+        struct stage_sched sched;
+        int skip = parse_sched(a, cmd, &sched);
+        if (skip == -1)
+        {
+            return NULL;
+        }
+        stage->sched = NULL;
+        if (skip > 0)
+        {
+            if ((stage->sched = arena_alloc(a, sizeof(struct stage_sched))) == NULL)
+            {
+                return NULL;
+            }
+            *stage->sched = sched;
+        }
+        stage->argv = cmd->argv + skip;
+        stage->redirs = cmd->redirs;
+        stage->builtin = lookup_builtin(stage->argv[0]);
+        if (stage->builtin != BUILTIN_NONE)
+        {
+            // The stage is compiled as a pipeline of its own, so loop, time and timeout only cover it
+            struct pipeline *single = arena_alloc(a, sizeof(struct pipeline));
+            struct command *single_cmd = arena_alloc(a, sizeof(struct command));
+            if (single == NULL || single_cmd == NULL)
+            {
+                return NULL;
+            }
+            *single_cmd = *cmd;
+            single_cmd->argv += skip;
+            single_cmd->argc -= skip;
+            single_cmd->next = NULL;
+            *single = *pl;
+            single->cmds = single_cmd;
+            single->num_cmds = 1;
+            single->next = NULL;
+            if ((stage->plan = compile_plan(a, single)) == NULL)
+            {
+                return NULL;
+            }
+            stage->plan->sched = stage->sched;
+            stage->path = NULL;
+            continue;
+        }
+
+        // A stage that can't be found only fails once the pipeline runs, like a failed execv()
+        const char *path = resolve_cmd(stage->argv[0]);
+        stage->error = errno;
+        stage->path = path;
+
+        // The plan must outlive a "hash -r" or a rehash of the command-location cache
+        if (path != NULL && path != stage->argv[0])
+        {
+            if ((stage->path = arena_strndup(a, path, strlen(path))) == NULL)
+            {
+                return NULL;
+            }
+        }
+    }
+    return plan;
+}
+
+/**
+ * Function: run_plan
+ * ------------------
+ * Runs a compiled pipeline once
+ *
+ * plan: the plan to run
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_plan(struct plan *plan)
+{
+    if (plan->type == PLAN_LOOP)
+    {
+        return run_loop(plan, NULL);
+    }
+    if (plan->type == PLAN_TIME)
+    {
+        return run_time(plan);
+    }
+    if (plan->type == PLAN_TIMEOUT)
+    {
+        return run_timeout(plan);
+    }
+    if (plan->type == PLAN_LIMIT)
+    {
+        return run_limit(plan);
+    }
+    if (plan->type == PLAN_BUILTIN)
+    {
+        return run_builtin_to(plan, -1, -1);
+    }
+    return run_pipeline(plan, NULL);
+}
+
+/**
+ * Function: run_builtin
+ * ---------------------
+ * Runs one of the built-in commands other than loop
+ *
+ * builtin: the built-in command
+ *
+ * cmd: the command, with its arguments
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_builtin(enum builtin_id builtin, struct command *cmd)
+{
+    char **args = cmd->argv;
+
+    // exit command
+    if (builtin == BUILTIN_EXIT)
+    {
+        exit(0);
+    }
+
+    // cd command
+    if (builtin == BUILTIN_CD)
+    {
+        forkserver_cwd_changed = 1;
+        return chdir(args[1]);
+    }
+
+    // pwd command
+    if (builtin == BUILTIN_PWD)
+    {
+        size_t path_size = 16;
+        char *path = malloc(path_size);
+        if (path == NULL)
+        {
+            return -1;
+        }
+        if (run_pwd(&path, &path_size) == -1)
+        {
+            free(path);
+            return -1;
+        }
+        printf("%s\n", path);
+        free(path);
+        return 0;
+    }
+
+    // jobs command
+    if (builtin == BUILTIN_JOBS)
+    {
+        return run_jobs();
+    }
+
+    // wait command
+    if (builtin == BUILTIN_WAIT)
+    {
+        double start = trace_file != NULL ? trace_now() : 0;
+        int ret = run_wait(args, cmd->argc);
+        if (trace_file != NULL)
+        {
+            trace_event("wait", start, trace_now(), 0, NULL, NULL);
+        }
+        return ret;
+    }
+
+    // cat command
+    if (builtin == BUILTIN_CAT)
+    {
+        return run_cat(args, cmd->argc);
+    }
+
+    // history command
+    if (builtin == BUILTIN_HISTORY)
+    {
+        return run_history(args, cmd->argc);
+    }
+
+    // export, unset and assignments
+    if (builtin == BUILTIN_EXPORT)
+    {
+        return run_export(args, cmd->argc);
+    }
+    if (builtin == BUILTIN_UNSET)
+    {
+        return run_unset(args, cmd->argc);
+    }
+    if (builtin == BUILTIN_ASSIGN)
+    {
+        return run_assign(args, cmd->argc);
+    }
+
+    // pipesize and pipestat commands
+    if (builtin == BUILTIN_PIPESIZE)
+    {
+        return run_pipesize(args, cmd->argc);
+    }
+    if (builtin == BUILTIN_PIPESTAT)
+    {
+        return run_pipestat();
+    }
+
+    // hash command
+    return run_hash(args, cmd->argc);
+}
+
+/**
+ * Function: run_builtin_to
+ * ------------------------
+ * Runs a built-in command in the shell with its standard input and output
+ * taken from somewhere else: its redirections, or the pipes around it when it
+ * is a pipeline stage.  The shell's own standard input and output are put back afterwards.
+ *
+ * plan: the compiled built-in command (PLAN_BUILTIN)
+ *
+ * in_fd: where its input comes from unless it is redirected, or -1 for the shell's stdin
+ *
+ * out_fd: where its output goes unless it is redirected, or -1 for the shell's stdout
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_builtin_to(struct plan *plan, int in_fd, int out_fd)
+{
+    // Redirections open their files the same way a child does, unless a loop holds the target open
+    int opened[2] = {-1, -1}; // Indexed by file descriptor
+    int fds[2] = {in_fd, out_fd};
+    int saved[2] = {-1, -1};
+    int ret = -1;
+    for (struct redir *r = plan->cmd->redirs; r != NULL; r = r->next)
+    {
+        int target = r->type == REDIR_IN ? STDIN_FILENO : STDOUT_FILENO;
+        if (target == STDOUT_FILENO && plan->held_out != -1)
+        {
+            fds[target] = plan->held_out;
+            continue;
+        }
+        if (opened[target] != -1)
+        {
+            close(opened[target]);
+        }
+        opened[target] = open(r->target, redir_flags(r->type) | O_CLOEXEC, 0644);
+        if (opened[target] == -1)
+        {
+            goto done;
+        }
+        fds[target] = opened[target];
+    }
+
+    fflush(stdout);
+    for (int fd = 0; fd < 2; fd++)
+    {
+        if (fds[fd] == -1)
+        {
+            continue;
+        }
+        if ((saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 3)) == -1 || dup2(fds[fd], fd) == -1)
+        {
+            goto restore;
+        }
+    }
+    stdio_moved = saved[0] != -1 || saved[1] != -1;
+    ret = run_builtin(plan->builtin, plan->cmd);
+    stdio_moved = 0;
+
+    // A write error (such as EPIPE) belongs to this command only
+    fflush(stdout);
+    clearerr(stdout);
+restore:
+    for (int fd = 0; fd < 2; fd++)
+    {
+        if (saved[fd] != -1)
+        {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+done:
+    for (int fd = 0; fd < 2; fd++)
+    {
+        if (opened[fd] != -1)
+        {
+            close(opened[fd]);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Function: run_pipeline
+ * ----------------------
+ * Runs a compiled pipeline with start_pipeline() and waits for all of its stages
+ *
+ * plan: the plan of the pipeline to run (a plain command is a pipeline with one stage)
+ *
+ * usage: for the time built-in, an entry per stage to fill in with its resource
+ *        usage, with stage set to -1; NULL otherwise.  Every stage is then a
+ *        child, built-in commands included, so each one gets its own figures.
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_pipeline(struct plan *plan, struct stage_usage *usage)
+{
+    struct job job;
+    struct stage_usage *trace_usage = NULL;
+    job.id = 0;
+    job.fork_builtins = usage != NULL;
+    job.pgid = -1;
+    job.limits = NULL;
+    job.pids = malloc(sizeof(pid_t) * plan->num_stages);
+    if (trace_file != NULL && usage == NULL)
+    {
+        usage = trace_usage = malloc(sizeof(struct stage_usage) * plan->num_stages);
+    }
+    job.usage = usage;
+    if (job.pids == NULL || (trace_file != NULL && usage == NULL))
+    {
+        free(job.pids);
+        return -1;
+    }
+    int ret = start_pipeline(plan, &job, -1);
+
+    // Wait for every stage that was started to be reaped
+    double start = trace_file != NULL ? trace_now() : 0;
+    while (job.num_live > 0)
+    {
+        wait_children(-1);
+    }
+    if (trace_file != NULL)
+    {
+        trace_event("wait", start, trace_now(), 0, NULL, NULL);
+        trace_job(&job, plan);
+    }
+    last_status = job.status;
+    free(job.pids);
+    free(trace_usage);
+    return ret;
+}
+
+/**
+ * Function: start_pipeline
+ * ------------------------
+ * Starts every stage of a compiled pipeline, without waiting for any of them.
+ * All of the stages are spawned up front, each one wired to its neighbours
+ * with a pipe, so they all run concurrently.
+ * The pipes are close-on-exec and the shell closes its copy of each end as soon
+ * as the stage using it is started, so each reader sees EOF as soon as its writer exits.
+ * One built-in command that doesn't change the shell's state (see the builtins
+ * table) runs in the shell itself once every other stage is running, reading
+ * and writing its pipes directly; other built-in commands run in a subshell
+ * from fork_subshell().  Only one can run in the shell, since two of them
+ * would run one after the other and the first could fill up a pipe nobody reads yet.
+ * Every process is entered in the table of children, which watches it for
+ * wait_children(), as soon as it is started.
+ *
+ * plan: the plan of the pipeline to start
+ *
+ * job: filled in with the processes that were started; job->pids must have room for every stage
+ *      and job->id, job->usage, job->fork_builtins, job->pgid and job->limits must be set
+ *
+ * out_fd: where the last stage's output goes if it isn't redirected, or -1 for the shell's stdout
+ *
+ * return: -1 if any stage failed to start (the others still run and must be waited for), 0 on success
+ */
+int start_pipeline(struct plan *plan, struct job *job, int out_fd)
+{
+    int ret = 0;
+    int in_fd = -1; // Read end of the pipe feeding the next stage
+    job->num_pids = 0;
+    job->num_live = 0;
+    job->last_pid = -1;
+    job->status = 1;
+    job->out_fd = out_fd;
+
+    // The built-in command the shell runs itself, and the pipe ends it uses
+    struct plan_stage *shell_stage = NULL;
+    int shell_fds[2] = {-1, -1};
+
+    if (proc_reserve(plan->num_stages) == -1)
+    {
+        return -1;
+    }
+
+    // Output from built-in commands must come out before the children's
+    fflush(stdout);
+    if (plan->num_stages > 1)
+    {
+        memset(&pipe_stats, 0, sizeof(pipe_stats));
+    }
+
+    for (int i = 0; i < plan->num_stages; i++)
+    {
+        struct plan_stage *stage = &plan->stages[i];
+        int pipefd[2] = {-1, -1};
+        if (i < plan->num_stages - 1 && pipe2(pipefd, O_CLOEXEC) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        if (pipefd[0] != -1 && pipe_size > 0)
+        {
+            size_pipe(pipefd[1]);
+        }
+        int stage_out = pipefd[1] != -1 ? pipefd[1] : out_fd;
+
+        // It runs last, once its neighbours are running; hash only prints when it has no arguments,
+        // as "hash -r" empties the cache
+        if (shell_stage == NULL && !job->fork_builtins && stage->builtin != BUILTIN_NONE && stage->sched == NULL &&
+            stage->plan->type == PLAN_BUILTIN && stage->builtin != BUILTIN_ASSIGN &&
+            find_builtin(stage->plan->cmd->argv[0])->in_process &&
+            (stage->builtin != BUILTIN_HASH || stage->plan->cmd->argc == 1))
+        {
+            shell_stage = stage;
+            shell_fds[0] = in_fd;
+            shell_fds[1] = stage_out;
+            in_fd = pipefd[0];
+            continue;
+        }
+
+        // A stage that fails to start fails the pipeline, but its neighbours still run
+        if (job->usage != NULL)
+        {
+            job->usage[job->num_pids].stage = i;
+            clock_gettime(CLOCK_MONOTONIC, &job->usage[job->num_pids].start);
+        }
+        pid_t pid;
+        if (stage->builtin != BUILTIN_NONE)
+        {
+            // Background jobs don't compete with the shell for its input
+            int stage_in = in_fd == -1 && job->id == 0 ? STDIN_FILENO : in_fd;
+            pid = fork_subshell(stage->plan, stage_in, stage_out, shell_fds, 2, job);
+        }
+        else
+        {
+            // Wire the stage up to its neighbours (or the redirection target)
+            struct spawn_req req;
+            spawn_init(&req, stage->path, stage->argv);
+            int added = 0;
+            if (stage->sched != NULL)
+            {
+                added |= spawn_add_sched(&req, stage->sched);
+            }
+            if (job->pgid != -1)
+            {
+                added |= spawn_add_setpgid(&req, job->pgid);
+            }
+            if (in_fd != -1)
+            {
+                added |= spawn_add_dup2(&req, in_fd, STDIN_FILENO);
+            }
+            if (stage_out != -1)
+            {
+                added |= spawn_add_dup2(&req, stage_out, STDOUT_FILENO);
+            }
+            if (i == 0 && job->id > 0)
+            {
+                added |= spawn_add_open(&req, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+            }
+            for (struct redir *r = stage->redirs; r != NULL; r = r->next)
+            {
+                if (r->type == REDIR_IN)
+                {
+                    added |= spawn_add_open(&req, STDIN_FILENO, r->target, O_RDONLY, 0);
+                }
+                else if (plan->held_out != -1 && i == plan->num_stages - 1)
+                {
+                    added |= spawn_add_dup2(&req, plan->held_out, STDOUT_FILENO);
+                }
+                else
+                {
+                    added |= spawn_add_open(&req, STDOUT_FILENO, r->target, redir_flags(r->type), 0644);
+                }
+            }
+
+            // Last, so a low RLIMIT_NOFILE can't stop the redirections
+            if (job->limits != NULL)
+            {
+                added |= spawn_add_limits(&req, job->limits);
+            }
+
+            // A stage needing more actions than fit fails like one whose redirection fails
+            if (added == -1)
+            {
+                errno = E2BIG;
+                pid = -1;
+            }
+            else
+            {
+                pid = stage->path == NULL ? -1 : spawn_proc(&req);
+            }
+        }
+        if (pid < 0 || proc_add(pid, job) == -1)
+        {
+            // A child the shell can't watch couldn't be waited for either
+            if (pid > 0)
+            {
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+            }
+            ret = -1;
+        }
+        else
+        {
+            job->pids[job->num_pids++] = pid;
+            job->num_live++;
+            if (i == plan->num_stages - 1)
+            {
+                job->last_pid = pid;
+            }
+
+            // The first process started leads the job's new process group
+            if (job->pgid == 0)
+            {
+                job->pgid = pid;
+            }
+        }
+
+        // The children now own these pipe ends
+        if (in_fd != -1)
+        {
+            close(in_fd);
+        }
+        if (pipefd[1] != -1)
+        {
+            close(pipefd[1]);
+        }
+        in_fd = pipefd[0];
+    }
+    if (in_fd != -1)
+    {
+        close(in_fd);
+    }
+
+    // A reader that exits early must not kill the shell, see main()
+    if (shell_stage != NULL)
+    {
+        int status = 0;
+        if (run_builtin_to(shell_stage->plan, shell_fds[0], shell_fds[1]) == -1)
+        {
+            print_error();
+            status = 1;
+        }
+        if (shell_fds[0] != -1)
+        {
+            close(shell_fds[0]);
+        }
+        if (shell_stage == &plan->stages[plan->num_stages - 1])
+        {
+            job->status = status;
+        }
+        else
+        {
+            close(shell_fds[1]);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Function: run_background
+ * ------------------------
+ * Starts a pipeline that ended with "&" as a background job and returns
+ * without waiting for it.  External commands are spawned directly, while
+ * built-in commands and loops run in a forked copy of the shell.
+ * The job's processes are reaped by wait_children() whenever the shell waits or reads a line.
+ *
+ * pl: the pipeline to start
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_background(struct pipeline *pl)
+{
+    struct plan *plan = compile_plan(&line_arena, pl);
+    if (plan == NULL)
+    {
+        return -1;
+    }
+    if (max_job_id == bg_jobs_size)
+    {
+        int new_size = bg_jobs_size == 0 ? 16 : bg_jobs_size * 2;
+        struct job **jobs = realloc(bg_jobs, sizeof(struct job *) * new_size);
+        if (jobs == NULL)
+        {
+            return -1;
+        }
+        for (int i = bg_jobs_size; i < new_size; i++)
+        {
+            jobs[i] = NULL;
+        }
+        bg_jobs = jobs;
+        bg_jobs_size = new_size;
+    }
+
+    int num_stages = plan->type == PLAN_EXEC ? plan->num_stages : 1;
+    struct job *job = malloc(sizeof(struct job));
+    if (job == NULL)
+    {
+        return -1;
+    }
+    job->pids = malloc(sizeof(pid_t) * num_stages);
+    job->text = strdup(pl->text);
+    job->num_pids = 0;
+    job->num_live = 0;
+    job->id = max_job_id + 1;
+    job->usage = NULL;
+    job->fork_builtins = 1;
+    job->pgid = -1;
+    job->limits = NULL;
+    if (job->pids == NULL || job->text == NULL)
+    {
+        free_job(job);
+        return -1;
+    }
+
+    int ret;
+    if (plan->type == PLAN_EXEC)
+    {
+        ret = start_pipeline(plan, job, -1);
+    }
+    else
+    {
+        ret = start_subshell(plan, job, -1);
+    }
+    // A pipeline of built-in commands the shell ran itself has nothing left to wait for
+    if (job->num_pids == 0)
+    {
+        free_job(job);
+        return ret;
+    }
+
+    bg_jobs[job->id - 1] = job;
+    max_job_id = job->id;
+    if (interactive)
+    {
+        printf("[%d] %d\n", job->id, (int)job->pids[job->num_pids - 1]);
+    }
+    return ret;
+}
+
+/**
+ * Function: start_subshell
+ * ------------------------
+ * Runs a compiled pipeline in a subshell (see fork_subshell()), for background
+ * jobs and timeout and limit commands that aren't just external commands
+ *
+ * plan: the plan to run in the subshell
+ *
+ * job: filled in with the subshell's process; job->pids must have room for one pid
+ *      and job->pgid and job->limits must be set
+ *
+ * in_fd: the subshell's standard input, -1 for /dev/null
+ *
+ * return: -1 on failure, 0 on success
+ */
+int start_subshell(struct plan *plan, struct job *job, int in_fd)
+{
+    job->num_pids = 0;
+    job->num_live = 0;
+    job->status = 1;
+    job->out_fd = -1;
+
+    if (proc_reserve(1) == -1)
+    {
+        return -1;
+    }
+    pid_t pid = fork_subshell(plan, in_fd, -1, NULL, 0, job);
+    if (pid == -1)
+    {
+        return -1;
+    }
+    if (proc_add(pid, job) == -1)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    job->pids[job->num_pids++] = pid;
+    job->num_live = 1;
+    job->last_pid = pid;
+    if (job->pgid == 0)
+    {
+        job->pgid = pid;
+    }
+    return 0;
+}
+
+/**
+ * Function: fork_subshell
+ * -----------------------
+ * Forks a copy of the shell that runs a compiled plan and exits with its status.
+ * It is used for what can't run in the shell itself: background built-in
+ * commands and loops, and pipeline stages that are built-in commands changing
+ * the shell's state.  A built-in stage's affinity, nice and ioprio prefixes
+ * (plan->sched) and the limits of its job are applied first.  The subshell forgets the shell's children and jobs,
+ * since it can only wait for its own, and watches its children from an
+ * epoll instance of its own.
+ *
+ * plan: the plan to run in the subshell
+ *
+ * in_fd: becomes the subshell's standard input, or -1 for /dev/null
+ *
+ * out_fd: becomes the subshell's standard output, or -1 to keep the shell's
+ *
+ * close_fds: descriptors the subshell must not hold on to, such as write ends
+ *            of pipes whose readers are waiting for EOF
+ *
+ * num_close: the number of elements in close_fds
+ *
+ * job: the job the subshell is part of, whose process group it joins (job->pgid: 0 for
+ *      a new one, -1 to stay in the shell's) and whose limits it takes on
+ *
+ * return: the pid of the subshell, or -1 on failure
+ */
+pid_t fork_subshell(struct plan *plan, int in_fd, int out_fd, const int *close_fds, int num_close,
+                    const struct job *job)
+{
+    pid_t pgid = job->pgid;
+    fflush(stdout);
+    double start = 0;
+    if (trace_file != NULL)
+    {
+        fflush(trace_file);
+        start = trace_now();
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (pgid != -1)
+        {
+            setpgid(0, pgid);
+        }
+        if ((plan->sched != NULL && apply_sched(plan->sched) == -1) ||
+            (job->limits != NULL && apply_limits(job->limits) == -1))
+        {
+            print_error();
+            _exit(1);
+        }
+        if (job->limits != NULL && job->limits->cgroup_fd != -1)
+        {
+            in_cgroup = 1;
+        }
+        for (size_t i = 0; i < proc_slots; i++)
+        {
+            if (procs[i].pid != 0 && procs[i].pidfd != -1)
+            {
+                close(procs[i].pidfd);
+            }
+        }
+        memset(procs, 0, sizeof(struct proc_slot) * proc_slots);
+        num_procs = 0;
+        close(events_fd);
+        if (sigchld_fd != -1)
+        {
+            close(sigchld_fd);
+        }
+        for (struct deadline *d = deadlines; d != NULL; d = d->next)
+        {
+            close(d->fd);
+        }
+        deadlines = NULL;
+        if (events_init() == -1)
+        {
+            print_error();
+            _exit(1);
+        }
+
+        // The server's children would be the shell's, not the subshell's
+        if (forkserver_fd != -1)
+        {
+            close(forkserver_fd);
+            forkserver_fd = -1;
+        }
+        max_job_id = 0;
+        num_done_jobs = 0;
+        interactive = 0;
+        if (in_fd == -1)
+        {
+            in_fd = open("/dev/null", O_RDONLY);
+        }
+        if (in_fd != -1 && in_fd != STDIN_FILENO)
+        {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+        }
+        if (out_fd != -1 && out_fd != STDOUT_FILENO)
+        {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+        for (int i = 0; i < num_close; i++)
+        {
+            close(close_fds[i]);
+        }
+
+        last_status = 0;
+        if (run_plan(plan) == -1)
+        {
+            print_error();
+            last_status = 1;
+        }
+        fflush(stdout);
+        if (trace_file != NULL)
+        {
+            fflush(trace_file);
+        }
+        _exit(last_status);
+    }
+
+    // Both sides set the group, so it exists before either goes on
+    if (pid != -1 && pgid != -1)
+    {
+        setpgid(pid, pgid == 0 ? pid : pgid);
+    }
+    if (pid != -1 && trace_file != NULL)
+    {
+        trace_event("fork", start, trace_now(), pid, plan->type == PLAN_BUILTIN ? plan->cmd->argv : NULL, NULL);
+    }
+    return pid;
+}
+
+/**
+ * Function: events_init
+ * ---------------------
+ * Creates the epoll instance every wait for children goes through (see
+ * wait_children()).  Each child is watched through a pidfd; on kernels without
+ * pidfd_open(), SIGCHLD is blocked and watched through a signalfd instead.
+ *
+ * return: -1 on failure, 0 on success
+ */
+int events_init(void)
+{
+    if ((events_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        return -1;
+    }
+    sigchld_fd = -1;
+    int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (pidfd != -1)
+    {
+        close(pidfd);
+        return 0;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    if ((sigchld_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)sigchld_fd;
+    return epoll_ctl(events_fd, EPOLL_CTL_ADD, sigchld_fd, &ev);
+}
+
+/**
+ * Function: wait_children
+ * -----------------------
+ * The shell's event loop: waits until children exit (or the timeout passes),
+ * and reaps every child that has.  The data of each event holds the child's
+ * pid, so each exit is O(1) work: one wait4() for the pid, which also hands
+ * back the child's resource usage, and one lookup in the table of children.
+ * With the SIGCHLD fallback, an event means any children may have exited,
+ * and they are reaped with wait4(-1) until none are left.  Events for the
+ * timers of timeout commands only count that the deadline ran out, for
+ * run_timeout() to act on once it gets back control.
+ *
+ * timeout_ms: how long to wait at most, -1 to wait for as long as it takes,
+ *             0 to only reap children that already exited
+ *
+ * return: the number of events handled (0 if the timeout passed), -1 on failure
+ */
+int wait_children(int timeout_ms)
+{
+    struct epoll_event events[WAIT_EVENTS];
+    int n = epoll_wait(events_fd, events, WAIT_EVENTS, timeout_ms);
+    if (n == -1)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int status;
+        struct rusage ru;
+        pid_t pid = events[i].data.u64 >> 32;
+        int fd = (uint32_t)events[i].data.u64;
+        if (pid == 0 && fd != sigchld_fd)
+        {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                for (struct deadline *d = deadlines; d != NULL; d = d->next)
+                {
+                    d->fired += d->fd == fd;
+                }
+            }
+        }
+        else if (pid == 0)
+        {
+            struct signalfd_siginfo si;
+            while (read(sigchld_fd, &si, sizeof(si)) > 0)
+            {
+            }
+            while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+            {
+                reap_child(pid, status, &ru);
+            }
+        }
+        else if (wait4(pid, &status, WNOHANG, &ru) == pid)
+        {
+            reap_child(pid, status, &ru);
+        }
+    }
+    return n;
+}
+
+/**
+ * Function: reap_child
+ * --------------------
+ * Updates the job of a child that was reaped.  Its resource usage is kept
+ * when the time built-in command is measuring it, and a background job whose
+ * last process exits is counted so the next prompt can report it.
+ *
+ * pid: the child
+ *
+ * status: its status from wait4()
+ *
+ * ru: its resource usage from wait4()
+ */
+void reap_child(pid_t pid, int status, const struct rusage *ru)
+{
+    struct job *job = proc_take(pid);
+    if (job == NULL)
+    {
+        return;
+    }
+
+    // Keep the child's resource usage for a time command that is running
+    if (timing != NULL && job->id == 0)
+    {
+        rusage_add(timing, ru);
+    }
+    for (int i = 0; job->usage != NULL && i < job->num_pids; i++)
+    {
+        if (job->pids[i] == pid)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &job->usage[i].end);
+            job->usage[i].ru = *ru;
+        }
+    }
+    if (pid == job->last_pid)
+    {
+        job->status = exit_status(status);
+    }
+    if (--job->num_live == 0 && job->id > 0)
+    {
+        num_done_jobs++;
+    }
+}
+
+/**
+ * Function: proc_reserve
+ * ----------------------
+ * Makes sure the table of children has room for n more entries,
+ * keeping it at most half full.
+ *
+ * n: the number of children about to be added
+ *
+ * return: -1 on failure, 0 on success
+ */
+int proc_reserve(size_t n)
+{
+    if ((num_procs + n) * 2 <= proc_slots)
+    {
+        return 0;
+    }
+    size_t new_slots = proc_slots == 0 ? PROC_MIN_SLOTS : proc_slots;
+    while ((num_procs + n) * 2 > new_slots)
+    {
+        new_slots *= 2;
+    }
+    struct proc_slot *table = calloc(new_slots, sizeof(struct proc_slot));
+    if (table == NULL)
+    {
+        return -1;
+    }
+    struct proc_slot *old = procs;
+    size_t old_slots = proc_slots;
+    procs = table;
+    proc_slots = new_slots;
+    num_procs = 0;
+    for (size_t i = 0; i < old_slots; i++)
+    {
+        if (old[i].pid != 0)
+        {
+            proc_insert(old[i].pid, old[i].pidfd, old[i].job);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * Function: proc_add
+ * ------------------
+ * Enters a child into the table of children and starts watching it: its pidfd
+ * is added to the shell's epoll instance, one-shot since it only ever reports
+ * the exit, with the pid and the pidfd as the event's data.
+ * There must be room for it in the table (see proc_reserve()).
+ *
+ * pid: the child's pid
+ *
+ * job: the job it belongs to
+ *
+ * return: -1 if the child can't be watched, 0 on success
+ */
+int proc_add(pid_t pid, struct job *job)
+{
+    int pidfd = -1;
+    if (sigchld_fd == -1)
+    {
+        if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1)
+        {
+            return -1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = (uint64_t)pid << 32 | (uint32_t)pidfd;
+        if (epoll_ctl(events_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1)
+        {
+            close(pidfd);
+            return -1;
+        }
+    }
+    proc_insert(pid, pidfd, job);
+    return 0;
+}
+
+/**
+ * Function: proc_insert
+ * ---------------------
+ * Puts a child into the table of children, which must have room for it
+ *
+ * pid: the child's pid
+ *
+ * pidfd: its pidfd, or -1
+ *
+ * job: the job it belongs to
+ */
+void proc_insert(pid_t pid, int pidfd, struct job *job)
+{
+    size_t i = ((size_t)pid * 2654435761u) & (proc_slots - 1);
+    while (procs[i].pid != 0)
+    {
+        i = (i + 1) & (proc_slots - 1);
+    }
+    procs[i].pid = pid;
+    procs[i].pidfd = pidfd;
+    procs[i].job = job;
+    num_procs++;
+}
+
+/**
+ * Function: proc_take
+ * -------------------
+ * Looks up a child in the table of children and removes it, closing its pidfd,
+ * shifting back the entries after it so no tombstones are needed.
+ *
+ * pid: the child's pid
+ *
+ * return: the job the child belonged to, or NULL if it isn't in the table
+ */
+struct job *proc_take(pid_t pid)
+{
+    if (proc_slots == 0)
+    {
+        return NULL;
+    }
+    size_t mask = proc_slots - 1;
+    size_t i = ((size_t)pid * 2654435761u) & mask;
+    while (procs[i].pid != pid)
+    {
+        if (procs[i].pid == 0)
+        {
+            return NULL;
+        }
+        i = (i + 1) & mask;
+    }
+    struct job *job = procs[i].job;
+    if (procs[i].pidfd != -1)
+    {
+        close(procs[i].pidfd);
+    }
+    procs[i].pid = 0;
+    num_procs--;
+
+    // Move back entries that can no longer be found past the hole
+    for (size_t j = (i + 1) & mask; procs[j].pid != 0; j = (j + 1) & mask)
+    {
+        size_t home = ((size_t)procs[j].pid * 2654435761u) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            procs[i] = procs[j];
+            procs[j].pid = 0;
+            i = j;
+        }
+    }
+    return job;
+}
+
+/**
+ * Function: notify_jobs
+ * ---------------------
+ * Reports background jobs that finished since the last prompt, and forgets them
+ */
+void notify_jobs(void)
+{
+    if (num_done_jobs == 0)
+    {
+        return;
+    }
+    for (int id = 1; id <= max_job_id; id++)
+    {
+        struct job *job = bg_jobs[id - 1];
+        if (job != NULL && job->num_live == 0)
+        {
+            printf("[%d]  Done\t%s\n", job->id, job->text);
+            free_job(job);
+        }
+    }
+}
+
+/**
+ * Function: free_job
+ * ------------------
+ * Removes a background job from the job table (if it is in it) and frees it.
+ *
+ * job: the job, which must not have any processes left to reap
+ */
+void free_job(struct job *job)
+{
+    if (job->id > 0 && job->id <= max_job_id && bg_jobs[job->id - 1] == job)
+    {
+        bg_jobs[job->id - 1] = NULL;
+        if (job->num_pids > 0)
+        {
+            num_done_jobs--;
+        }
+        while (max_job_id > 0 && bg_jobs[max_job_id - 1] == NULL)
+        {
+            max_job_id--;
+        }
+    }
+    free(job->pids);
+    free(job->text);
+    free(job);
+}
+
+/**
+ * Function: run_jobs
+ * ------------------
+ * Helper function for the jobs built-in command.
+ * Lists the background jobs; the ones that are done are forgotten afterwards.
+ *
+ * return: 0 (it can't fail)
+ */
+int run_jobs(void)
+{
+    if (num_procs > 0)
+    {
+        wait_children(0);
+    }
+    for (int id = 1; id <= max_job_id; id++)
+    {
+        struct job *job = bg_jobs[id - 1];
+        if (job == NULL)
+        {
+            continue;
+        }
+        printf("[%d]  %s\t%s\n", job->id, job->num_live > 0 ? "Running" : "Done", job->text);
+        if (job->num_live == 0)
+        {
+            free_job(job);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: run_wait
+ * ------------------
+ * Helper function for the wait built-in command.
+ * "wait" waits for every background job, "wait n" (or "wait %n") for job n only,
+ * and the job's exit status becomes the status of the wait command.
+ *
+ * args: An array of strings containing the input for the command
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 if there is no such job, 0 on success
+ */
+int run_wait(char **args, int num_args)
+{
+    if (num_args == 1)
+    {
+        for (int id = 1; id <= max_job_id; id++)
+        {
+            struct job *job = bg_jobs[id - 1];
+            if (job == NULL)
+            {
+                continue;
+            }
+            while (job->num_live > 0)
+            {
+                wait_children(-1);
+            }
+            free_job(job);
+        }
+        return 0;
+    }
+
+    const char *arg = args[1][0] == '%' ? args[1] + 1 : args[1];
+    char *end;
+    long id = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || id < 1 || id > max_job_id || bg_jobs[id - 1] == NULL)
+    {
+        return -1;
+    }
+    struct job *job = bg_jobs[id - 1];
+    while (job->num_live > 0)
+    {
+        wait_children(-1);
+    }
+    last_status = job->status;
+    free_job(job);
+    return 0;
+}
+
+/**
+ * Function: exit_status
+ * ---------------------
+ * Turns a status from waitpid() into an exit status the way other shells do
+ *
+ * status: the status from waitpid()
+ *
+ * return: the exit code, or 128 plus the signal number for a killed process
+ */
+int exit_status(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * Function: copy_fd
+ * -----------------
+ * Copies everything from one file descriptor to another, starting at in_fd's offset.
+ * The data is moved inside the kernel wherever it can be: copy_file_range()
+ * between two regular files (which some file systems turn into a reflink or a
+ * server-side copy), splice() when either side is a pipe, and sendfile() from
+ * any other regular file.  A plain read()/write() loop covers everything else,
+ * and picks up where a zero-copy call left off if the kernel turns it down.
+ *
+ * in_fd: the file descriptor to copy from
+ *
+ * out_fd: the file descriptor to copy to
+ *
+ * return: -1 on failure, 0 on success
+ */
+int copy_fd(int in_fd, int out_fd)
+{
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+    {
+        return -1;
+    }
+    enum copy_method method = COPY_READ_WRITE;
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+    {
+        method = COPY_FILE_RANGE;
+    }
+    else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+    {
+        method = COPY_SPLICE;
+    }
+    else if (S_ISREG(in_st.st_mode))
+    {
+        method = COPY_SENDFILE;
+    }
+
+    while (method != COPY_READ_WRITE)
+    {
+        ssize_t n;
+        if (method == COPY_FILE_RANGE)
+        {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+        }
+        else if (method == COPY_SPLICE)
+        {
+            n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        }
+        else
+        {
+            n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+        }
+        if (n == 0)
+        {
+            return 0;
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // Not supported for these files (e.g. across file systems or onto an O_APPEND file)
+            if (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF)
+            {
+                break;
+            }
+            return -1;
+        }
+    }
+
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(in_fd, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t done = 0; done < n;)
+        {
+            ssize_t w = write(out_fd, buf + done, n - done);
+            if (w == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            done += w;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: run_cat
+ * -----------------
+ * Helper function for the cat built-in command.
+ * Copies each file named in args (or standard input, for none or for "-") to
+ * standard output with copy_fd(), so the data never passes through the shell's memory
+ * when the files and pipes involved allow it.
+ *
+ * args: An array of strings containing the input for the command
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 if any file couldn't be opened or copied (the rest are still copied), 0 on success
+ */
+int run_cat(char **args, int num_args)
+{
+    int ret = 0;
+    fflush(stdout);
+    for (int i = 1; i < num_args || (i == 1 && num_args == 1); i++)
+    {
+        int fd = STDIN_FILENO;
+        if (i < num_args && strcmp(args[i], "-") != 0 && (fd = open(args[i], O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            ret = -1;
+            continue;
+        }
+        int err = copy_fd(fd, STDOUT_FILENO) == -1 ? errno : 0;
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+
+        // Whoever was reading is gone, which isn't an error (a child would get SIGPIPE)
+        if (err == EPIPE)
+        {
+            break;
+        }
+        if (err != 0)
+        {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Function: spawn_init
+ * --------------------
+ * Initializes a spawn request with no file actions
+ *
+ * req: the request to initialize
+ *
+ * path: the path of the binary to execute
+ *
+ * argv: the NULL-terminated argument array for the binary
+ */
+void spawn_init(struct spawn_req *req, const char *path, char **argv)
+{
+    req->path = path;
+    req->argv = argv;
+    req->envp = NULL;
+    req->num_actions = 0;
+}
+
+/**
+ * Function: spawn_add_dup2
+ * ------------------------
+ * Adds a file action that duplicates src_fd onto fd in the child
+ *
+ * return: -1 if the request has no room left for the action, 0 on success
+ */
+int spawn_add_dup2(struct spawn_req *req, int src_fd, int fd)
+{
+    if (req->num_actions == MAX_SPAWN_ACTIONS)
+    {
+        return -1;
+    }
+    struct spawn_action *action = &req->actions[req->num_actions++];
+    action->type = SPAWN_DUP2;
+    action->fd = fd;
+    action->src_fd = src_fd;
+    return 0;
+}
+
+/**
+ * Function: spawn_add_close
+ * -------------------------
+ * Adds a file action that closes fd in the child
+ *
+ * return: -1 if the request has no room left for the action, 0 on success
+ */
+int spawn_add_close(struct spawn_req *req, int fd)
+{
+    if (req->num_actions == MAX_SPAWN_ACTIONS)
+    {
+        return -1;
+    }
+    struct spawn_action *action = &req->actions[req->num_actions++];
+    action->type = SPAWN_CLOSE;
+    action->fd = fd;
+    return 0;
+}
+
+/**
+ * Function: spawn_add_open
+ * ------------------------
+ * Adds a file action that opens path onto fd in the child (used for redirection)
+ *
+ * return: -1 if the request has no room left for the action, 0 on success
+ */
+int spawn_add_open(struct spawn_req *req, int fd, const char *path, int flags, mode_t mode)
+{
+    if (req->num_actions == MAX_SPAWN_ACTIONS)
+    {
+        return -1;
+    }
+    struct spawn_action *action = &req->actions[req->num_actions++];
+    action->type = SPAWN_OPEN;
+    action->fd = fd;
+    action->path = path;
+    action->flags = flags;
+    action->mode = mode;
+    action->end.tv_sec = 0;
+    action->end.tv_nsec = 0;
+    return 0;
+}
+
+/**
+ * Function: spawn_add_setpgid
+ * ---------------------------
+ * Adds an action that moves the child into a process group.
+ * Both launchers only return once the child has run its actions, so the group
+ * exists by the time the shell could signal it.
+ *
+ * pgid: the group to join, 0 for a new one led by the child
+ *
+ * return: -1 if the request has no room left for the action, 0 on success
+ */
+int spawn_add_setpgid(struct spawn_req *req, pid_t pgid)
+{
+    if (req->num_actions == MAX_SPAWN_ACTIONS)
+    {
+        return -1;
+    }
+    struct spawn_action *action = &req->actions[req->num_actions++];
+    action->type = SPAWN_SETPGID;
+    action->fd = pgid;
+    return 0;
+}
+
+/**
+ * Function: spawn_add_sched
+ * -------------------------
+ * Adds an action that applies a stage's scheduling settings to the child (see apply_sched())
+ *
+ * sched: the settings, which must outlive the request
+ *
+ * return: -1 if the request has no room left for the action, 0 on success
+ */
+int spawn_add_sched(struct spawn_req *req, const struct stage_sched *sched)
+{
+    if (req->num_actions == MAX_SPAWN_ACTIONS)
+    {
+        return -1;
+    }
+    struct spawn_action *action = &req->actions[req->num_actions++];
+    action->type = SPAWN_SCHED;
+    action->sched = sched;
+    return 0;
+}
+
+/**
+ * Function: apply_sched
+ * ---------------------
+ * Applies the settings from the affinity, nice and ioprio prefixes to the
+ * calling process, which passes them on to everything it starts.
+ * The niceness is raised (or lowered) relative to the current one, like nice(1).
+ * Only makes system calls, so it is safe in a child sharing its parent's memory.
+ *
+ * sched: the settings
+ *
+ * return: -1 (with errno set) if any of them couldn't be applied, 0 on success
+ */
+int apply_sched(const struct stage_sched *sched)
+{
+    if (sched->cpus != NULL && sched_setaffinity(0, sched->cpus_size, sched->cpus) == -1)
+    {
+        return -1;
+    }
+    if (sched->nice != 0)
+    {
+        errno = 0;
+        int prio = getpriority(PRIO_PROCESS, 0);
+        if ((prio == -1 && errno != 0) || setpriority(PRIO_PROCESS, 0, prio + sched->nice) == -1)
+        {
+            return -1;
+        }
+    }
+    if (sched->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched->ioprio) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function: spawn_add_limits
+ * --------------------------
+ * Adds an action that puts the child in its job's cgroup and caps its resources
+ * (see apply_limits()).  It should come after the file actions, which a low
+ * RLIMIT_NOFILE could otherwise stop.
+ *
+ * limits: the caps, which must outlive the request
+ *
+ * return: -1 if the request has no room left for the action, 0 on success
+ */
+int spawn_add_limits(struct spawn_req *req, const struct job_limits *limits)
+{
+    if (req->num_actions == MAX_SPAWN_ACTIONS)
+    {
+        return -1;
+    }
+    struct spawn_action *action = &req->actions[req->num_actions++];
+    action->type = SPAWN_LIMITS;
+    action->limits = limits;
+    return 0;
+}
+
+/**
+ * Function: apply_limits
+ * ----------------------
+ * Moves the calling process into its job's cgroup, if it has one, and sets the
+ * soft and hard limits from the limit built-in, which everything it starts inherits.
+ * Only makes system calls, so it is safe in a child sharing its parent's memory.
+ *
+ * limits: the caps
+ *
+ * return: -1 (with errno set) if the cgroup couldn't be joined or a limit couldn't be set,
+ *         0 on success
+ */
+int apply_limits(const struct job_limits *limits)
+{
+    // Writing 0 to cgroup.procs moves the writer
+    if (limits->cgroup_fd != -1)
+    {
+        int fd = openat(limits->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        ssize_t n = write(fd, "0", 1);
+        close(fd);
+        if (n == -1)
+        {
+            return -1;
+        }
+    }
+    for (int i = 0; i < NUM_RLIMITS; i++)
+    {
+        if (limits->rlimits[i] == RLIM_INFINITY)
+        {
+            continue;
+        }
+        struct rlimit rl = {limits->rlimits[i], limits->rlimits[i]};
+        if (setrlimit(limit_resources[i].resource, &rl) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: spawn_proc
+ * --------------------
+ * Launches a child process for a spawn request, through the fork server when
+ * it's running (see forkserver_spawn()).
+ * The child is created with vfork(), so it borrows the shell's address space
+ * instead of copying its page tables and the cost stays the same however large
+ * the shell grows.  Until it execs, the child only makes system calls:
+ * it puts back the signal mask and the SIGCHLD and SIGPIPE dispositions the
+ * shell started with, runs the file actions in order and then calls execve()
+ * with the environment of the exported variables (see var_environ()).
+ * If any of that fails, the child writes its errno into a close-on-exec pipe,
+ * which the shell reads once vfork() returns.  A successful execve() closes
+ * the pipe instead, so the shell sees EOF.
+ *
+ * req: the binary, arguments and file actions for the child
+ *
+ * return: the pid of the child on success,
+ *         -1 (with errno set to the child's error) if it could not be started
+ */
+pid_t spawn_proc(struct spawn_req *req)
+{
+    req->envp = var_environ();
+    if (req->envp == NULL)
+    {
+        return -1;
+    }
+
+    if (forkserver_fd != -1 && !stdio_moved)
+    {
+        double start = trace_file != NULL ? trace_now() : 0;
+        pid_t pid = forkserver_spawn(req);
+        if (pid != -2)
+        {
+            if (trace_file != NULL)
+            {
+                trace_event("spawn", start, trace_now(), pid, req->argv, req->path);
+            }
+            return pid;
+        }
+    }
+
+    int errpipe[2];
+    if (pipe2(errpipe, O_CLOEXEC) == -1)
+    {
+        return -1;
+    }
+
+    double start = trace_file != NULL ? trace_now() : 0;
+
+    // No signal handler may run in the child while it shares the shell's memory
+    sigset_t all, old;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
+    pid_t pid = vfork();
+    if (pid == 0)
+    {
+        signal(SIGCHLD, SIG_DFL);
+        sigaction(SIGPIPE, &child_sigpipe, NULL);
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        if (run_spawn_actions(req) == 0)
+        {
+            execve(req->path, req->argv, req->envp);
+        }
+        int err = errno;
+        write(errpipe[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    int saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    close(errpipe[1]);
+    if (pid < 0)
+    {
+        close(errpipe[0]);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // EOF means the child made it to execv()
+    int child_errno;
+    ssize_t n;
+    do
+    {
+        n = read(errpipe[0], &child_errno, sizeof(child_errno));
+    } while (n == -1 && errno == EINTR);
+    close(errpipe[0]);
+    if (trace_file != NULL)
+    {
+        trace_event("spawn", start, trace_now(), pid, req->argv, req->path);
+        for (int i = 0; i < req->num_actions; i++)
+        {
+            struct spawn_action *action = &req->actions[i];
+            if (action->type == SPAWN_OPEN && (action->end.tv_sec != 0 || action->end.tv_nsec != 0))
+            {
+                trace_event("open", trace_time(&action->start), trace_time(&action->end), pid, NULL, action->path);
+            }
+        }
+    }
+    if (n == sizeof(child_errno))
+    {
+        waitpid(pid, NULL, 0);
+        errno = child_errno;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Function: run_spawn_actions
+ * ---------------------------
+ * Runs the file actions of a spawn request in order, in a child about to exec.
+ * Only makes system calls, so it is safe in a child sharing its parent's memory.
+ *
+ * req: the request whose actions are run
+ *
+ * return: -1 (with errno set) if an action failed, 0 on success
+ */
+int run_spawn_actions(struct spawn_req *req)
+{
+    for (int i = 0; i < req->num_actions; i++)
+    {
+        struct spawn_action *action = &req->actions[i];
+        if (action->type == SPAWN_DUP2)
+        {
+            // dup2() onto itself would keep the close-on-exec flag
+            if (action->src_fd == action->fd)
+            {
+                if (fcntl(action->fd, F_SETFD, 0) == -1)
+                {
+                    return -1;
+                }
+            }
+            else if (dup2(action->src_fd, action->fd) == -1)
+            {
+                return -1;
+            }
+        }
+        else if (action->type == SPAWN_CLOSE)
+        {
+            close(action->fd);
+        }
+        else if (action->type == SPAWN_SETPGID)
+        {
+            if (setpgid(0, action->fd) == -1)
+            {
+                return -1;
+            }
+        }
+        else if (action->type == SPAWN_SCHED)
+        {
+            if (apply_sched(action->sched) == -1)
+            {
+                return -1;
+            }
+        }
+        else if (action->type == SPAWN_LIMITS)
+        {
+            if (apply_limits(action->limits) == -1)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            // The times are written into the shell's memory, which the child is borrowing
+            if (trace_file != NULL)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &action->start);
+            }
+            int fd = open(action->path, action->flags, action->mode);
+            if (trace_file != NULL)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &action->end);
+            }
+            if (fd == -1)
+            {
+                return -1;
+            }
+            if (fd != action->fd)
+            {
+                if (dup2(fd, action->fd) == -1)
+                {
+                    return -1;
+                }
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: forkserver_start
+ * --------------------------
+ * Starts the fork server: a helper process, forked before the shell has set up
+ * anything, that starts children on the shell's behalf (see forkserver_run()).
+ * It must be called first thing in main(), so the helper has no heap, stdio
+ * buffers, signal handlers or open files of the shell's to carry around.
+ * If it can't be started, the shell starts its children itself.
+ */
+void forkserver_start(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+    {
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sv[0]);
+        forkserver_run(sv[1]);
+    }
+    close(sv[1]);
+    if (pid == -1)
+    {
+        close(sv[0]);
+        return;
+    }
+    forkserver_fd = sv[0];
+    forkserver_pid = pid;
+}
+
+/**
+ * Function: forkserver_run
+ * ------------------------
+ * Main loop of the fork server.  Each request (see forkserver_spawn()) holds the
+ * binary, arguments and file actions of one child, with the descriptors the
+ * actions duplicate passed along with SCM_RIGHTS.  The child is created with
+ * clone(CLONE_VM | CLONE_VFORK | CLONE_PARENT): it borrows the server's small
+ * address space like vfork() would, and it is the shell's child rather than the
+ * server's, so the shell reaps it with everything else in wait_children().
+ * The server keeps the last environment it was sent, since the shell only
+ * sends one after its exported variables change.
+ * The server answers each request with the child's pid and the errno the
+ * child failed with (0 if it got to execve()), and exits when the shell
+ * closes its end of the socket.
+ *
+ * sock: the server's end of the socket
+ */
+void forkserver_run(int sock)
+{
+    // Ctrl-C is meant for the shell's children, not for the server; they get the old dispositions back
+    struct sigaction ignore, old_int, old_quit;
+    ignore.sa_handler = SIG_IGN;
+    ignore.sa_flags = 0;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &old_int);
+    sigaction(SIGQUIT, &ignore, &old_quit);
+
+    static char buf[FORKSERVER_MAX_REQ + 1];
+    static char **env = NULL;
+    static char *env_strings = NULL;
+    env = environ;
+    while (1)
+    {
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int) * FORKSERVER_MAX_FDS)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {buf, FORKSERVER_MAX_REQ};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < (ssize_t)sizeof(struct forkserver_hdr))
+        {
+            _exit(0);
+        }
+        buf[n] = '\0';
+
+        int fds[FORKSERVER_MAX_FDS];
+        int num_fds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num_fds);
+        }
+
+        // Rebuild the request: the header, the actions, then the path, argv, open() paths and environment
+        struct forkserver_reply reply = {-1, EINVAL};
+        struct forkserver_hdr hdr;
+        struct forkserver_child child;
+        memcpy(&hdr, buf, sizeof(hdr));
+        size_t off = sizeof(hdr) + sizeof(struct forkserver_action) * hdr.num_actions;
+        int ok = hdr.num_fds == num_fds && hdr.num_actions >= 0 && hdr.num_actions <= MAX_SPAWN_ACTIONS &&
+                 hdr.argc >= 0 && hdr.argc < n && hdr.envc < n && off <= (size_t)n &&
+                 !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+        char *argv[ok ? hdr.argc + 1 : 1];
+        if (ok)
+        {
+            struct forkserver_action *actions = (struct forkserver_action *)(buf + sizeof(hdr));
+            char *s = buf + off;
+            child.req.path = s;
+            s += strlen(s) + 1;
+            for (int i = 0; i < hdr.argc; i++)
+            {
+                argv[i] = s;
+                s += strlen(s) + 1;
+            }
+            argv[hdr.argc] = NULL;
+            child.req.argv = argv;
+            child.req.num_actions = hdr.num_actions;
+            for (int i = 0; i < hdr.num_actions; i++)
+            {
+                struct spawn_action *action = &child.req.actions[i];
+                action->type = actions[i].type;
+                action->fd = actions[i].fd;
+                action->src_fd = action->type == SPAWN_DUP2 ? fds[actions[i].src] : -1;
+                action->flags = actions[i].flags;
+                action->mode = actions[i].mode;
+                if (action->type == SPAWN_OPEN)
+                {
+                    action->path = s;
+                    s += strlen(s) + 1;
+                }
+                else if (action->type == SPAWN_SCHED)
+                {
+                    // The CPU mask is raw bytes among the strings
+                    child.sched.nice = actions[i].fd;
+                    child.sched.ioprio = actions[i].flags;
+                    child.sched.cpus_size = actions[i].mode;
+                    child.sched.cpus = actions[i].mode > 0 ? (cpu_set_t *)s : NULL;
+                    action->sched = &child.sched;
+                    s += actions[i].mode;
+                }
+                else if (action->type == SPAWN_LIMITS)
+                {
+                    memcpy(child.limits.rlimits, s, sizeof(child.limits.rlimits));
+                    child.limits.cgroup_fd = actions[i].src == -1 ? -1 : fds[actions[i].src];
+                    action->limits = &child.limits;
+                    s += sizeof(child.limits.rlimits);
+                }
+            }
+            child.old_int = &old_int;
+            child.old_quit = &old_quit;
+            child.err = 0;
+
+            // The shell's exported variables changed since the last request, and they are the last
+            // strings; they're copied out of buf to be kept for the requests that don't send them
+            int err = 0;
+            if (hdr.envc >= 0)
+            {
+                size_t size = buf + n - s;
+                char *strings = malloc(size + 1);
+                char **new_env = malloc(sizeof(char *) * (hdr.envc + 1));
+                if (strings == NULL || new_env == NULL)
+                {
+                    free(strings);
+                    free(new_env);
+                    err = ENOMEM;
+                }
+                else
+                {
+                    memcpy(strings, s, size + 1);
+                    char *e = strings;
+                    for (int i = 0; i < hdr.envc; i++)
+                    {
+                        new_env[i] = e;
+                        e += e < strings + size ? strlen(e) + 1 : 0;
+                    }
+                    new_env[hdr.envc] = NULL;
+                    if (env != environ)
+                    {
+                        free(env);
+                    }
+                    free(env_strings);
+                    env = new_env;
+                    env_strings = strings;
+                }
+            }
+            child.req.envp = env;
+
+            // The shell changed directories since the last request
+            if (err != 0)
+            {
+                reply.err = err;
+            }
+            else if (hdr.chdir && fchdir(fds[num_fds - 1]) == -1)
+            {
+                reply.err = errno;
+            }
+            else
+            {
+                static char stack[FORKSERVER_STACK_SIZE] __attribute__((aligned(16)));
+                reply.pid = clone(forkserver_child, stack + sizeof(stack),
+                                  CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &child);
+                reply.err = reply.pid == -1 ? errno : child.err;
+            }
+        }
+        for (int i = 0; i < num_fds; i++)
+        {
+            close(fds[i]);
+        }
+        while (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) == -1 && errno == EINTR)
+        {
+        }
+    }
+}
+
+/**
+ * Function: forkserver_child
+ * --------------------------
+ * Runs in a child of the fork server, on its own stack but in the server's
+ * memory, until it execs.  Puts back the SIGINT and SIGQUIT dispositions the
+ * server ignores, runs the file actions and execs the binary; on failure the
+ * errno is left in the server's memory for forkserver_run() to send back.
+ *
+ * arg: the request (a struct forkserver_child)
+ *
+ * return: never returns
+ */
+int forkserver_child(void *arg)
+{
+    struct forkserver_child *child = arg;
+    sigaction(SIGINT, child->old_int, NULL);
+    sigaction(SIGQUIT, child->old_quit, NULL);
+    if (run_spawn_actions(&child->req) == 0)
+    {
+        execve(child->req.path, child->req.argv, child->req.envp);
+    }
+    child->err = errno;
+    _exit(127);
+}
+
+/**
+ * Function: forkserver_spawn
+ * --------------------------
+ * Launches a child process through the fork server.  The request is packed
+ * into one message: a header, the file actions (with descriptors to duplicate
+ * given as indexes into the descriptors passed with SCM_RIGHTS), then the path,
+ * the arguments and the paths to open, all NUL-terminated (a scheduling
+ * action's CPU mask and a limits action's caps go in among them as is).  When the shell has
+ * changed directories since the last request, its new working directory is
+ * passed last, so relative paths mean the same thing to the server.  Likewise
+ * the environment (req->envp) only follows the other strings when the exported
+ * variables changed since the server was last sent it; one too big to send
+ * is caught from its size (see var_environ()) without packing any of it.
+ *
+ * req: the binary, arguments and file actions for the child
+ *
+ * return: the pid of the child on success,
+ *         -1 (with errno set to the child's error) if it could not be started,
+ *         -2 if the request can't go through the server (too big, or the server is gone,
+ *         in which case it is shut down), so the caller should start the child itself
+ */
+pid_t forkserver_spawn(struct spawn_req *req)
+{
+    static char buf[FORKSERVER_MAX_REQ];
+    struct forkserver_hdr hdr;
+    int fds[FORKSERVER_MAX_FDS];
+    hdr.argc = 0;
+    hdr.num_actions = req->num_actions;
+    hdr.num_fds = 0;
+    hdr.chdir = 0;
+    hdr.envc = -1;
+
+    // The actions go after the header, and the strings after them
+    struct forkserver_action *actions = (struct forkserver_action *)(buf + sizeof(hdr));
+    size_t off = sizeof(hdr) + sizeof(struct forkserver_action) * req->num_actions;
+    off = forkserver_pack(buf, off, req->path);
+    for (; req->argv[hdr.argc] != NULL; hdr.argc++)
+    {
+        off = forkserver_pack(buf, off, req->argv[hdr.argc]);
+    }
+    for (int i = 0; i < req->num_actions; i++)
+    {
+        struct spawn_action *action = &req->actions[i];
+        actions[i].type = action->type;
+        actions[i].fd = action->fd;
+        actions[i].src = -1;
+        actions[i].flags = action->flags;
+        actions[i].mode = action->mode;
+        if (action->type == SPAWN_DUP2)
+        {
+            actions[i].src = hdr.num_fds;
+            fds[hdr.num_fds++] = action->src_fd;
+        }
+        else if (action->type == SPAWN_OPEN)
+        {
+            off = forkserver_pack(buf, off, action->path);
+        }
+        else if (action->type == SPAWN_SCHED)
+        {
+            actions[i].fd = action->sched->nice;
+            actions[i].flags = action->sched->ioprio;
+            actions[i].mode = action->sched->cpus != NULL ? action->sched->cpus_size : 0;
+            if (action->sched->cpus != NULL)
+            {
+                off = forkserver_pack_bytes(buf, off, action->sched->cpus, action->sched->cpus_size);
+            }
+        }
+        else if (action->type == SPAWN_LIMITS)
+        {
+            if (action->limits->cgroup_fd != -1)
+            {
+                actions[i].src = hdr.num_fds;
+                fds[hdr.num_fds++] = action->limits->cgroup_fd;
+            }
+            off = forkserver_pack_bytes(buf, off, action->limits->rlimits, sizeof(action->limits->rlimits));
+        }
+    }
+    unsigned long version = env_version;
+    if (forkserver_env_version != version)
+    {
+        // An environment too big to send is known to be before any of it is packed
+        if (off + var_env_bytes > sizeof(buf))
+        {
+            return -2;
+        }
+        for (hdr.envc = 0; req->envp[hdr.envc] != NULL; hdr.envc++)
+        {
+            off = forkserver_pack(buf, off, req->envp[hdr.envc]);
+        }
+    }
+    if (off > sizeof(buf))
+    {
+        return -2;
+    }
+    int cwd = -1;
+    if (forkserver_cwd_changed)
+    {
+        if ((cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+        {
+            return -2;
+        }
+        fds[hdr.num_fds++] = cwd;
+        hdr.chdir = 1;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * FORKSERVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {buf, off};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (hdr.num_fds > 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * hdr.num_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * hdr.num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * hdr.num_fds);
+    }
+
+    struct forkserver_reply reply;
+    ssize_t n;
+    while ((n = sendmsg(forkserver_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    {
+    }
+    if (n != -1)
+    {
+        while ((n = recv(forkserver_fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR)
+        {
+        }
+    }
+    if (cwd != -1)
+    {
+        close(cwd);
+    }
+    if (n != sizeof(reply))
+    {
+        // The server exits when it sees the socket close, if it hasn't died already
+        close(forkserver_fd);
+        forkserver_fd = -1;
+        waitpid(forkserver_pid, NULL, 0);
+        return -2;
+    }
+    if (reply.pid > 0)
+    {
+        forkserver_cwd_changed = 0;
+        forkserver_env_version = version;
+    }
+    if (reply.err != 0)
+    {
+        // The child exited with 127 and is the shell's to reap
+        if (reply.pid > 0)
+        {
+            waitpid(reply.pid, NULL, 0);
+        }
+        errno = reply.err;
+        return -1;
+    }
+    return reply.pid;
+}
+
+/**
+ * Function: forkserver_pack
+ * -------------------------
+ * Appends a NUL-terminated string to a fork server request
+ *
+ * buf: the request, FORKSERVER_MAX_REQ bytes long
+ *
+ * off: where the string goes
+ *
+ * s: the string
+ *
+ * return: the offset after the string, which is past the end of buf if it didn't fit
+ *         (and then nothing was written)
+ */
+size_t forkserver_pack(char *buf, size_t off, const char *s)
+{
+    return forkserver_pack_bytes(buf, off, s, strlen(s) + 1);
+}
+
+/**
+ * Function: forkserver_pack_bytes
+ * -------------------------------
+ * Appends raw bytes to a fork server request, the way forkserver_pack() appends a string
+ *
+ * return: the offset after the bytes, which is past the end of buf if they didn't fit
+ *         (and then nothing was written)
+ */
+size_t forkserver_pack_bytes(char *buf, size_t off, const void *data, size_t len)
+{
+    if (off + len <= FORKSERVER_MAX_REQ)
+    {
+        memcpy(buf + off, data, len);
+    }
+    return off + len;
+}
+
+/**
+ * Function: hash_name
+ * -------------------
+ * FNV-1a hash of a string, used for the command-location cache
+ *
+ * s: the string to be hashed
+ *
+ * return: the hash of s
+ */
+unsigned long hash_name(const char *s)
+{
+    return hash_bytes(s, strlen(s));
+}
+
+/**
+ * Function: hash_bytes
+ * --------------------
+ * FNV-1a hash of the first len bytes of a string, used for the names of
+ * variables, which are often followed by more of a word
+ *
+ * s: the bytes to be hashed
+ *
+ * len: the number of bytes
+ *
+ * return: the hash of the bytes
+ */
+unsigned long hash_bytes(const char *s, size_t len)
+{
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/**
+ * Function: path_cache_clear
+ * --------------------------
+ * Forgets every remembered command location (the "hash -r" builtin)
+ */
+void path_cache_clear(void)
+{
+    for (size_t i = 0; i < path_cache_slots; i++)
+    {
+        if (path_cache[i].name != NULL)
+        {
+            free(path_cache[i].name);
+            free(path_cache[i].path);
+            path_cache[i].name = NULL;
+        }
+    }
+    path_cache_used = 0;
+}
+
+/**
+ * Function: path_cache_find
+ * -------------------------
+ * Finds the slot for a command name in the open-addressing (linear probing)
+ * command-location table.
+ *
+ * name: the command name to look up
+ *
+ * return: the slot holding name, or the empty slot where it would be inserted
+ */
+struct path_cache_entry *path_cache_find(const char *name)
+{
+    size_t i = hash_name(name) & (path_cache_slots - 1);
+    while (path_cache[i].name != NULL && strcmp(path_cache[i].name, name) != 0)
+    {
+        i = (i + 1) & (path_cache_slots - 1);
+    }
+    return &path_cache[i];
+}
+
+/**
+ * Function: path_cache_insert
+ * ---------------------------
+ * Remembers the location of a command, growing the table when it is 3/4 full
+ *
+ * name: the command name
+ *
+ * path: the full path the command resolved to
+ *
+ * return: the new entry, or NULL on failure
+ */
+struct path_cache_entry *path_cache_insert(const char *name, const char *path)
+{
+    if ((path_cache_used + 1) * 4 > path_cache_slots * 3)
+    {
+        size_t old_slots = path_cache_slots;
+        struct path_cache_entry *old = path_cache;
+        size_t new_slots = old_slots == 0 ? PATH_CACHE_MIN_SLOTS : old_slots * 2;
+        struct path_cache_entry *table = calloc(new_slots, sizeof(struct path_cache_entry));
+        if (table == NULL)
+        {
+            return NULL;
+        }
+        path_cache = table;
+        path_cache_slots = new_slots;
+        for (size_t i = 0; i < old_slots; i++)
+        {
+            if (old[i].name != NULL)
+            {
+                *path_cache_find(old[i].name) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct path_cache_entry *entry = path_cache_find(name);
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    if (entry->name == NULL || entry->path == NULL)
+    {
+        free(entry->name);
+        free(entry->path);
+        entry->name = NULL;
+        return NULL;
+    }
+    entry->hits = 0;
+    path_cache_used++;
+    return entry;
+}
+
+/**
+ * Function: path_cache_revalidate
+ * -------------------------------
+ * Makes sure the command-location cache still matches PATH.
+ * If PATH itself changed, the list of directories is rebuilt.  Otherwise each
+ * directory is stat()ed and, if any of their mtimes changed (a binary was added,
+ * removed or renamed), every remembered location is dropped.
+ * resolve_cmd() calls this at most once per input line, so hot loops never touch
+ * the file system to resolve a command they have already run, and lines without
+ * external commands don't pay for it at all.
+ */
+void path_cache_revalidate(void)
+{
+    const char *path_env = var_get("PATH");
+    if (path_env == NULL)
+    {
+        path_env = DEFAULT_PATH;
+    }
+    path_cache_line = line_number;
+
+    // Rebuild the directory list when PATH changes
+    if (path_cache_env == NULL || strcmp(path_cache_env, path_env) != 0)
+    {
+        for (int i = 0; i < num_path_dirs; i++)
+        {
+            free(path_dirs[i].dir);
+        }
+        free(path_dirs);
+        free(path_cache_env);
+        path_dirs = NULL;
+        num_path_dirs = 0;
+        path_cache_clear();
+        if ((path_cache_env = strdup(path_env)) == NULL)
+        {
+            return;
+        }
+
+        int n = 1;
+        for (const char *c = path_env; *c != '\0'; c++)
+        {
+            if (*c == ':')
+            {
+                n++;
+            }
+        }
+        if ((path_dirs = calloc(n, sizeof(struct path_dir))) == NULL)
+        {
+            return;
+        }
+        const char *start = path_env;
+        while (1)
+        {
+            const char *end = strchrnul(start, ':');
+            struct path_dir *pd = &path_dirs[num_path_dirs++];
+
+            // An empty entry means the current directory
+            pd->dir = end == start ? strdup(".") : strndup(start, end - start);
+            struct stat st;
+            if (pd->dir != NULL && stat(pd->dir, &st) == 0)
+            {
+                pd->mtime = st.st_mtim;
+            }
+            if (*end == '\0')
+            {
+                break;
+            }
+            start = end + 1;
+        }
+        return;
+    }
+
+    int changed = 0;
+    for (int i = 0; i < num_path_dirs; i++)
+    {
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (path_dirs[i].dir != NULL && stat(path_dirs[i].dir, &st) == 0)
+        {
+            mtime = st.st_mtim;
+        }
+        if (mtime.tv_sec != path_dirs[i].mtime.tv_sec || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec)
+        {
+            path_dirs[i].mtime = mtime;
+            changed = 1;
+        }
+    }
+    if (changed)
+    {
+        path_cache_clear();
+    }
+}
+
+/**
+ * Function: resolve_cmd
+ * ---------------------
+ * Finds the binary to execute for a command.
+ * Commands containing a "/" are used as they are.  Anything else is looked up in
+ * the command-location cache first, and only on a miss are the PATH directories
+ * searched (the first executable regular file wins) and the result remembered.
+ *
+ * name: the command as typed (args[0])
+ *
+ * return: the path to execute, or NULL (with errno set) if there is none
+ */
+const char *resolve_cmd(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+    {
+        return name;
+    }
+    if (path_cache_env == NULL || path_cache_line != line_number)
+    {
+        path_cache_revalidate();
+    }
+
+    if (path_cache_slots > 0)
+    {
+        struct path_cache_entry *entry = path_cache_find(name);
+        if (entry->name != NULL)
+        {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    char buf[PATH_MAX];
+    for (int i = 0; i < num_path_dirs; i++)
+    {
+        if (path_dirs[i].dir == NULL)
+        {
+            continue;
+        }
+        if (snprintf(buf, sizeof(buf), "%s/%s", path_dirs[i].dir, name) >= (int)sizeof(buf))
+        {
+            continue;
+        }
+        struct stat st;
+        if (access(buf, X_OK) == 0 && stat(buf, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            struct path_cache_entry *entry = path_cache_insert(name, buf);
+            if (entry == NULL)
+            {
+                return NULL;
+            }
+            entry->hits++;
+            return entry->path;
+        }
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+/**
+ * Function: run_hash
+ * ------------------
+ * Helper function for the hash built-in command.
+ * "hash" lists the remembered command locations with their hit counts,
+ * "hash -r" forgets all of them.
+ *
+ * args: An array of strings containing the input for the command
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_hash(char **args, int num_args)
+{
+    if (num_args > 2)
+    {
+        return -1;
+    }
+    if (num_args == 2)
+    {
+        if (strcmp(args[1], "-r") != 0)
+        {
+            return -1;
+        }
+        path_cache_clear();
+        return 0;
+    }
+    if (path_cache_used == 0)
+    {
+        return 0;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < path_cache_slots; i++)
+    {
+        if (path_cache[i].name != NULL)
+        {
+            printf("%4lu\t%s\n", path_cache[i].hits, path_cache[i].path);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: trie_refresh
+ * ----------------------
+ * Makes sure the trie of commands the line editor completes matches PATH.
+ * The trie is built the first time a command is completed, not when the
+ * shell starts.  After that, each directory in PATH is stat()ed and only the
+ * ones whose mtime changed are read again, so a completion costs a dozen
+ * stat()s, not reading every directory.  A new PATH builds a new trie.
+ *
+ * return: -1 on failure, 0 on success
+ */
+int trie_refresh(void)
+{
+    const char *path_env = var_get("PATH");
+    if (path_env == NULL)
+    {
+        path_env = DEFAULT_PATH;
+    }
+
+    if (trie_path_env == NULL || strcmp(trie_path_env, path_env) != 0)
+    {
+        for (int i = 0; i < num_trie_dirs; i++)
+        {
+            free(trie_dirs[i].dir);
+            free(trie_dirs[i].names);
+        }
+        free(trie_dirs);
+        free(trie_path_env);
+        trie_dirs = NULL;
+        num_trie_dirs = 0;
+        trie_path_env = NULL;
+
+        int n = 1;
+        for (const char *c = path_env; *c != '\0'; c++)
+        {
+            if (*c == ':')
+            {
+                n++;
+            }
+        }
+        if ((trie_dirs = calloc(n, sizeof(struct trie_dir))) == NULL)
+        {
+            return -1;
+        }
+        const char *start = path_env;
+        while (1)
+        {
+            const char *end = strchrnul(start, ':');
+            struct trie_dir *td = &trie_dirs[num_trie_dirs++];
+
+            // An empty entry means the current directory
+            td->dir = end == start ? strdup(".") : strndup(start, end - start);
+            td->mtime.tv_sec = -1;
+            td->mtime.tv_nsec = -1;
+            if (*end == '\0')
+            {
+                break;
+            }
+            start = end + 1;
+        }
+        if (trie_rebuild() == -1 || (trie_path_env = strdup(path_env)) == NULL)
+        {
+            return -1;
+        }
+    }
+
+    size_t names_len = 0;
+    for (int i = 0; i < num_trie_dirs; i++)
+    {
+        struct trie_dir *td = &trie_dirs[i];
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (td->dir != NULL && stat(td->dir, &st) == 0)
+        {
+            mtime = st.st_mtim;
+        }
+        if (mtime.tv_sec != td->mtime.tv_sec || mtime.tv_nsec != td->mtime.tv_nsec)
+        {
+            td->mtime = mtime;
+            if (trie_scan(td) == -1)
+            {
+                // Read it all again next time
+                td->mtime.tv_sec = -1;
+                return -1;
+            }
+        }
+        names_len += td->names_len;
+    }
+
+    // Nodes of commands that went away are left behind, until there are as many of them as live ones
+    if (trie_nodes > names_len + TRIE_MIN_NODES)
+    {
+        return trie_rebuild();
+    }
+    return 0;
+}
+
+/**
+ * Function: trie_rebuild
+ * ----------------------
+ * Builds the trie of commands again from the builtins and the executables
+ * last read from each directory in PATH, without reading any of them
+ *
+ * return: -1 on failure, 0 on success
+ */
+int trie_rebuild(void)
+{
+    if (trie_size == 0)
+    {
+        if ((trie = malloc(TRIE_MIN_NODES * sizeof(struct trie_node))) == NULL)
+        {
+            return -1;
+        }
+        trie_size = TRIE_MIN_NODES;
+    }
+    memset(&trie[0], 0, sizeof(struct trie_node));
+    trie_nodes = 1;
+
+    // The builtins are commands whatever PATH is
+    for (int i = 0; i < BUILTIN_SLOTS; i++)
+    {
+        if (builtins[i].name != NULL && trie_add(builtins[i].name, 1) == -1)
+        {
+            return -1;
+        }
+    }
+    for (int i = 0; i < num_trie_dirs; i++)
+    {
+        struct trie_dir *td = &trie_dirs[i];
+        for (size_t off = 0; off < td->names_len; off += strlen(td->names + off) + 1)
+        {
+            if (trie_add(td->names + off, 1) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: trie_scan
+ * -------------------
+ * (Re)reads the executables in a directory of PATH into the trie of
+ * commands.  Like resolve_cmd(), only regular files (or links to them) that
+ * can be executed count.  Reading a directory again only changes the trie
+ * for the names that came or went, and only checks the new ones, so adding
+ * one command to a directory of thousands costs a readdir() of it.
+ *
+ * td: the directory
+ *
+ * return: -1 on failure, 0 on success (a directory that can't be read has no executables)
+ */
+int trie_scan(struct trie_dir *td)
+{
+    // The names the directory had, in an open-addressing table of their offsets plus one
+    size_t slots = 1;
+    while (slots < td->num_names * 2)
+    {
+        slots *= 2;
+    }
+    size_t *known = calloc(slots, sizeof(size_t));
+    if (known == NULL)
+    {
+        return -1;
+    }
+    char *old = td->names;
+    for (size_t off = 0; off < td->names_len; off += strlen(old + off) + 1)
+    {
+        size_t i = hash_name(old + off) & (slots - 1);
+        while (known[i] != 0)
+        {
+            i = (i + 1) & (slots - 1);
+        }
+        known[i] = off + 1;
+    }
+    td->names = NULL;
+    td->names_len = 0;
+    td->names_size = 0;
+    td->num_names = 0;
+
+    int ret = 0;
+    DIR *d = td->dir != NULL ? opendir(td->dir) : NULL;
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL)
+    {
+        if (e->d_name[0] == '.' || e->d_type == DT_DIR)
+        {
+            continue;
+        }
+
+        // Names it still has are marked with SIZE_MAX, which keeps the others findable
+        size_t i = hash_name(e->d_name) & (slots - 1);
+        while (known[i] != 0 && (known[i] == SIZE_MAX || strcmp(old + known[i] - 1, e->d_name) != 0))
+        {
+            i = (i + 1) & (slots - 1);
+        }
+        if (known[i] != 0)
+        {
+            known[i] = SIZE_MAX;
+        }
+        else
+        {
+            struct stat st;
+            if (e->d_type != DT_REG && (fstatat(dirfd(d), e->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode)))
+            {
+                continue;
+            }
+            if (faccessat(dirfd(d), e->d_name, X_OK, 0) == -1)
+            {
+                continue;
+            }
+            if (trie_add(e->d_name, 1) == -1)
+            {
+                ret = -1;
+                break;
+            }
+        }
+
+        size_t len = strlen(e->d_name) + 1;
+        if (td->names_len + len > td->names_size)
+        {
+            size_t size = td->names_size == 0 ? 4096 : td->names_size * 2;
+            char *names = realloc(td->names, size);
+            if (names == NULL)
+            {
+                // Not kept, so not in the trie either
+                trie_add(e->d_name, -1);
+                ret = -1;
+                break;
+            }
+            td->names = names;
+            td->names_size = size;
+        }
+        memcpy(td->names + td->names_len, e->d_name, len);
+        td->names_len += len;
+        td->num_names++;
+    }
+    if (d != NULL)
+    {
+        closedir(d);
+    }
+
+    // Whatever wasn't seen again is gone
+    for (size_t i = 0; i < slots; i++)
+    {
+        if (known[i] != 0 && known[i] != SIZE_MAX)
+        {
+            trie_add(old + known[i] - 1, -1);
+        }
+    }
+    free(known);
+    free(old);
+    return ret;
+}
+
+/**
+ * Function: trie_add
+ * ------------------
+ * Adds a command to the trie of commands, or takes one out.  Each node is a
+ * byte of a command, with its children in a list sorted by byte, and counts
+ * the commands ending below it, so a prefix that nothing completes anymore
+ * is skipped over without freeing its nodes.  A command in several
+ * directories of PATH is added once for each.
+ *
+ * name: the command
+ *
+ * delta: 1 to add it, -1 to take it out (it must have been added)
+ *
+ * return: -1 on failure, 0 on success
+ */
+int trie_add(const char *name, int delta)
+{
+    uint32_t path[NAME_MAX + 1]; // The nodes from the root to the command's last byte
+    size_t depth = 0;
+    uint32_t node = 0;
+    if (strlen(name) > NAME_MAX)
+    {
+        return 0;
+    }
+    path[depth++] = node;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+    {
+        uint32_t prev = 0; // The child the byte goes after, 0 if it goes first
+        uint32_t next = trie[node].child;
+        while (next != 0 && trie[next].c < *c)
+        {
+            prev = next;
+            next = trie[next].sibling;
+        }
+        if (next == 0 || trie[next].c != *c)
+        {
+            if (trie_nodes == trie_size)
+            {
+                struct trie_node *nodes = realloc(trie, trie_size * 2 * sizeof(struct trie_node));
+                if (nodes == NULL)
+                {
+                    return -1;
+                }
+                trie = nodes;
+                trie_size *= 2;
+            }
+            trie[trie_nodes] = (struct trie_node){0, next, 0, 0, *c};
+            if (prev == 0)
+            {
+                trie[node].child = trie_nodes;
+            }
+            else
+            {
+                trie[prev].sibling = trie_nodes;
+            }
+            next = trie_nodes++;
+        }
+        node = next;
+        path[depth++] = node;
+    }
+
+    // The command appearing or going away changes the count of every prefix of it
+    int was = trie[node].count > 0;
+    trie[node].count += delta;
+    if (was != (trie[node].count > 0))
+    {
+        for (size_t i = 0; i < depth; i++)
+        {
+            trie[path[i]].words += delta;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: trie_find
+ * -------------------
+ * Finds the node of the trie of commands for a prefix
+ *
+ * prefix: the start of a command
+ *
+ * len: the length of prefix
+ *
+ * return: the node, or -1 if no command starts with prefix
+ */
+long trie_find(const char *prefix, size_t len)
+{
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        uint32_t next = trie[node].child;
+        while (next != 0 && trie[next].c < (unsigned char)prefix[i])
+        {
+            next = trie[next].sibling;
+        }
+        if (next == 0 || trie[next].c != (unsigned char)prefix[i])
+        {
+            return -1;
+        }
+        node = next;
+    }
+    return trie[node].words > 0 ? (long)node : -1;
+}
+
+/**
+ * Function: trie_collect
+ * ----------------------
+ * Gathers the commands ending under a node of the trie, in sorted order,
+ * copying them into complete_arena
+ *
+ * node: the node
+ *
+ * prefix: the bytes leading to node, with room for the longest command
+ *
+ * len: the length of prefix
+ *
+ * names: where the commands are stored, with room for trie[node].words more of them
+ *
+ * n: the number of commands already in names
+ *
+ * return: the number of commands in names, or -1 on failure
+ */
+long trie_collect(uint32_t node, char *prefix, size_t len, char **names, long n)
+{
+    if (trie[node].count > 0 && (names[n++] = arena_strndup(&complete_arena, prefix, len)) == NULL)
+    {
+        return -1;
+    }
+    for (uint32_t c = trie[node].child; c != 0; c = trie[c].sibling)
+    {
+        if (trie[c].words > 0)
+        {
+            prefix[len] = trie[c].c;
+            if ((n = trie_collect(c, prefix, len + 1, names, n)) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * Function: dir_cache_get
+ * -----------------------
+ * Gets the listing of a directory for completing file names.  The last
+ * DIR_CACHE_SLOTS directories listed are kept, and one is only read again
+ * when its mtime changes, so pressing Tab in a big directory costs a stat().
+ *
+ * dir: the directory as typed, "" for the working directory
+ *
+ * return: the listing, or NULL (with errno set) on failure
+ */
+struct dir_listing *dir_cache_get(const char *dir)
+{
+    const char *path = *dir != '\0' ? dir : ".";
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        return NULL;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    // Empty slots are never used, so they're replaced first
+    struct dir_listing *l = NULL;
+    struct dir_listing *oldest = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SLOTS && l == NULL; i++)
+    {
+        if (dir_cache[i].dir != NULL && strcmp(dir_cache[i].dir, dir) == 0)
+        {
+            l = &dir_cache[i];
+        }
+        else if (dir_cache[i].used < oldest->used)
+        {
+            oldest = &dir_cache[i];
+        }
+    }
+    if (l != NULL && l->dev == st.st_dev && l->ino == st.st_ino && l->mtime.tv_sec == st.st_mtim.tv_sec &&
+        l->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        l->used = ++dir_cache_clock;
+        return l;
+    }
+    if (l == NULL)
+    {
+        l = oldest;
+    }
+
+    free(l->dir);
+    free(l->names);
+    free(l->block);
+    memset(l, 0, sizeof(struct dir_listing));
+    if (dir_list(l, path) == -1 || (l->dir = strdup(dir)) == NULL)
+    {
+        free(l->names);
+        free(l->block);
+        memset(l, 0, sizeof(struct dir_listing));
+        return NULL;
+    }
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    l->used = ++dir_cache_clock;
+    return l;
+}
+
+/**
+ * Function: dir_list
+ * ------------------
+ * Reads the names in a directory into a listing, sorted with the hidden
+ * ones first.  Directories (and links to them) get a "/" added.
+ *
+ * l: the listing, empty
+ *
+ * path: the directory
+ *
+ * return: -1 on failure, 0 on success
+ */
+int dir_list(struct dir_listing *l, const char *path)
+{
+    DIR *d = opendir(path);
+    if (d == NULL)
+    {
+        return -1;
+    }
+    size_t len = 0;
+    size_t size = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+        {
+            continue;
+        }
+        int is_dir = e->d_type == DT_DIR;
+        struct stat st;
+        if (e->d_type == DT_LNK || e->d_type == DT_UNKNOWN)
+        {
+            is_dir = fstatat(dirfd(d), e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        size_t name_len = strlen(e->d_name);
+        if (len + name_len + 2 > size)
+        {
+            size = size == 0 ? 4096 : size * 2;
+            while (len + name_len + 2 > size)
+            {
+                size *= 2;
+            }
+            char *block = realloc(l->block, size);
+            if (block == NULL)
+            {
+                closedir(d);
+                return -1;
+            }
+            l->block = block;
+        }
+        memcpy(l->block + len, e->d_name, name_len);
+        if (is_dir)
+        {
+            l->block[len + name_len++] = '/';
+        }
+        l->block[len + name_len] = '\0';
+        len += name_len + 1;
+        l->count++;
+    }
+    closedir(d);
+
+    if ((l->names = malloc((l->count + 1) * sizeof(char *))) == NULL)
+    {
+        return -1;
+    }
+    size_t off = 0;
+    for (size_t i = 0; i < l->count; i++)
+    {
+        l->names[i] = l->block + off;
+        off += strlen(l->block + off) + 1;
+        if (l->names[i][0] == '.')
+        {
+            l->hidden++;
+        }
+    }
+    qsort(l->names, l->count, sizeof(char *), compare_names);
+    return 0;
+}
+
+/**
+ * Function: compare_names
+ * -----------------------
+ * Orders the names of a directory listing for qsort(): hidden ones first,
+ * then by strcmp()
+ *
+ * a: a pointer to the first name
+ *
+ * b: a pointer to the second name
+ *
+ * return: < 0 if a goes first, > 0 if b does, 0 if they're the same
+ */
+int compare_names(const void *a, const void *b)
+{
+    const char *x = *(char *const *)a;
+    const char *y = *(char *const *)b;
+    if ((x[0] == '.') != (y[0] == '.'))
+    {
+        return x[0] == '.' ? -1 : 1;
+    }
+    return strcmp(x, y);
+}
+
+/**
+ * Function: vars_init
+ * -------------------
+ * Fills the table of shell variables with the environment the shell was
+ * started with, all of them exported.  The environment of commands stays the
+ * one the shell got until a variable changes (see var_environ()).
+ *
+ * return: -1 on failure, 0 on success
+ */
+int vars_init(void)
+{
+    for (char **e = environ; *e != NULL; e++)
+    {
+        // The first of two definitions wins, as with getenv()
+        char *eq = strchr(*e, '=');
+        if (eq == NULL || eq == *e || var_lookup(*e, eq - *e) != NULL)
+        {
+            continue;
+        }
+        if (var_set(*e, eq - *e, eq + 1, 1) == -1)
+        {
+            return -1;
+        }
+    }
+    env_version = 0;
+    return 0;
+}
+
+/**
+ * Function: var_find
+ * ------------------
+ * Finds the slot for a variable name in the open-addressing (linear probing)
+ * table of shell variables.
+ *
+ * name: the name, which doesn't have to end at name[len]
+ *
+ * len: the length of the name
+ *
+ * return: the slot holding the variable, or the empty slot where it would be inserted
+ */
+struct var *var_find(const char *name, size_t len)
+{
+    size_t i = hash_bytes(name, len) & (var_slots - 1);
+    while (vars[i].entry != NULL && (vars[i].name_len != len || memcmp(vars[i].entry, name, len) != 0))
+    {
+        i = (i + 1) & (var_slots - 1);
+    }
+    return &vars[i];
+}
+
+/**
+ * Function: var_get
+ * -----------------
+ * Looks up the value of a shell variable, in place of getenv()
+ *
+ * name: the variable's name
+ *
+ * return: its value, or NULL if it isn't set
+ */
+const char *var_get(const char *name)
+{
+    return var_lookup(name, strlen(name));
+}
+
+/**
+ * Function: var_lookup
+ * --------------------
+ * Looks up the value of a shell variable whose name is part of a longer string
+ *
+ * name: the name, which doesn't have to end at name[len]
+ *
+ * len: the length of the name
+ *
+ * return: its value, or NULL if it isn't set
+ */
+const char *var_lookup(const char *name, size_t len)
+{
+    if (var_slots == 0)
+    {
+        return NULL;
+    }
+    struct var *v = var_find(name, len);
+    return v->entry != NULL && v->set ? v->entry + len + 1 : NULL;
+}
+
+/**
+ * Function: var_set
+ * -----------------
+ * Sets and/or exports a shell variable, growing the table when it is 3/4 full.
+ * Changing a variable that is exported means commands need a new
+ * environment, which var_environ() builds the next time one is started.
+ *
+ * name: the name, which doesn't have to end at name[len]
+ *
+ * len: the length of the name
+ *
+ * value: the new value, or NULL to leave the value alone
+ *
+ * export: 1 to export the variable, 0 to leave it exported or not
+ *
+ * return: -1 on failure, 0 on success
+ */
+int var_set(const char *name, size_t len, const char *value, int export)
+{
+    if ((num_vars + 1) * 4 > var_slots * 3)
+    {
+        size_t old_slots = var_slots;
+        struct var *old = vars;
+        size_t new_slots = old_slots == 0 ? VARS_MIN_SLOTS : old_slots * 2;
+        struct var *table = calloc(new_slots, sizeof(struct var));
+        if (table == NULL)
+        {
+            return -1;
+        }
+        vars = table;
+        var_slots = new_slots;
+        for (size_t i = 0; i < old_slots; i++)
+        {
+            if (old[i].entry != NULL)
+            {
+                *var_find(old[i].entry, old[i].name_len) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct var *v = var_find(name, len);
+    if (v->entry == NULL || value != NULL)
+    {
+        // The entry is "name=value", ready for the environment
+        size_t value_len = value == NULL ? 0 : strlen(value);
+        char *entry = malloc(len + value_len + 2);
+        if (entry == NULL)
+        {
+            return -1;
+        }
+        memcpy(entry, name, len);
+        entry[len] = '=';
+        memcpy(entry + len + 1, value == NULL ? "" : value, value_len + 1);
+        if (v->entry == NULL)
+        {
+            v->name_len = len;
+            v->exported = 0;
+            v->set = 0;
+            num_vars++;
+        }
+        free(v->entry);
+        v->entry = entry;
+        v->set |= value != NULL;
+
+        // Commands are looked up in the new PATH, even later on the same line
+        if (len == 4 && memcmp(name, "PATH", 4) == 0)
+        {
+            path_cache_line = 0;
+        }
+    }
+    if (export && !v->exported)
+    {
+        v->exported = 1;
+        env_version += v->set;
+    }
+    else if (v->exported && value != NULL)
+    {
+        env_version++;
+    }
+    return 0;
+}
+
+/**
+ * Function: var_unset
+ * -------------------
+ * Removes a shell variable, moving back the ones after it that probed past
+ * its slot, so lookups still find them without tombstones
+ *
+ * name: the name, which doesn't have to end at name[len]
+ *
+ * len: the length of the name
+ */
+void var_unset(const char *name, size_t len)
+{
+    if (var_slots == 0)
+    {
+        return;
+    }
+    struct var *v = var_find(name, len);
+    if (v->entry == NULL)
+    {
+        return;
+    }
+    if (v->exported && v->set)
+    {
+        env_version++;
+    }
+    free(v->entry);
+    num_vars--;
+    if (len == 4 && memcmp(name, "PATH", 4) == 0)
+    {
+        path_cache_line = 0;
+    }
+
+    size_t mask = var_slots - 1;
+    size_t hole = v - vars;
+    for (size_t i = (hole + 1) & mask; vars[i].entry != NULL; i = (i + 1) & mask)
+    {
+        // An entry can fill the hole unless its home slot is after the hole (cyclically)
+        size_t home = hash_bytes(vars[i].entry, vars[i].name_len) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            vars[hole] = vars[i];
+            hole = i;
+        }
+    }
+    vars[hole].entry = NULL;
+}
+
+/**
+ * Function: var_environ
+ * ---------------------
+ * Gives the environment for the commands the shell starts: the exported
+ * variables that have values.  The array is only built again after an
+ * exported variable changed, so starting a command costs nothing however
+ * big the environment is.
+ *
+ * return: the environment, or NULL if there is no memory for it
+ */
+char **var_environ(void)
+{
+    if (var_env != NULL && var_env_version == env_version)
+    {
+        return var_env;
+    }
+    char **env = realloc(var_env, sizeof(char *) * (num_vars + 1));
+    if (env == NULL)
+    {
+        return NULL;
+    }
+    size_t n = 0;
+    var_env_bytes = 0;
+    for (size_t i = 0; i < var_slots; i++)
+    {
+        if (vars[i].entry != NULL && vars[i].exported && vars[i].set)
+        {
+            env[n++] = vars[i].entry;
+            var_env_bytes += strlen(vars[i].entry) + 1;
+        }
+    }
+    env[n] = NULL;
+    var_env = env;
+    var_env_version = env_version;
+    return env;
+}
+
+/**
+ * Function: var_name_len
+ * ----------------------
+ * Measures the variable name at the start of a string: a letter or "_",
+ * then any letters, digits and "_"s
+ *
+ * s: the string
+ *
+ * return: the length of the name, 0 if s doesn't start with one
+ */
+size_t var_name_len(const char *s)
+{
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_')
+    {
+        return 0;
+    }
+    size_t len = 1;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_')
+    {
+        len++;
+    }
+    return len;
+}
+
+/**
+ * Function: is_assignment
+ * -----------------------
+ * Checks whether a word sets a variable, like "NAME=value"
+ *
+ * word: the word
+ *
+ * return: 1 if it is an assignment, 0 otherwise
+ */
+int is_assignment(const char *word)
+{
+    size_t len = var_name_len(word);
+    return len > 0 && word[len] == '=';
+}
+
+/**
+ * Function: run_export
+ * --------------------
+ * Helper function for the export built-in command.
+ * "export NAME=value" sets a variable and exports it, "export NAME" exports
+ * it with the value it has (or gets later), and "export" lists the exported
+ * variables.  The names are all checked before any of them is exported.
+ *
+ * args: An array of strings containing the input for the command
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_export(char **args, int num_args)
+{
+    if (num_args == 1)
+    {
+        struct var **list = malloc(sizeof(struct var *) * (num_vars + 1));
+        if (list == NULL)
+        {
+            return -1;
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < var_slots; i++)
+        {
+            if (vars[i].entry != NULL && vars[i].exported)
+            {
+                list[n++] = &vars[i];
+            }
+        }
+        qsort(list, n, sizeof(struct var *), compare_vars);
+        for (size_t i = 0; i < n; i++)
+        {
+            int len = list[i]->set ? (int)strlen(list[i]->entry) : (int)list[i]->name_len;
+            printf("export %.*s\n", len, list[i]->entry);
+        }
+        free(list);
+        return 0;
+    }
+
+    for (int i = 1; i < num_args; i++)
+    {
+        size_t len = var_name_len(args[i]);
+        if (len == 0 || (args[i][len] != '\0' && args[i][len] != '='))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    for (int i = 1; i < num_args; i++)
+    {
+        size_t len = var_name_len(args[i]);
+        if (var_set(args[i], len, args[i][len] == '=' ? args[i] + len + 1 : NULL, 1) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: run_unset
+ * -------------------
+ * Helper function for the unset built-in command.
+ * "unset NAME ..." removes the variables, whether they are exported or not.
+ * Names that aren't set are fine; ones that aren't names at all are an error,
+ * and then nothing is removed.
+ *
+ * args: An array of strings containing the input for the command
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_unset(char **args, int num_args)
+{
+    for (int i = 1; i < num_args; i++)
+    {
+        size_t len = var_name_len(args[i]);
+        if (len == 0 || args[i][len] != '\0')
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    for (int i = 1; i < num_args; i++)
+    {
+        var_unset(args[i], strlen(args[i]));
+    }
+    return 0;
+}
+
+/**
+ * Function: run_assign
+ * --------------------
+ * Sets the variables of a command made of assignments ("NAME=value ...",
+ * checked by check_pipeline()), in order.  An exported variable stays exported.
+ *
+ * args: the assignments
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_assign(char **args, int num_args)
+{
+    for (int i = 0; i < num_args; i++)
+    {
+        size_t len = var_name_len(args[i]);
+        if (var_set(args[i], len, args[i] + len + 1, 0) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: compare_vars
+ * ----------------------
+ * Orders variables by name for qsort(), for listing them
+ *
+ * a: a pointer to the first variable
+ *
+ * b: a pointer to the second variable
+ *
+ * return: < 0 if a goes first, > 0 if b does, 0 if they're the same
+ */
+int compare_vars(const void *a, const void *b)
+{
+    const struct var *x = *(struct var *const *)a;
+    const struct var *y = *(struct var *const *)b;
+    size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int cmp = memcmp(x->entry, y->entry, len);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+/**
+ * Function: run_pipesize
+ * ----------------------
+ * Helper function for the pipesize built-in command.
+ * "pipesize n" makes the pipes between the stages of later pipelines n bytes
+ * big (a "k" or "m" suffix multiplies n by 1024 or 1024*1024), capped at
+ * /proc/sys/fs/pipe-max-size.  "pipesize 0" goes back to the kernel's default,
+ * and "pipesize" prints the size in use.
+ *
+ * args: An array of strings containing the input for the command
+ *
+ * num_args: the number of elements in args
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_pipesize(char **args, int num_args)
+{
+    if (num_args == 1)
+    {
+        printf("%d\n", pipe_size);
+        return 0;
+    }
+
+    char *end;
+    long size = strtol(args[1], &end, 10);
+    if (*end == 'k' || *end == 'K')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size *= 1024 * 1024;
+        end++;
+    }
+    if (end == args[1] || *end != '\0' || size < 0)
+    {
+        return -1;
+    }
+    long max = pipe_max_size();
+    if (max <= 0 || max > INT_MAX)
+    {
+        max = INT_MAX;
+    }
+    pipe_size = size > max ? max : size;
+    return 0;
+}
+
+/**
+ * Function: run_pipestat
+ * ----------------------
+ * Helper function for the pipestat built-in command.
+ * Prints the pipe size asked for with pipesize, the kernel's default and
+ * largest size, and the sizes the pipes of the last pipeline really got:
+ * the kernel rounds sizes up to a power-of-two number of pages and turns
+ * them down once a user has too much memory in pipes.
+ *
+ * return: 0 (it can't fail)
+ */
+int run_pipestat(void)
+{
+    // A throwaway pipe shows the kernel's default
+    int fds[2];
+    int def = -1;
+    if (pipe2(fds, O_CLOEXEC) == 0)
+    {
+        def = fcntl(fds[0], F_GETPIPE_SZ);
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    printf("configured\t%d%s\n", pipe_size, pipe_size == 0 ? " (kernel default)" : "");
+    printf("default\t\t%d\n", def);
+    printf("max\t\t%ld\n", pipe_max_size());
+    if (pipe_stats.num_pipes == 0)
+    {
+        printf("last pipeline\tno sized pipes\n");
+    }
+    else if (pipe_stats.min_size == pipe_stats.max_size)
+    {
+        printf("last pipeline\t%d pipes of %d bytes, %d refused\n", pipe_stats.num_pipes, pipe_stats.min_size,
+               pipe_stats.num_refused);
+    }
+    else
+    {
+        printf("last pipeline\t%d pipes of %d to %d bytes, %d refused\n", pipe_stats.num_pipes, pipe_stats.min_size,
+               pipe_stats.max_size, pipe_stats.num_refused);
+    }
+    return 0;
+}
+
+/**
+ * Function: pipe_max_size
+ * -----------------------
+ * Reads the largest pipe size an unprivileged process may ask for
+ *
+ * return: /proc/sys/fs/pipe-max-size, or -1 if it can't be read
+ */
+long pipe_max_size(void)
+{
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+    long max = -1;
+    if (f != NULL)
+    {
+        if (fscanf(f, "%ld", &max) != 1)
+        {
+            max = -1;
+        }
+        fclose(f);
+    }
+    return max;
+}
+
+/**
+ * Function: size_pipe
+ * -------------------
+ * Gives a new pipe between two stages the size set with pipesize, and records
+ * the size it got for pipestat.  It is only called when a size was set.
+ * A refused size isn't an error: the pipe keeps the size it had.
+ *
+ * fd: either end of the pipe
+ */
+void size_pipe(int fd)
+{
+    int size = fcntl(fd, F_SETPIPE_SZ, pipe_size);
+    if (size == -1)
+    {
+        pipe_stats.num_refused++;
+        size = fcntl(fd, F_GETPIPE_SZ);
+    }
+    if (pipe_stats.num_pipes == 0 || size < pipe_stats.min_size)
+    {
+        pipe_stats.min_size = size;
+    }
+    if (pipe_stats.num_pipes == 0 || size > pipe_stats.max_size)
+    {
+        pipe_stats.max_size = size;
+    }
+    pipe_stats.num_pipes++;
+}
+
+/**
+ * Function: builtin_hash
+ * ----------------------
+ * Perfect hash of the names of the built-in commands: each of them lands in a
+ * slot of its own in the builtins table, so a lookup takes one strcmp().
+ * Adding a built-in command means picking new multipliers that keep the
+ * slots distinct (or growing BUILTIN_SLOTS).
+ *
+ * name: the command name
+ *
+ * len: the length of name, at least 1
+ *
+ * return: the slot name would be in
+ */
+size_t builtin_hash(const char *name, size_t len)
+{
+    return (2 * len + 3 * (unsigned char)name[0] + (unsigned char)name[len - 1]) & (BUILTIN_SLOTS - 1);
+}
+
+/**
+ * Function: find_builtin
+ * ----------------------
+ * Finds the built-in command with a given name in the builtins table
+ *
+ * name: the command name (args[0])
+ *
+ * return: its entry in the table, or NULL for an external command
+ */
+const struct builtin *find_builtin(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0)
+    {
+        return NULL;
+    }
+    const struct builtin *b = &builtins[builtin_hash(name, len)];
+    return b->name != NULL && strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+/**
+ * Function: lookup_builtin
+ * ------------------------
+ * Finds the built-in command with a given name
+ *
+ * name: the command name (args[0])
+ *
+ * return: the built-in command, BUILTIN_ASSIGN for an assignment ("NAME=value"),
+ *         or BUILTIN_NONE for an external command
+ */
+enum builtin_id lookup_builtin(const char *name)
+{
+    const struct builtin *b = find_builtin(name);
+    if (b == NULL)
+    {
+        return is_assignment(name) ? BUILTIN_ASSIGN : BUILTIN_NONE;
+    }
+    return b->id;
+}
+
+/**
+ * Function: parse_loop
+ * --------------------
+ * Reads the options and loop variable of a loop command:
+ * "loop [-j n] [-b] count cmd args"
+ *
+ * cmd: the command starting with "loop"
+ *
+ * count: set to the number of iterations
+ *
+ * jobs: set to the number of iterations that may run at once (1 without -j)
+ *
+ * buffered: set to 1 if -b was given, 0 otherwise
+ *
+ * return: the number of words before the command being looped, or -1 on a syntax error
+ */
+int parse_loop(struct command *cmd, int *count, int *jobs, int *buffered)
+{
+    char **args = cmd->argv;
+    int i = 1;
+    *jobs = 1;
+    *buffered = 0;
+    while (i < cmd->argc && args[i][0] == '-')
+    {
+        if (strcmp(args[i], "-j") == 0 && i + 1 < cmd->argc)
+        {
+            if ((*jobs = atoi(args[i + 1])) < 1)
+            {
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(args[i], "-b") == 0)
+        {
+            *buffered = 1;
+            i++;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    // There has to be a command after the loop variable
+    if (i + 1 >= cmd->argc || (*count = atoi(args[i])) < 1)
+    {
+        return -1;
+    }
+    return i + 1;
+}
+
+/**
+ * Function: parse_timeout
+ * -----------------------
+ * Reads the options and duration of a timeout command:
+ * "timeout [-s signal] [-k duration] duration cmd args"
+ *
+ * cmd: the command starting with "timeout"
+ *
+ * secs: set to the duration, in seconds
+ *
+ * sig: set to the signal sent when it runs out (SIGTERM without -s)
+ *
+ * kill_after: set to the seconds after that before SIGKILL is sent (0 without -k, for never)
+ *
+ * return: the number of words before the command being run, or -1 on a syntax error
+ */
+int parse_timeout(struct command *cmd, double *secs, int *sig, double *kill_after)
+{
+    char **args = cmd->argv;
+    int i = 1;
+    *sig = SIGTERM;
+    *kill_after = 0;
+    while (i + 1 < cmd->argc && args[i][0] == '-')
+    {
+        if (strcmp(args[i], "-s") == 0)
+        {
+            if ((*sig = parse_signal(args[i + 1])) == -1)
+            {
+                return -1;
+            }
+        }
+        else if (strcmp(args[i], "-k") != 0 || parse_duration(args[i + 1], kill_after) == -1)
+        {
+            return -1;
+        }
+        i += 2;
+    }
+
+    // There has to be a command after the duration
+    if (i + 1 >= cmd->argc || parse_duration(args[i], secs) == -1)
+    {
+        return -1;
+    }
+    return i + 1;
+}
+
+/**
+ * Function: parse_duration
+ * ------------------------
+ * Reads a duration such as "10", "1.5s", "2m", "1h" or "1d"
+ *
+ * s: the duration
+ *
+ * secs: set to it in seconds
+ *
+ * return: -1 if it isn't a duration, 0 on success
+ */
+int parse_duration(const char *s, double *secs)
+{
+    char *end;
+    *secs = strtod(s, &end);
+    if (end == s || *secs < 0)
+    {
+        return -1;
+    }
+    if (*end == 'm')
+    {
+        *secs *= 60;
+    }
+    else if (*end == 'h')
+    {
+        *secs *= 60 * 60;
+    }
+    else if (*end == 'd')
+    {
+        *secs *= 24 * 60 * 60;
+    }
+    else if (*end != 's' && *end != '\0')
+    {
+        return -1;
+    }
+    return *end == '\0' || end[1] == '\0' ? 0 : -1;
+}
+
+/**
+ * Function: parse_signal
+ * ----------------------
+ * Reads a signal given by number or by name, with or without "SIG" in front
+ *
+ * s: the signal, such as "9", "KILL" or "SIGKILL"
+ *
+ * return: the signal number, or -1 if there is no such signal
+ */
+int parse_signal(const char *s)
+{
+    static const struct
+    {
+        const char *name;
+        int sig;
+    } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+        {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    };
+    char *end;
+    long sig = strtol(s, &end, 10);
+    if (end != s)
+    {
+        return *end == '\0' && sig > 0 && sig < NSIG ? (int)sig : -1;
+    }
+    if (strncmp(s, "SIG", 3) == 0)
+    {
+        s += 3;
+    }
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+    {
+        if (strcmp(s, signals[i].name) == 0)
+        {
+            return signals[i].sig;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Function: is_sched_prefix
+ * -------------------------
+ * Tells the built-in commands that set a stage's scheduling (affinity, nice
+ * and ioprio) apart from the others: they are prefixes taken off the stage by
+ * compile_plan() rather than commands run on their own
+ *
+ * id: the built-in command
+ *
+ * return: 1 for affinity, nice and ioprio, 0 otherwise
+ */
+int is_sched_prefix(enum builtin_id id)
+{
+    return id == BUILTIN_AFFINITY || id == BUILTIN_NICE || id == BUILTIN_IOPRIO;
+}
+
+/**
+ * Function: parse_nice
+ * --------------------
+ * Reads a nice increment: a whole number the kernel can clamp to the range of
+ * niceness
+ *
+ * s: the word after nice
+ *
+ * inc: set to the increment
+ *
+ * return: 0 on success, or -1 with errno set to EINVAL if the word is not a
+ *         number or ERANGE if it is too far out of range
+ */
+int parse_nice(const char *s, int *inc)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end != '\0')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (n < -40 || n > 40)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    *inc = n;
+    return 0;
+}
+
+/**
+ * Function: parse_sched
+ * ---------------------
+ * Reads the affinity, nice and ioprio prefixes at the front of a pipeline
+ * stage, such as "affinity 0-3 nice 10 cmd".  They can come in any order and
+ * each one is followed by its setting; nice increments add up, and for the
+ * others the last one wins.  There has to be a command after them.
+ * nice also takes the forms of nice(1): "nice -n 5 cmd", "nice -5 cmd" and
+ * "nice cmd", which is an increment of 10.
+ *
+ * a: the arena the CPU mask is allocated from, or NULL to only check the syntax
+ *
+ * cmd: the stage
+ *
+ * sched: filled in with the settings (nothing to change if there are no prefixes)
+ *
+ * return: the number of words taken up by the prefixes (0 if there are none),
+ *         or -1 (with errno set) if they are malformed or there is no room for the mask
+ */
+int parse_sched(struct arena *a, struct command *cmd, struct stage_sched *sched)
+{
+    char **args = cmd->argv;
+    sched->cpus = NULL;
+    sched->cpus_size = 0;
+    sched->nice = 0;
+    sched->ioprio = -1;
+    int i = 0;
+    int words;
+    int inc;
+    for (; i < cmd->argc; i += words)
+    {
+        enum builtin_id id = lookup_builtin(args[i]);
+        if (!is_sched_prefix(id))
+        {
+            break;
+        }
+
+        // Each prefix is followed by its setting, except that nice's can be
+        // spelt "-n 5" or left out for an increment of 10, as with nice(1)
+        const char *setting = i + 1 < cmd->argc ? args[i + 1] : "";
+        words = 2;
+        if (id == BUILTIN_NICE && strcmp(setting, "-n") == 0)
+        {
+            setting = i + 2 < cmd->argc ? args[i + 2] : "";
+            words = 3;
+        }
+        else if (id == BUILTIN_NICE && parse_nice(setting, &inc) == -1 && errno == EINVAL)
+        {
+            setting = "10";
+            words = 1;
+        }
+        errno = EINVAL;
+        if (i + words >= cmd->argc)
+        {
+            return -1;
+        }
+
+        // affinity: a list of CPUs, like "0-3,8"
+        if (id == BUILTIN_AFFINITY)
+        {
+            int num_cpus = parse_cpus(setting, NULL, 0);
+            if (num_cpus == -1)
+            {
+                return -1;
+            }
+            if (a != NULL)
+            {
+                sched->cpus_size = CPU_ALLOC_SIZE(num_cpus);
+                if ((sched->cpus = arena_alloc(a, sched->cpus_size)) == NULL)
+                {
+                    return -1;
+                }
+                parse_cpus(setting, sched->cpus, sched->cpus_size);
+            }
+        }
+
+        // nice: an increment, which the kernel clamps to the range of niceness
+        else if (id == BUILTIN_NICE)
+        {
+            if (parse_nice(setting, &inc) == -1)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            sched->nice += inc;
+        }
+
+        // ioprio: a class and level, like "idle" or "be:7"
+        else if ((sched->ioprio = parse_ioprio(setting)) == -1)
+        {
+            return -1;
+        }
+    }
+    return i;
+}
 
-            // Split command into tokens containing commands & arguments for each pipe
-            if (lexer(line, &pipe_cmds, &num_pipe_cmds, "|") == -1)
+/**
+ * Function: parse_cpus
+ * --------------------
+ * Reads a list of CPUs such as "3", "0-3" or "0,2,4-7" into a CPU mask
+ *
+ * s: the list
+ *
+ * cpus: the mask to fill in, or NULL to only find out how big it has to be
+ *
+ * size: the size of cpus in bytes
+ *
+ * return: the number of CPUs the mask must have room for (the highest one listed, plus one),
+ *         or -1 if s isn't a list of CPUs
+ */
+int parse_cpus(const char *s, cpu_set_t *cpus, size_t size)
+{
+    if (cpus != NULL)
+    {
+        CPU_ZERO_S(size, cpus);
+    }
+    long highest = -1;
+    while (1)
+    {
+        if (!isdigit((unsigned char)*s))
+        {
+            return -1;
+        }
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (*end == '-')
+        {
+            s = end + 1;
+            if (!isdigit((unsigned char)*s))
             {
-                print_error();
-                exit(1);
+                return -1;
             }
+            last = strtol(s, &end, 10);
+        }
+        if (last < first || last >= MAX_CPUS)
+        {
+            return -1;
+        }
+        for (long cpu = first; cpus != NULL && cpu <= last; cpu++)
+        {
+            CPU_SET_S(cpu, size, cpus);
+        }
+        if (last > highest)
+        {
+            highest = last;
+        }
+        if (*end == '\0')
+        {
+            return highest + 1;
+        }
+        if (*end != ',')
+        {
+            return -1;
+        }
+        s = end + 1;
+    }
+}
+
+/**
+ * Function: parse_ioprio
+ * ----------------------
+ * Reads an I/O scheduling class, with a level for the classes that have one:
+ * "idle", "be" (or "best-effort") and "rt" (or "realtime") with an optional
+ * ":0" (highest) to ":7" (lowest), 4 if it is left out, or "none" to go back
+ * to the priority the kernel derives from the niceness
+ *
+ * s: the class and level
+ *
+ * return: the value for ioprio_set(), or -1 if s isn't a class and level
+ */
+int parse_ioprio(const char *s)
+{
+    static const struct
+    {
+        const char *name;
+        int class;
+    } classes[] = {
+        {"none", IOPRIO_CLASS_NONE}, {"rt", IOPRIO_CLASS_RT}, {"realtime", IOPRIO_CLASS_RT},
+        {"be", IOPRIO_CLASS_BE}, {"best-effort", IOPRIO_CLASS_BE}, {"idle", IOPRIO_CLASS_IDLE},
+    };
+    const char *colon = strchr(s, ':');
+    size_t len = colon != NULL ? (size_t)(colon - s) : strlen(s);
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    {
+        if (strlen(classes[i].name) != len || strncmp(s, classes[i].name, len) != 0)
+        {
+            continue;
+        }
+        int class = classes[i].class;
+        if (class == IOPRIO_CLASS_NONE || class == IOPRIO_CLASS_IDLE)
+        {
+            return colon == NULL ? (int)IOPRIO_PRIO_VALUE(class, 0) : -1;
+        }
+        if (colon == NULL)
+        {
+            return IOPRIO_PRIO_VALUE(class, IOPRIO_NORM);
+        }
+        if (colon[1] < '0' || colon[1] >= '0' + IOPRIO_NR_LEVELS || colon[2] != '\0')
+        {
+            return -1;
+        }
+        return IOPRIO_PRIO_VALUE(class, colon[1] - '0');
+    }
+    return -1;
+}
+
+/**
+ * Function: loop_body
+ * -------------------
+ * Builds the pipeline a loop command repeats: the same pipeline with "loop",
+ * its options and its loop variable taken off the front of the first stage.
+ * Nothing but the first stage's node is copied, into the storage given by the caller.
+ *
+ * pl: the pipeline starting with "loop"
+ *
+ * skip: the number of words in front of the body, from parse_loop()
+ *
+ * body: filled in with the pipeline to repeat
+ *
+ * body_cmd: filled in with the first stage of body
+ */
+void loop_body(struct pipeline *pl, int skip, struct pipeline *body, struct command *body_cmd)
+{
+    *body_cmd = *pl->cmds;
+    body_cmd->argv += skip;
+    body_cmd->argc -= skip;
+    *body = *pl;
+    body->cmds = body_cmd;
+}
 
-            // Loop through until pipe commands are all handled
-            for (int i = 0; i < num_pipe_cmds - 2; i++)
+/**
+ * Function: run_loop
+ * ------------------
+ * Helper function that runs the loop command.
+ * The body was compiled once by compile_plan(), so each iteration only
+ * spawns and waits for its children (or runs its built-in command).
+ * The body's output redirection is opened once and held for the whole loop:
+ * with ">>" every iteration appends to it, and with ">" it is truncated
+ * between iterations, so the last one wins without reopening the file.
+ * Iterations of "loop -j" running side by side can't share a ">" target, so
+ * they still open it themselves.
+ *
+ * plan: the compiled loop, holding the loop variable and the body's plan
+ *
+ * samples: for the time built-in, where the wall-clock time of each iteration
+ *          is added; NULL otherwise
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_loop(struct plan *plan, struct loop_samples *samples)
+{
+    struct redir *out = output_redir(plan->body);
+    int held = -1;
+    int truncate = 0;
+    if (out != NULL && (plan->jobs == 1 || out->type == REDIR_APPEND))
+    {
+        struct stat st;
+        if ((held = open(out->target, redir_flags(out->type) | O_CLOEXEC, 0644)) == -1 || fstat(held, &st) == -1)
+        {
+            if (held != -1)
             {
-                // Tokenize each end of the pipe
-                char **pipe_args1;
-                int num_pipe_args1;
-                char **pipe_args2;
-                int num_pipe_args2;
-                if (lexer(pipe_cmds[i], &pipe_args1, &num_pipe_args1, " \t\n") == -1)
-                {
-                    print_error();
-                    exit(1);
-                }
-                if (lexer(pipe_cmds[i + 1], &pipe_args2, &num_pipe_args2, " \t\n") == -1)
-                {
-                    print_error();
-                    exit(1);
-                }
+                close(held);
+            }
+            return -1;
+        }
 
-                // Create each command array for each end of the pipe
-                char **pipe_args1_tmp = malloc(sizeof(char **) * (num_pipe_args1 + 1));
-                if (pipe_args1_tmp == NULL)
-                {
-                    return -1;
-                }
-                for (int i = 0; i < num_pipe_args1; i++)
-                {
-                    pipe_args1_tmp[i] = malloc(sizeof(char) * strlen(pipe_args1[i]) + sizeof(NULL));
-                    strcpy(pipe_args1_tmp[i], pipe_args1[i]);
-                }
-                pipe_args1_tmp[num_pipe_args1] = NULL;
+        // Devices and FIFOs have nothing to truncate
+        truncate = out->type == REDIR_OUT && S_ISREG(st.st_mode);
+        hold_output(plan->body, held);
+    }
 
-                char **pipe_args2_tmp = malloc(sizeof(char **) * (num_pipe_args2 + 1));
-                if (pipe_args2_tmp == NULL)
-                {
-                    return -1;
-                }
-                for (int i = 0; i < num_pipe_args2; i++)
-                {
-                    pipe_args2_tmp[i] = malloc(sizeof(char) * strlen(pipe_args2[i]) + sizeof(NULL));
-                    strcpy(pipe_args2_tmp[i], pipe_args2[i]);
-                }
-                pipe_args2_tmp[num_pipe_args2] = NULL;
+    int ret = 0;
+    if (plan->jobs > 1)
+    {
+        ret = run_loop_parallel(plan, samples);
+    }
+    for (int i = 0; plan->jobs == 1 && i < plan->count && ret == 0; i++)
+    {
+        struct timespec start, end;
+        if (samples != NULL)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        if (truncate && i > 0 && (ftruncate(held, 0) == -1 || lseek(held, 0, SEEK_SET) == -1))
+        {
+            ret = -1;
+            break;
+        }
+        if (run_plan(plan->body) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        if (samples != NULL)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            samples->secs[samples->num++] = elapsed(&start, &end);
+        }
+    }
 
-                if (pipe(pipefd) == -1)
-                {
-                    return -1;
-                }
+    if (held != -1)
+    {
+        hold_output(plan->body, -1);
+        close(held);
+    }
+    return ret;
+}
 
-                int pid = fork();
+/**
+ * Function: output_redir
+ * ----------------------
+ * Finds the output redirection of a compiled command or pipeline
+ *
+ * plan: the plan
+ *
+ * return: the ">" or ">>" redirection of its last stage, or NULL if it has none
+ *         (or isn't a plain command or pipeline)
+ */
+struct redir *output_redir(struct plan *plan)
+{
+    struct redir *r = NULL;
+    if (plan->type == PLAN_BUILTIN)
+    {
+        r = plan->cmd->redirs;
+    }
+    else if (plan->type == PLAN_EXEC)
+    {
+        r = plan->stages[plan->num_stages - 1].redirs;
+    }
+    for (; r != NULL; r = r->next)
+    {
+        if (r->type != REDIR_IN)
+        {
+            return r;
+        }
+    }
+    return NULL;
+}
 
-                // Fork on pipe
-                if (pid < 0)
-                {
-                    return -1;
-                }
-                else if (pid == 0)
-                {
-                    dup2(pipefd[1], 1);
-                    close(pipefd[0]);
-                    execv(pipe_args1_tmp[0], pipe_args1_tmp);
-                    print_error();
-                    exit(1);
-                }
-                else
-                {
-                    dup2(pipefd[0], 0);
-                    close(pipefd[1]);
-                    if (waitpid(pid, NULL, 0) == -1)
-                    {
-                        return -1;
-                    }
-                    sleep(5); // REMOVE ME
-                    execv(pipe_args2_tmp[0], pipe_args2_tmp);
-                    print_error();
-                    return -1;
-                }
-            }
+/**
+ * Function: hold_output
+ * ---------------------
+ * Makes a compiled command or pipeline write to a descriptor held open by a
+ * loop instead of opening its output redirection target every time it runs
+ *
+ * plan: the plan, which has an output redirection (see output_redir())
+ *
+ * fd: the descriptor, or -1 to go back to opening the target
+ */
+void hold_output(struct plan *plan, int fd)
+{
+    plan->held_out = fd;
 
-            // Tokenize the last ends of the pipe for redirection
-            char **last_pipe1_args;
-            int num_last1_args;
-            if (lexer(pipe_cmds[num_pipe_cmds - 2], &last_pipe1_args, &num_last1_args, " \t\n") == -1)
+    // A built-in last stage runs from a plan of its own
+    if (plan->type == PLAN_EXEC && plan->stages[plan->num_stages - 1].builtin != BUILTIN_NONE)
+    {
+        plan->stages[plan->num_stages - 1].plan->held_out = fd;
+    }
+}
+
+/**
+ * Function: run_loop_parallel
+ * ---------------------------
+ * Runs the iterations of "loop -j n" with up to n of them in flight at a time.
+ * Whenever wait_children() reaps an iteration's last process, the next
+ * iteration starts in its slot.
+ * With -b, each iteration's output goes to its own memory file and is written
+ * out in one piece when the iteration finishes, so output from concurrent
+ * iterations never interleaves.
+ * The loop's status is the highest exit status of any iteration, so it is 0 only
+ * if every iteration succeeded.  If an iteration fails to start, no more are
+ * started, but the ones already running are still waited for.
+ *
+ * plan: the compiled loop, whose body runs external commands
+ *
+ * samples: for the time built-in, where the wall-clock time of each iteration
+ *          is added; NULL otherwise
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_loop_parallel(struct plan *plan, struct loop_samples *samples)
+{
+    struct plan *body = plan->body;
+    int num_slots = plan->jobs < plan->count ? plan->jobs : plan->count;
+    struct job *slots = malloc(sizeof(struct job) * num_slots);
+    pid_t *pids = malloc(sizeof(pid_t) * num_slots * body->num_stages);
+    char *busy = calloc(num_slots, 1);
+    struct timespec *started = malloc(sizeof(struct timespec) * num_slots);
+    struct stage_usage *usage = NULL;
+    if (trace_file != NULL)
+    {
+        usage = malloc(sizeof(struct stage_usage) * num_slots * body->num_stages);
+    }
+    if (slots == NULL || pids == NULL || busy == NULL || started == NULL || (trace_file != NULL && usage == NULL))
+    {
+        free(slots);
+        free(pids);
+        free(busy);
+        free(started);
+        free(usage);
+        return -1;
+    }
+    for (int i = 0; i < num_slots; i++)
+    {
+        slots[i].pids = pids + i * body->num_stages;
+        slots[i].num_live = 0;
+        slots[i].id = 0;
+        slots[i].fork_builtins = 1;
+        slots[i].pgid = -1;
+        slots[i].limits = NULL;
+        slots[i].usage = usage == NULL ? NULL : usage + i * body->num_stages;
+    }
+
+    // Check on the iterations each time wait_children() reaps something
+    int ret = 0;
+    int num_started = 0;
+    int running = 0;
+    int status = 0;
+    while (1)
+    {
+        // Start iterations in the free slots
+        for (int i = 0; i < num_slots && num_started < plan->count && ret == 0; i++)
+        {
+            if (busy[i])
             {
-                print_error();
-                exit(1);
+                continue;
             }
-            char **last_pipe1_args_tmp = malloc(sizeof(char **) * (num_last1_args + 1));
-            if (last_pipe1_args_tmp == NULL)
+            int out_fd = -1;
+            if (plan->buffered && (out_fd = memfd_create("smash-loop", MFD_CLOEXEC)) == -1)
             {
-                return -1;
+                ret = -1;
+                break;
             }
-            for (int i = 0; i < num_last1_args; i++)
+            clock_gettime(CLOCK_MONOTONIC, &started[i]);
+            if (start_pipeline(body, &slots[i], out_fd) == -1)
             {
-                last_pipe1_args_tmp[i] = malloc(sizeof(char) * strlen(last_pipe1_args[i]) + sizeof(NULL));
-                strcpy(last_pipe1_args_tmp[i], last_pipe1_args[i]);
+                ret = -1;
             }
-            last_pipe1_args_tmp[num_last1_args] = NULL;
-
-            char **last_pipe2_args;
-            int num_last2_args;
-            if (lexer(pipe_cmds[num_pipe_cmds - 1], &last_pipe2_args, &num_last2_args, " \t\n") == -1)
+            num_started++;
+            if (slots[i].num_pids > 0)
             {
-                print_error();
-                exit(1);
+                busy[i] = 1;
+                running++;
             }
-            char **last_pipe2_args_tmp = malloc(sizeof(char **) * (num_last2_args + 1));
-            if (last_pipe2_args_tmp == NULL)
+            else if (out_fd != -1)
             {
-                return -1;
+                close(out_fd);
             }
-            for (int i = 0; i < num_last2_args; i++)
+        }
+        if (running == 0)
+        {
+            break;
+        }
+        double wait_start = trace_file != NULL ? trace_now() : 0;
+        wait_children(-1);
+        if (trace_file != NULL)
+        {
+            trace_event("wait", wait_start, trace_now(), 0, NULL, NULL);
+        }
+
+        for (int i = 0; i < num_slots; i++)
+        {
+            if (!busy[i] || slots[i].num_live > 0)
             {
-                last_pipe2_args_tmp[i] = malloc(sizeof(char) * strlen(last_pipe2_args[i]) + sizeof(NULL));
-                strcpy(last_pipe2_args_tmp[i], last_pipe2_args[i]);
+                continue;
             }
-            last_pipe2_args_tmp[num_last2_args] = NULL;
 
-            // Handle redirection
-            if (rd)
+            // The iteration is done
+            busy[i] = 0;
+            running--;
+            if (trace_file != NULL)
+            {
+                trace_job(&slots[i], body);
+            }
+            if (samples != NULL)
+            {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                samples->secs[samples->num++] = elapsed(&started[i], &now);
+            }
+            if (slots[i].status > status)
+            {
+                status = slots[i].status;
+            }
+            if (slots[i].out_fd != -1)
             {
-                // Check for empty command
-                if (strcmp(last_pipe2_args[0], ">") == 0)
+                if (lseek(slots[i].out_fd, 0, SEEK_SET) == -1 || copy_fd(slots[i].out_fd, STDOUT_FILENO) == -1)
                 {
-                    print_error();
-                    exit(1);
+                    ret = -1;
                 }
+                close(slots[i].out_fd);
+            }
+        }
+    }
 
-                int newfd; // New file descriptor
+    last_status = status;
+    free(slots);
+    free(pids);
+    free(busy);
+    free(started);
+    free(usage);
+    return ret;
+}
 
-                // Check for more than one ">"
-                int n = 0;
-                for (int i = 0; i < num_last2_args; i++)
-                {
-                    if (strcmp(last_pipe2_args[i], ">") == 0)
-                    {
-                        n++;
-                    }
-                }
-                if (n > 1)
-                {
-                    print_error();
-                    exit(1);
-                }
+/**
+ * Function: run_time
+ * ------------------
+ * Helper function for the time built-in command.
+ * Runs the timed command and then reports, on standard error, its wall-clock
+ * time and the user time, system time, largest resident set size and
+ * voluntary+involuntary context switches of the children it started.
+ * The children's figures come from wait4() as wait_children() reaps them,
+ * and a built-in command run in the shell adds what the shell used meanwhile.
+ * A pipeline gets a line per stage before the total (its built-in commands
+ * run as children, so they have figures of their own), and a loop gets the
+ * mean and percentiles of the wall-clock time of its iterations after the total.
+ *
+ * plan: the compiled time command, whose body is the command being timed
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_time(struct plan *plan)
+{
+    struct plan *body = plan->body;
+    struct stage_usage *usage = NULL;
+    struct loop_samples samples = {NULL, 0};
+    if (body->type == PLAN_EXEC)
+    {
+        if ((usage = malloc(sizeof(struct stage_usage) * body->num_stages)) == NULL)
+        {
+            return -1;
+        }
+        for (int i = 0; i < body->num_stages; i++)
+        {
+            usage[i].stage = -1;
+        }
+    }
+    else if (body->type == PLAN_LOOP)
+    {
+        if ((samples.secs = malloc(sizeof(double) * body->count)) == NULL)
+        {
+            return -1;
+        }
+    }
 
-                // Check for ">" being second-to-last argument
-                if (strcmp(last_pipe2_args[num_last2_args - 2], ">") != 0)
-                {
-                    print_error();
-                    exit(1);
-                }
+    // Children reaped from here on are added to total, see reap_child()
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    struct rusage *outer = timing;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    timing = &total;
 
-                // Redirect output to given file
-                if ((newfd = open(last_pipe2_args[num_last2_args - 1], O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
-                {
-                    print_error();
-                    exit(1);
-                }
-                dup2(newfd, 1);
-                close(newfd);
+    int ret;
+    if (body->type == PLAN_EXEC)
+    {
+        ret = run_pipeline(body, usage);
+    }
+    else if (body->type == PLAN_LOOP)
+    {
+        ret = run_loop(body, &samples);
+    }
+    else
+    {
+        // A built-in command may run in the shell itself, which is then part of what it used
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        ret = run_plan(body);
+        getrusage(RUSAGE_SELF, &after);
+        timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+        after.ru_maxrss = 0;
+        after.ru_nvcsw -= before.ru_nvcsw;
+        after.ru_nivcsw -= before.ru_nivcsw;
+        rusage_add(&total, &after);
+    }
 
-                // Change command array to eliminate redirection operator & file
-                last_pipe2_args_tmp[num_last2_args - 2] = NULL;
+    timing = outer;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (outer != NULL)
+    {
+        rusage_add(outer, &total);
+    }
 
-                // Fork here ???
-                if (pipe(pipefd) == -1)
-                {
-                    return -1;
-                }
+    // Output of the command must come out before the report
+    fflush(stdout);
+    for (int i = 0; usage != NULL && i < body->num_stages && usage[i].stage != -1; i++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "stage %d", usage[i].stage + 1);
+        print_usage(label, elapsed(&usage[i].start, &usage[i].end), &usage[i].ru,
+                    body->stages[usage[i].stage].argv[0]);
+    }
+    print_usage("total", elapsed(&start, &end), &total, NULL);
+
+    if (samples.num > 0)
+    {
+        qsort(samples.secs, samples.num, sizeof(double), compare_doubles);
+        double sum = 0;
+        for (int i = 0; i < samples.num; i++)
+        {
+            sum += samples.secs[i];
+        }
+        fprintf(stderr, "iterations: %d  mean %.6fs  min %.6fs  p50 %.6fs  p90 %.6fs  p99 %.6fs  max %.6fs\n",
+                samples.num, sum / samples.num, samples.secs[0], percentile(&samples, 50),
+                percentile(&samples, 90), percentile(&samples, 99), samples.secs[samples.num - 1]);
+    }
+    free(usage);
+    free(samples.secs);
+    return ret;
+}
+
+/**
+ * Function: run_timeout
+ * ---------------------
+ * Helper function for the timeout built-in command.
+ * Runs the command in a process group of its own: every stage of a pipeline,
+ * or the subshell running a built-in command or loop (with everything it
+ * starts).  When the duration runs out, the signal goes to the whole group;
+ * with -k, SIGKILL follows if the group is still there that much later.
+ * The deadline is a timerfd watched by wait_children() alongside the children,
+ * so nothing has to poll and no watchdog process is needed.
+ * The status is the command's, or 124 if it timed out (137 if it was killed with SIGKILL).
+ * Like other shells' timeout, a command in its own process group can't read
+ * from the terminal.
+ *
+ * plan: the compiled timeout command, whose body is the command being run
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_timeout(struct plan *plan)
+{
+    struct plan *body = plan->body;
+    struct job job;
+    job.id = 0;
+    job.fork_builtins = 1;
+    job.usage = NULL;
+    job.pgid = 0;
+    job.limits = NULL;
+    job.pids = malloc(sizeof(pid_t) * (body->type == PLAN_EXEC ? body->num_stages : 1));
+    if (job.pids == NULL)
+    {
+        return -1;
+    }
+    struct deadline deadline;
+    deadline.fired = 0;
+    if (plan->timeout > 0 && deadline_start(&deadline, plan->timeout) == -1)
+    {
+        free(job.pids);
+        return -1;
+    }
+
+    int ret = body->type == PLAN_EXEC ? start_pipeline(body, &job, -1) : start_subshell(body, &job, STDIN_FILENO);
+    double start = trace_file != NULL ? trace_now() : 0;
+    int handled = 0; // Expirations of the deadline acted on so far
+    int killed = 0;
+    while (job.num_live > 0)
+    {
+        wait_children(-1);
+        if (plan->timeout == 0 || deadline.fired == handled)
+        {
+            continue;
+        }
+
+        // First the signal, then (with -k) SIGKILL
+        int sig = handled == 0 ? plan->signal : SIGKILL;
+        handled = deadline.fired;
+        if (job.pgid > 0)
+        {
+            kill(-job.pgid, sig);
+            if (sig == SIGSTOP || sig == SIGTSTP)
+            {
+                kill(-job.pgid, SIGCONT);
+            }
+        }
+        killed = sig == SIGKILL;
+        if (handled == 1 && plan->kill_after > 0)
+        {
+            deadline_set(&deadline, plan->kill_after);
+        }
+    }
+    if (trace_file != NULL)
+    {
+        trace_event("wait", start, trace_now(), 0, NULL, NULL);
+    }
+    if (plan->timeout > 0)
+    {
+        deadline_stop(&deadline);
+    }
 
-                int pid = fork();
+    last_status = handled == 0 ? job.status : killed ? 128 + SIGKILL : 124;
+    free(job.pids);
+    return ret;
+}
 
-                // Fork on pipe
-                if (pid < 0)
-                {
-                    return -1;
-                }
-                else if (pid == 0)
-                {
-                    dup2(pipefd[1], 1);
-                    close(pipefd[0]);
-                    execv(last_pipe1_args_tmp[0], last_pipe1_args_tmp); // args 1
-                    print_error();
-                    exit(1);
-                }
-                else
-                {
-                    dup2(pipefd[0], 0);
-                    close(pipefd[1]);
-                    if (waitpid(pid, NULL, 0) == -1)
-                    {
-                        return -1;
-                    }
-                    execv(last_pipe2_args_tmp[0], last_pipe2_args_tmp); // args 2
-                    print_error();
-                    return -1;
-                }
+/**
+ * Function: deadline_start
+ * ------------------------
+ * Starts a timer that wait_children() watches, and makes it the innermost deadline
+ *
+ * d: the deadline, which stays in use until deadline_stop()
+ *
+ * secs: when it runs out, in seconds from now
+ *
+ * return: -1 on failure, 0 on success
+ */
+int deadline_start(struct deadline *d, double secs)
+{
+    d->fired = 0;
+    if ((d->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)d->fd;
+    if (deadline_set(d, secs) == -1 || epoll_ctl(events_fd, EPOLL_CTL_ADD, d->fd, &ev) == -1)
+    {
+        close(d->fd);
+        return -1;
+    }
+    d->next = deadlines;
+    deadlines = d;
+    return 0;
+}
 
+/**
+ * Function: deadline_set
+ * ----------------------
+ * (Re)arms a deadline
+ *
+ * d: the deadline
+ *
+ * secs: when it runs out, in seconds from now
+ *
+ * return: -1 on failure, 0 on success
+ */
+int deadline_set(struct deadline *d, double secs)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)secs;
+    its.it_value.tv_nsec = (long)((secs - (double)its.it_value.tv_sec) * 1e9);
 
-                // execv(last_pipe2_args[0], last_pipe2_args);
-                // print_error();
-                // exit(1);
-            }
-            else
-            {
-                if (pipe(pipefd) == -1)
-                {
-                    return -1;
-                }
+    // An all-zero time would disarm the timer
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+    return timerfd_settime(d->fd, 0, &its, NULL);
+}
 
-                int pid = fork();
+/**
+ * Function: deadline_stop
+ * -----------------------
+ * Stops the innermost deadline and closes its timer
+ *
+ * d: the deadline, which must be the innermost one
+ */
+void deadline_stop(struct deadline *d)
+{
+    deadlines = d->next;
+    close(d->fd);
+}
 
-                // Fork on pipe
-                if (pid < 0)
-                {
-                    return -1;
-                }
-                else if (pid == 0)
-                {
-                    dup2(pipefd[1], 1);
-                    close(pipefd[0]);
-                    execv(last_pipe1_args_tmp[0], last_pipe1_args_tmp); // args 1
-                    print_error();
-                    exit(1);
-                }
-                else
-                {
-                    dup2(pipefd[0], 0);
-                    close(pipefd[1]);
-                    if (waitpid(pid, NULL, 0) == -1)
-                    {
-                        return -1;
-                    }
-                    execv(last_pipe2_args_tmp[0], last_pipe2_args_tmp); // args 2
-                    print_error();
-                    return -1;
-                }
+/**
+ * Function: parse_limit
+ * ---------------------
+ * Reads the options of a limit command:
+ * "limit [-v size] [-t secs] [-n files] [-u procs] [-m size] [-c cpus] cmd args"
+ *
+ * cmd: the command starting with "limit"
+ *
+ * limits: filled in with the caps (the cgroup is left for run_limit() to create)
+ *
+ * return: the number of words before the command being run, or -1 on a syntax error
+ */
+int parse_limit(struct command *cmd, struct job_limits *limits)
+{
+    char **args = cmd->argv;
+    int i = 1;
+    for (int j = 0; j < NUM_RLIMITS; j++)
+    {
+        limits->rlimits[j] = RLIM_INFINITY;
+    }
+    limits->memory_max = 0;
+    limits->cpus = 0;
+    limits->cgroup_fd = -1;
+    while (i + 1 < cmd->argc && args[i][0] == '-')
+    {
+        const char *value = args[i + 1];
+        char *end;
+
+        // The cgroup's caps
+        if (strcmp(args[i], "-m") == 0)
+        {
+            if (parse_size(value, &limits->memory_max) == -1 || limits->memory_max == 0)
+            {
+                return -1;
             }
+            i += 2;
+            continue;
         }
-        else
+        if (strcmp(args[i], "-c") == 0)
         {
-            if (lexer(line, &args, &num_args, " \t\n") == -1)
+            limits->cpus = strtod(value, &end);
+            if (end == value || *end != '\0' || !(limits->cpus > 0))
             {
                 return -1;
             }
-            char **cmd_args = malloc(sizeof(char **) * (num_args + 1));
-            if (cmd_args == NULL)
+            i += 2;
+            continue;
+        }
+
+        // The setrlimit() caps, all counts but the address space
+        int j = 0;
+        while (j < NUM_RLIMITS && strcmp(args[i], limit_resources[j].option) != 0)
+        {
+            j++;
+        }
+        if (j == NUM_RLIMITS)
+        {
+            return -1;
+        }
+        long long n;
+        if (limit_resources[j].resource == RLIMIT_AS)
+        {
+            if (parse_size(value, &n) == -1)
             {
                 return -1;
             }
-            for (int i = 0; i < num_args; i++)
+        }
+        else
+        {
+            n = strtoll(value, &end, 10);
+            if (end == value || *end != '\0' || n < 0)
             {
-                cmd_args[i] = malloc(sizeof(char) * strlen(args[i]) + sizeof(NULL));
-                strcpy(cmd_args[i], args[i]);
+                return -1;
             }
-            cmd_args[num_args] = NULL;
+        }
+        limits->rlimits[j] = n;
+        i += 2;
+    }
 
-            // Handle redirection
-            if (rd)
-            {
-                // Check for empty command
-                if (strcmp(cmd_args[0], ">") == 0)
-                {
-                    print_error();
-                    exit(1);
-                }
+    // There has to be a command after the options
+    return i < cmd->argc ? i : -1;
+}
 
-                int newfd; // New file descriptor
+/**
+ * Function: parse_size
+ * --------------------
+ * Reads a size in bytes, or with a "k", "m" or "g" suffix (powers of 1024)
+ *
+ * s: the size, such as "4096", "512m" or "2g"
+ *
+ * bytes: set to it in bytes
+ *
+ * return: -1 if it isn't a size, 0 on success
+ */
+int parse_size(const char *s, long long *bytes)
+{
+    char *end;
+    *bytes = strtoll(s, &end, 10);
+    if (end == s || *bytes < 0)
+    {
+        return -1;
+    }
+    int shift = 0;
+    if (*end == 'k' || *end == 'K')
+    {
+        shift = 10;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        shift = 20;
+    }
+    else if (*end == 'g' || *end == 'G')
+    {
+        shift = 30;
+    }
+    if (shift > 0)
+    {
+        if (*bytes > LLONG_MAX >> shift)
+        {
+            return -1;
+        }
+        *bytes <<= shift;
+        end++;
+    }
+    return *end == '\0' ? 0 : -1;
+}
 
-                // Check for more than one ">"
-                int n = 0;
-                for (int i = 0; i < num_args; i++)
-                {
-                    if (strcmp(cmd_args[i], ">") == 0)
-                    {
-                        n++;
-                    }
-                }
-                if (n > 1)
-                {
-                    print_error();
-                    exit(1);
-                }
+/**
+ * Function: run_limit
+ * -------------------
+ * Helper function for the limit built-in command.
+ * The setrlimit() caps are set in each child before it execs (see apply_limits()),
+ * or in the subshell running a built-in command or loop, so they hold for
+ * every process the command starts, each on its own.
+ * When SMASH_CGROUP_ROOT names a writable directory of a cgroup v2 hierarchy,
+ * the job also gets a cgroup of its own under it, with the -m and -c caps
+ * (memory.max and cpu.max) covering all of its processes together; once they
+ * have all exited, the CPU time, peak memory and OOM kills of the cgroup are
+ * printed on standard error and the cgroup is removed.  -m and -c need such a
+ * cgroup, so they fail in a limit command nested in another one that has a cgroup.
+ *
+ * plan: the compiled limit command, whose body is the command being run
+ *
+ * return: -1 on failure, 0 on success
+ */
+int run_limit(struct plan *plan)
+{
+    struct plan *body = plan->body;
+    struct job_limits limits = *plan->limits;
 
-                // Check for ">" being second-to-last argument
-                if (strcmp(cmd_args[num_args - 2], ">") != 0)
-                {
-                    print_error();
-                    exit(1);
-                }
+    // A limit command inside another one stays in its cgroup, whose caps it can't loosen
+    const char *root = in_cgroup ? NULL : var_get("SMASH_CGROUP_ROOT");
+    if (root != NULL && *root == '\0')
+    {
+        root = NULL;
+    }
+    if (root == NULL && (limits.memory_max > 0 || limits.cpus > 0))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
 
-                // Redirect output to given file
-                if ((newfd = open(cmd_args[num_args - 1], O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
-                {
-                    print_error();
-                    exit(1);
-                }
-                dup2(newfd, 1);
-                close(newfd);
+    struct job job;
+    job.id = 0;
+    job.fork_builtins = 1;
+    job.usage = NULL;
+    job.pgid = -1;
+    job.limits = &limits;
+    job.pids = malloc(sizeof(pid_t) * (body->type == PLAN_EXEC ? body->num_stages : 1));
+    if (job.pids == NULL)
+    {
+        return -1;
+    }
+    char path[PATH_MAX];
+    if (root != NULL && (limits.cgroup_fd = cgroup_create(root, &limits, path, sizeof(path))) == -1)
+    {
+        free(job.pids);
+        return -1;
+    }
 
-                // Change command array to eliminate redirection operator & file
-                cmd_args[num_args - 2] = NULL;
+    int ret = body->type == PLAN_EXEC ? start_pipeline(body, &job, -1) : start_subshell(body, &job, STDIN_FILENO);
+    double start = trace_file != NULL ? trace_now() : 0;
+    while (job.num_live > 0)
+    {
+        wait_children(-1);
+    }
+    if (trace_file != NULL)
+    {
+        trace_event("wait", start, trace_now(), 0, NULL, NULL);
+    }
 
-                execv(cmd_args[0], cmd_args);
-                print_error();
-                exit(1);
-            }
-            else
-            {
-                execv(cmd_args[0], cmd_args);
-                print_error();
-                exit(1);
-            }
-        }
+    // A process the job left running keeps the cgroup around
+    if (limits.cgroup_fd != -1)
+    {
+        cgroup_report(limits.cgroup_fd);
+        close(limits.cgroup_fd);
+        rmdir(path);
     }
-    else
+    last_status = job.status;
+    free(job.pids);
+    return ret;
+}
+
+/**
+ * Function: cgroup_create
+ * -----------------------
+ * Creates the cgroup of a limit command under the cgroup root and sets its caps.
+ * The memory and cpu controllers are turned on for the root's children first,
+ * which only works if the root itself has no processes in it.
+ *
+ * root: the directory the cgroup is created in (SMASH_CGROUP_ROOT)
+ *
+ * limits: the caps, of which memory_max and cpus are written to the cgroup
+ *
+ * path: filled in with the cgroup's path, for removing it afterwards
+ *
+ * size: the size of path
+ *
+ * return: the cgroup's directory, opened close-on-exec, or -1 on failure
+ */
+int cgroup_create(const char *root, const struct job_limits *limits, char *path, size_t size)
+{
+    if (limits->memory_max > 0 || limits->cpus > 0)
     {
-        if (waitpid(rc, NULL, 0) == -1)
+        int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd == -1)
         {
             return -1;
         }
-        return 0;
+        cgroup_write(root_fd, "cgroup.subtree_control", "+memory");
+        cgroup_write(root_fd, "cgroup.subtree_control", "+cpu");
+        close(root_fd);
+    }
+    if ((size_t)snprintf(path, size, "%s/smash-%d-%lu", root, (int)getpid(), ++num_cgroups) >= size)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(path, 0755) == -1)
+    {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char value[64];
+    int ok = fd != -1;
+    if (ok && limits->memory_max > 0)
+    {
+        snprintf(value, sizeof(value), "%lld", limits->memory_max);
+        ok = cgroup_write(fd, "memory.max", value) == 0;
+    }
+    if (ok && limits->cpus > 0)
+    {
+        // A quota of CPU time per 100ms period, which the kernel wants to be at least 1ms
+        long long quota = (long long)(limits->cpus * 100000);
+        snprintf(value, sizeof(value), "%lld 100000", quota < 1000 ? 1000 : quota);
+        ok = cgroup_write(fd, "cpu.max", value) == 0;
+    }
+    if (!ok)
+    {
+        int saved_errno = errno;
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        rmdir(path);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Function: cgroup_write
+ * ----------------------
+ * Writes a value to one of the files of a cgroup
+ *
+ * dir_fd: the cgroup's directory
+ *
+ * file: the file, such as "memory.max"
+ *
+ * value: what is written to it
+ *
+ * return: -1 on failure, 0 on success
+ */
+int cgroup_write(int dir_fd, const char *file, const char *value)
+{
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    size_t len = strlen(value);
+    ssize_t n = write(fd, value, len);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * Function: cgroup_read
+ * ---------------------
+ * Reads a number from one of the files of a cgroup: either the whole file
+ * (such as memory.peak) or the line starting with a key (such as "usage_usec"
+ * in cpu.stat)
+ *
+ * dir_fd: the cgroup's directory
+ *
+ * file: the file
+ *
+ * key: the key of the line, or NULL for a file holding just the number
+ *
+ * return: the number, or -1 if the file or key isn't there (e.g. on older kernels)
+ */
+long long cgroup_read(int dir_fd, const char *file, const char *key)
+{
+    char buf[4096];
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+    {
+        return -1;
+    }
+    buf[n] = '\0';
+    if (key == NULL)
+    {
+        return isdigit((unsigned char)buf[0]) ? strtoll(buf, NULL, 10) : -1;
+    }
+    size_t len = strlen(key);
+    char *line = buf;
+    while (line != NULL)
+    {
+        if (strncmp(line, key, len) == 0 && line[len] == ' ')
+        {
+            return strtoll(line + len + 1, NULL, 10);
+        }
+        if ((line = strchr(line, '\n')) != NULL)
+        {
+            line++;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Function: cgroup_report
+ * -----------------------
+ * Prints, on standard error, what the processes of a limit command's cgroup
+ * used between them: CPU time, peak memory and the number of them the OOM
+ * killer took.  Figures the kernel doesn't keep are left out.
+ *
+ * dir_fd: the cgroup's directory
+ */
+void cgroup_report(int dir_fd)
+{
+    long long usage = cgroup_read(dir_fd, "cpu.stat", "usage_usec");
+    long long peak = cgroup_read(dir_fd, "memory.peak", NULL);
+    long long oom_kills = cgroup_read(dir_fd, "memory.events", "oom_kill");
+    const char *sep = " ";
+    fprintf(stderr, "limit:");
+    if (usage != -1)
+    {
+        fprintf(stderr, "%scpu %.6fs", sep, usage / 1e6);
+        sep = "  ";
+    }
+    if (peak != -1)
+    {
+        fprintf(stderr, "%smemory peak %lldKB", sep, peak / 1024);
+        sep = "  ";
+    }
+    if (oom_kills != -1)
+    {
+        fprintf(stderr, "%soom kills %lld", sep, oom_kills);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Function: rusage_add
+ * --------------------
+ * Adds one child's resource usage to a running total.
+ * Times and context switches are summed, the resident set size is the largest seen.
+ *
+ * total: the running total
+ *
+ * ru: the usage to add to it
+ */
+void rusage_add(struct rusage *total, const struct rusage *ru)
+{
+    total->ru_utime.tv_sec += ru->ru_utime.tv_sec;
+    total->ru_utime.tv_usec += ru->ru_utime.tv_usec;
+    if (total->ru_utime.tv_usec >= 1000000)
+    {
+        total->ru_utime.tv_sec++;
+        total->ru_utime.tv_usec -= 1000000;
+    }
+    total->ru_stime.tv_sec += ru->ru_stime.tv_sec;
+    total->ru_stime.tv_usec += ru->ru_stime.tv_usec;
+    if (total->ru_stime.tv_usec >= 1000000)
+    {
+        total->ru_stime.tv_sec++;
+        total->ru_stime.tv_usec -= 1000000;
+    }
+    if (ru->ru_maxrss > total->ru_maxrss)
+    {
+        total->ru_maxrss = ru->ru_maxrss;
     }
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/**
+ * Function: print_usage
+ * ---------------------
+ * Prints one line of the time built-in command's report to standard error
+ *
+ * label: what the line is for ("total" or "stage n")
+ *
+ * real: wall-clock time in seconds
+ *
+ * ru: user and system time, max RSS and context switches
+ *
+ * name: the command the line is for, or NULL
+ */
+void print_usage(const char *label, double real, const struct rusage *ru, const char *name)
+{
+    fprintf(stderr, "%s: real %.6fs  user %.6fs  sys %.6fs  maxrss %ldKB  csw %ld+%ld%s%s\n", label, real,
+            ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6, ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, name == NULL ? "" : "  ", name == NULL ? "" : name);
 }
 
 /**
- * Function: run_loop
- * ------------------
- * Helper function that runs the loop command
+ * Function: elapsed
+ * -----------------
+ * Computes the time between two readings of CLOCK_MONOTONIC
  *
- * args: An array of strings containing the input for the command
+ * start: the earlier reading
+ *
+ * end: the later reading
+ *
+ * return: the difference in seconds
+ */
+double elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Function: percentile
+ * --------------------
+ * Looks up a percentile of sorted samples, using the nearest-rank method
+ *
+ * samples: the samples, sorted in increasing order (there must be at least one)
+ *
+ * p: the percentile, from 1 to 100
+ *
+ * return: the smallest sample that is at least as large as p percent of the samples
+ */
+double percentile(const struct loop_samples *samples, int p)
+{
+    int rank = (samples->num * p + 99) / 100;
+    return samples->secs[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Function: compare_doubles
+ * -------------------------
+ * Comparison function for sorting doubles in increasing order with qsort()
  *
- * num_args: An integer for the number of arguments,
- *           including "loop" and its corresponding loop variable
+ * a: the first double
  *
- * rd: 1 if the command uses redirection, 0 if not
+ * b: the second double
  *
- * pipes: 1 if the command uses pipes, 0 if not
+ * return: negative, zero or positive as a is less than, equal to or greater than b
+ */
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Function: trace_open
+ * --------------------
+ * Turns on tracing (see SMASH_TRACE in main()): the file is truncated and
+ * starts a Chrome trace_event JSON array, which trace_close() ends at exit.
  *
- * line: the input for the entire command
+ * path: the file to write the trace to
  *
  * return: -1 on failure, 0 on success
  */
-int run_loop(char *args[], int num_args, int rd, int pipes, char *line)
+int trace_open(const char *path)
 {
-    if (num_args < 2)
+    // Close-on-exec, so commands don't inherit it
+    if ((trace_file = fopen(path, "we")) == NULL)
     {
         return -1;
     }
-    int loop_var = atoi(args[1]);
-    if (loop_var < 1)
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    trace_pid = getpid();
+    fputs("[\n", trace_file);
+    atexit(trace_close);
+    return 0;
+}
+
+/**
+ * Function: trace_close
+ * ---------------------
+ * Ends the trace's JSON array and flushes it out, when the shell exits
+ */
+void trace_close(void)
+{
+    if (trace_file != NULL && getpid() == trace_pid)
     {
-        return -1;
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
     }
-    for (int i = 0; i < loop_var; i++)
-    {
-        // exit command
-        if (strcmp(args[2], "exit") == 0)
-        {
-            if (num_args > 3)
-            {
-                return -1;
-            }
-            else
-            {
-                exit(0);
-            }
-        }
-
-        // cd command
-        if (strcmp(args[2], "cd") == 0)
-        {
-            if (num_args == 3 || num_args > 4)
-            {
-                return -1;
-            }
-            if (chdir(args[3]) == -1)
-            {
-                return -1;
-            }
-            continue;
-        }
-
-        // pwd command
-        if (strcmp(args[2], "pwd") == 0)
-        {
-            if (num_args > 1)
-            {
-                return -1;
-            }
-            size_t path_size = 16;
-            char *path = malloc(path_size);
-            if (path == NULL)
-            {
-                return -1;
-            }
-            if (run_pwd(&path, &path_size) == -1)
-            {
-                return -1;
-            }
-            printf("%s\n", path);
-            free(path);
-            continue;
-        }
+}
 
-        // Loop command
-        if (strcmp(args[2], "loop") == 0)
-        {
-            run_loop(args + 2, num_args - 2, rd, pipes, line);
-        }
+/**
+ * Function: trace_now
+ * -------------------
+ * Reads the clock for a trace event.  Only called when tracing is on.
+ *
+ * return: microseconds since tracing was turned on
+ */
+double trace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return trace_time(&now);
+}
 
-        // execv() command
-        if (run_exec(line + 7, rd, pipes) == -1)
-        {
-            return -1;
-        }
-    }
-    return 0;
+/**
+ * Function: trace_time
+ * --------------------
+ * Converts a reading of CLOCK_MONOTONIC into a trace timestamp
+ *
+ * ts: the reading
+ *
+ * return: microseconds since tracing was turned on
+ */
+double trace_time(const struct timespec *ts)
+{
+    return elapsed(&trace_epoch, ts) * 1e6;
 }
 
 /**
- * Function: run_mult
- * ------------------
- * Helper function to run in multiple-command mode
+ * Function: trace_event
+ * ---------------------
+ * Writes a complete ("ph":"X") event to the trace.
+ * Events of the shell itself go on the shell's row; events of a child
+ * go on a row of their own, named after the child's pid.
+ *
+ * name: what the span covers ("parse", "spawn", "exec", ...)
+ *
+ * start: when the span started, from trace_now()
  *
- * line: The line containing user input
+ * end: when the span ended, from trace_now()
  *
- * args: An array of strings that will be
- *       filled in each iteration of the commands
+ * pid: the child the span is about, or 0 for the shell itself
  *
- * num_args: An integer of the number of arguments in args
+ * argv: the child's arguments, or NULL
+ *
+ * path: a file the span is about, or NULL
  */
-void run_mult(char *line, char **args, int num_args)
+void trace_event(const char *name, double start, double end, pid_t pid, char **argv, const char *path)
 {
-    char **mult_args;
-    int num_mult_args;
-    if (lexer(line, &mult_args, &num_mult_args, ";") == -1)
-    {
-        print_error();
-        return;
-    }
-
-    if (check_mult_syntax(mult_args, num_mult_args, args, num_args) == -1)
+    fprintf(trace_file,
+            "%s{\"name\":\"%s\",\"cat\":\"smash\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{",
+            trace_empty ? "" : ",\n", name, start, end - start, (int)trace_pid, (int)(pid > 0 ? pid : trace_pid));
+    const char *sep = "";
+    if (pid > 0)
     {
-        print_error();
-        return;
+        fprintf(trace_file, "\"pid\":%d", (int)pid);
+        sep = ",";
     }
-
-    for (int i = 0; i < num_mult_args; i++)
+    if (argv != NULL)
     {
-        int pipes = 0;
-        int rd = 0; // Redirection for each command
-
-        // Check for empty command
-        if (is_empty(mult_args[i]) == 1)
-        {
-            continue;
-        }
-
-        // Check for redirection
-        if (strstr(mult_args[i], ">"))
-        {
-            rd = 1;
-        }
-
-        // Check for pipes
-        if (strstr(line, "|"))
-        {
-            pipes = 1;
-        }
-
-        char *mult_args_copy = malloc(sizeof(char) * strlen(line) + sizeof(NULL));
-        strcpy(mult_args_copy, mult_args[i]);
-
-        // Tokenize input
-        if (lexer(mult_args[i], &args, &num_args, " \t\n") == -1)
-        {
-            print_error();
-            continue;
-        }
-
-        // exit command
-        if (strcmp(args[0], "exit") == 0)
-        {
-            if (num_args > 1)
-            {
-                print_error();
-                continue;
-            }
-            else
-            {
-                free(line);
-                free(args);
-                exit(0);
-            }
-        }
-
-        // cd command
-        if (strcmp(args[0], "cd") == 0)
+        fprintf(trace_file, "%s\"argv\":[", sep);
+        for (int i = 0; argv[i] != NULL; i++)
         {
-            if (num_args == 1 || num_args > 2)
-            {
-                print_error();
-                continue;
-            }
-            if (chdir(args[1]) == -1)
+            if (i > 0)
             {
-                print_error();
+                fputc(',', trace_file);
             }
-            continue;
+            trace_string(argv[i]);
         }
+        fputc(']', trace_file);
+        sep = ",";
+    }
+    if (path != NULL)
+    {
+        fprintf(trace_file, "%s\"path\":", sep);
+        trace_string(path);
+    }
+    fputs("}}", trace_file);
+    trace_empty = 0;
+}
 
-        // pwd command
-        if (strcmp(args[0], "pwd") == 0)
+/**
+ * Function: trace_string
+ * ----------------------
+ * Writes a string to the trace as a JSON string literal
+ *
+ * s: the string
+ */
+void trace_string(const char *s)
+{
+    fputc('"', trace_file);
+    for (; *s != '\0'; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
         {
-            if (num_args > 1)
-            {
-                print_error();
-                continue;
-            }
-            size_t path_size = 16;
-            char *path = malloc(path_size);
-            if (path == NULL)
-            {
-                print_error();
-                continue;
-            }
-            if (run_pwd(&path, &path_size) == -1)
-            {
-                print_error();
-                continue;
-            }
-            printf("%s\n", path);
-            free(path);
-            continue;
+            fputc('\\', trace_file);
+            fputc(c, trace_file);
         }
-
-        // Loop command
-        if (strcmp(args[0], "loop") == 0)
+        else if (c < 0x20)
         {
-            if (run_loop(args, num_args, rd, pipes, mult_args_copy) == -1)
-            {
-                print_error();
-            }
-            continue;
+            fprintf(trace_file, "\\u%04x", c);
         }
-
-        // execv() command
-        if (run_exec(mult_args_copy, rd, pipes) == -1)
+        else
         {
-            print_error();
-            continue;
+            fputc(c, trace_file);
         }
     }
+    fputc('"', trace_file);
 }
 
 /**
- * Function: check_mult_syntax
- * ---------------------------
- * Helper function to determine if there are any syntax errors
- * on the input line that has multiple commands.
+ * Function: trace_job
+ * -------------------
+ * Writes an "exec" event for each stage of a finished job,
+ * covering the time from its spawn until it was reaped
  *
- * mult_args: the array of strings where each element is an entire command w/ arguments
+ * job: the job, whose usage was filled in
  *
- * num_mult_args: the number of elements in mult_args
- *
- * args: the array of strings containing the command-line input (for each command)
+ * plan: the plan the job was started from
+ */
+void trace_job(struct job *job, struct plan *plan)
+{
+    for (int i = 0; i < job->num_pids; i++)
+    {
+        struct stage_usage *u = &job->usage[i];
+        trace_event("exec", trace_time(&u->start), trace_time(&u->end), job->pids[i], plan->stages[u->stage].argv,
+                    NULL);
+    }
+}
+
+/**
+ * Function: check_syntax
+ * ----------------------
+ * Helper function to determine if there are any syntax errors on a parsed line,
+ * so that a line with an error anywhere in it runs none of its commands.
+ * Pipelines with variables in them can only be checked once they're
+ * expanded, which run_list() does.
  *
- * num_args: the number of elements in args
+ * list: the parsed line
  *
  * return: -1 if there are any syntax errors, 0 otherwise
  */
-int check_mult_syntax(char **mult_args, int num_mult_args, char **args, int num_args)
+int check_syntax(struct cmd_list *list)
 {
-    /**
-     * To be honest I don't even know if I need this part,
-     * but am doing it now to be safe anyway.  I don't remember
-     * if dynamically-allocated arrays are pass-by-reference or not.
-     */
-    char **args_tmp = malloc(sizeof(char **) * num_args);
-    for (int i = 0; i < num_args; i++)
+    for (struct pipeline *pl = list->pipelines; pl != NULL; pl = pl->next)
     {
-        args_tmp[i] = malloc(sizeof(char) * strlen(args[i]) + sizeof(NULL));
-        strcpy(args_tmp[i], args[i]);
+        if (!pl->expand && check_pipeline(pl) == -1)
+        {
+            return -1;
+        }
     }
-    int num_args_tmp = num_args;
+    return 0;
+}
 
-    char **mult_args_tmp = malloc(sizeof(char **) * num_mult_args);
-    for (int i = 0; i < num_mult_args; i++)
-    {
-        mult_args_tmp[i] = malloc(sizeof(char) * strlen(mult_args[i]) + sizeof(NULL));
-        strcpy(mult_args_tmp[i], mult_args[i]);
-    }
+/**
+ * Function: check_pipeline
+ * ------------------------
+ * Checks the number of arguments of the built-in commands in a single
+ * pipeline, against the limits in the builtins table.
+ * A loop, time, timeout or limit command at the start covers the whole pipeline, which is
+ * checked the same way (a loop body can't be a built-in command with -j);
+ * further down the pipeline they only cover their own stage.  The affinity,
+ * nice and ioprio prefixes always cover their own stage only.
+ * A command that starts with an assignment must be nothing but assignments.
+ *
+ * pl: the pipeline to check
+ *
+ * return: -1 if there are any syntax errors, 0 otherwise
+ */
+int check_pipeline(struct pipeline *pl)
+{
+    char **args = pl->cmds->argv;
+    int num_args = pl->cmds->argc;
+    enum builtin_id first = lookup_builtin(args[0]);
 
-    for (int i = 0; i < num_mult_args; i++)
+    // Loop command
+    if (first == BUILTIN_LOOP)
     {
-        int rd = 0; // Redirection for each command
-        int pipes = 0;
-
-        // Check for empty command
-        if (is_empty(mult_args_tmp[i]) == 1)
-        {
-            continue;
-        }
-
-        // Check for redirection
-        if (strstr(mult_args_tmp[i], ">"))
+        int count, jobs, buffered;
+        int skip = parse_loop(pl->cmds, &count, &jobs, &buffered);
+        if (skip == -1)
         {
-            rd = 1;
+            return -1;
         }
+        struct pipeline body;
+        struct command body_cmd;
+        loop_body(pl, skip, &body, &body_cmd);
 
-        // Check for pipes
-        if (strstr(mult_args_tmp[i], "|"))
+        // Only external commands can run side by side
+        struct stage_sched sched;
+        int prefixes = parse_sched(NULL, &body_cmd, &sched);
+        if (prefixes == -1 || (jobs > 1 && lookup_builtin(body_cmd.argv[prefixes]) != BUILTIN_NONE))
         {
-            pipes = 1;
+            return -1;
         }
+        return check_pipeline(&body);
+    }
 
-        // Tokenize input
-        if (lexer(mult_args_tmp[i], &args_tmp, &num_args_tmp, " \t\n") == -1)
+    // Time command
+    if (first == BUILTIN_TIME)
+    {
+        if (num_args < 2)
         {
             return -1;
         }
+        struct pipeline body;
+        struct command body_cmd;
+        loop_body(pl, 1, &body, &body_cmd);
+        return check_pipeline(&body);
+    }
 
-        // exit command
-        if (strcmp(args_tmp[0], "exit") == 0)
+    // Timeout command
+    if (first == BUILTIN_TIMEOUT)
+    {
+        double secs, kill_after;
+        int sig;
+        int skip = parse_timeout(pl->cmds, &secs, &sig, &kill_after);
+        if (skip == -1)
         {
-            if (num_args_tmp > 1)
-            {
-                return -1;
-            }
-            continue;
+            return -1;
         }
+        struct pipeline body;
+        struct command body_cmd;
+        loop_body(pl, skip, &body, &body_cmd);
+        return check_pipeline(&body);
+    }
 
-        // cd command
-        if (strcmp(args_tmp[0], "cd") == 0)
+    // Limit command
+    if (first == BUILTIN_LIMIT)
+    {
+        struct job_limits limits;
+        int skip = parse_limit(pl->cmds, &limits);
+        if (skip == -1)
         {
-            if (num_args_tmp == 1 || num_args_tmp > 2)
-            {
-                return -1;
-            }
-            continue;
+            return -1;
         }
+        struct pipeline body;
+        struct command body_cmd;
+        loop_body(pl, skip, &body, &body_cmd);
+        return check_pipeline(&body);
+    }
 
-        // pwd command
-        if (strcmp(args_tmp[0], "pwd") == 0)
+    for (struct command *cmd = pl->cmds; cmd != NULL; cmd = cmd->next)
+    {
+        // The stage's own command comes after its affinity, nice and ioprio prefixes
+        struct stage_sched sched;
+        int prefixes = parse_sched(NULL, cmd, &sched);
+        if (prefixes == -1)
         {
-            if (num_args_tmp > 1)
-            {
-                return -1;
-            }
-            continue;
+            return -1;
         }
-
-        // Loop command
-        if (strcmp(args_tmp[0], "loop") == 0)
+        const struct builtin *b = find_builtin(cmd->argv[prefixes]);
+        if (b == NULL)
         {
-            if (num_args_tmp < 2)
-            {
-                return -1;
-            }
-            int loop_var = atoi(args_tmp[1]);
-            if (loop_var < 1)
+            // Assignments can't be followed by a command
+            if (is_assignment(cmd->argv[prefixes]))
             {
-                return -1;
+                for (int i = prefixes + 1; i < cmd->argc; i++)
+                {
+                    if (!is_assignment(cmd->argv[i]))
+                    {
+                        return -1;
+                    }
+                }
             }
             continue;
         }
-
-        // execv() command
-        if (rd)
+        if (b->id == BUILTIN_LOOP || b->id == BUILTIN_TIME || b->id == BUILTIN_TIMEOUT || b->id == BUILTIN_LIMIT)
         {
-            // Check for empty command
-            if (strcmp(args_tmp[0], ">") == 0)
-            {
-                return -1;
-            }
-
-            // Check for more than one ">"
-            int n = 0;
-            for (int i = 0; i < num_args_tmp; i++)
-            {
-                if (strcmp(args_tmp[i], ">") == 0)
-                {
-                    n++;
-                }
-            }
-            if (n > 1)
-            {
-                return -1;
-            }
-
-            // Check for ">" being second-to-last argument
-            if (strcmp(args_tmp[num_args_tmp - 2], ">") != 0)
+            struct pipeline single = *pl;
+            struct command single_cmd = *cmd;
+            single_cmd.argv += prefixes;
+            single_cmd.argc -= prefixes;
+            single_cmd.next = NULL;
+            single.cmds = &single_cmd;
+            single.num_cmds = 1;
+            if (check_pipeline(&single) == -1)
             {
                 return -1;
             }
         }
-        if (pipes)
+        else if (cmd->argc - prefixes < b->min_args || (b->max_args != -1 && cmd->argc - prefixes > b->max_args))
         {
-            // Check for empty command
-            if (strcmp(args_tmp[0], "|") == 0)
-            {
-                return -1;
-            }
-
-            // Check for receiving end of pipe missing
-            if (strcmp(args_tmp[num_args - 1], "|") == 0)
-            {
-                return -1;
-            }
-
-            // Check for empty pipe
-            for (int i = 1; i < num_args_tmp; i++)
-            {
-                if (strcmp(args_tmp[i - 1], "|") == 0 && strcmp(args_tmp[i], "|") == 0)
-                {
-                    return -1;
-                }
-            }
+            return -1;
         }
     }
     return 0;
-}
\ No newline at end of file
+}